@@ -0,0 +1,89 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file arena.c
+ * \brief Arena of page-aligned buffers (see arena.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#define ARENA_HUGE_PAGE_SIZE (2u * 1024 * 1024)
+
+int arena_flags;
+
+static size_t round_up(size_t value, size_t unit)
+{
+    return (value + unit - 1) / unit * unit;
+}
+
+/* count buffers of at least buffer_size bytes; NULL if there is no memory */
+struct page_arena *arena_create(size_t buffer_size, unsigned int count, int flags)
+{
+    struct page_arena *arena = calloc(1, sizeof(*arena));
+    void *base = MAP_FAILED;
+
+    if( arena == NULL )
+        return NULL;
+    arena->buffer_size = round_up(buffer_size, ARENA_ALIGN);
+    arena->count = count;
+    arena->mapped = arena->buffer_size * count;
+
+    if( flags & ARENA_HUGE_PAGES )
+    {
+        size_t huge_length = round_up(arena->mapped, ARENA_HUGE_PAGE_SIZE);
+
+        base = mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if( base != MAP_FAILED )
+        {
+            arena->mapped = huge_length;
+            arena->huge = 1;
+        }
+    }
+    if( base == MAP_FAILED )
+    {
+        base = mmap(NULL, arena->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if( base == MAP_FAILED )
+        {
+            fprintf(stderr, "Failed to map %zu bytes of page buffers.\n", arena->mapped);
+            free(arena);
+            return NULL;
+        }
+        /* no reserved huge pages: let the kernel collapse the mapping if it can */
+        if( flags & ARENA_HUGE_PAGES )
+            madvise(base, arena->mapped, MADV_HUGEPAGE);
+    }
+    arena->base = base;
+    return arena;
+}
+
+unsigned char *arena_buffer(const struct page_arena *arena, unsigned int index)
+{
+    return arena->base + (size_t)index * arena->buffer_size;
+}
+
+void arena_destroy(struct page_arena *arena)
+{
+    if( arena == NULL )
+        return;
+    munmap(arena->base, arena->mapped);
+    free(arena);
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file arena.h
+ * \brief Arena of page-aligned buffers
+ * One anonymous mapping holds a fixed number of equally sized buffers, each
+ * starting on a memory page boundary, so they can be handed to O_DIRECT
+ * writes as they are. With ARENA_HUGE_PAGES the mapping is backed by huge
+ * pages if the system has them reserved, and otherwise marked for
+ * transparent huge pages.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN      4096 /* buffer alignment, also the O_DIRECT block size */
+#define ARENA_HUGE_PAGES 0x01
+
+struct page_arena
+{
+    unsigned char *base;
+    size_t mapped;        /* length of the mapping */
+    size_t buffer_size;   /* stride between buffers, a multiple of ARENA_ALIGN */
+    unsigned int count;
+    int huge;             /* backed by reserved huge pages */
+};
+
+extern int arena_flags; /* flags for the arenas of the dump paths */
+
+struct page_arena *arena_create(size_t buffer_size, unsigned int count, int flags);
+unsigned char *arena_buffer(const struct page_arena *arena, unsigned int index);
+void arena_destroy(struct page_arena *arena);
+
+#endif /* ARENA_H */
@@ -0,0 +1,304 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \file bbt.c
+ * \brief On-flash bad block table in the Linux MTD format (see bbt.h)
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nand.h"
+#include "bbt.h"
+
+static const unsigned char bbt_patterns[2][4] = { { 'B', 'b', 't', '0' }, { '1', 't', 'b', 'B' } };
+static const char *bbt_names[2] = { "table", "mirror" };
+
+/* 2 bits per block on flash */
+static unsigned int bbt_length(unsigned int blocks)
+{
+    return (blocks * 2 + 7) / 8;
+}
+
+static unsigned int bbt_pages(unsigned int blocks)
+{
+    return (bbt_length(blocks) + nand_geometry.page_size - 1) / nand_geometry.page_size;
+}
+
+/* a table with every block good, for a job without a table of the chip */
+int bbt_init(struct bad_block_table *bbt)
+{
+    memset(bbt, 0, sizeof(*bbt));
+    bbt->blocks = nand_geometry.blocks;
+    bbt->block[0] = bbt->block[1] = -1;
+    bbt->state = calloc(bbt->blocks ? bbt->blocks : 1, 1);
+    return bbt->state ? 0 : EXIT_FAILURE;
+}
+
+/* the block among the last ones whose first page carries the signature of the
+ * table (which: 0) or of the mirror (1), and its version; -1 if there is none */
+static int bbt_search(int which, unsigned char *version, unsigned char *spare)
+{
+    for(unsigned int k = 0; k < BBT_SEARCH_BLOCKS && k < nand_geometry.blocks; k++)
+    {
+        unsigned int block = nand_geometry.blocks - 1 - k;
+
+        if( read_page_part(block * nand_geometry.pages_per_block, nand_geometry.page_size, spare,
+                nand_geometry.spare_size) != 0 )
+            continue;
+        if( memcmp(spare + BBT_PATTERN_OFFSET, bbt_patterns[which], sizeof(bbt_patterns[which])) == 0 )
+        {
+            *version = spare[BBT_VERSION_OFFSET];
+            return (int)block;
+        }
+    }
+    return -1;
+}
+
+/* 11: good, 00: factory bad (or reserved), anything else: worn out */
+static int bbt_read_table(struct bad_block_table *bbt, unsigned int block)
+{
+    unsigned int page_size = nand_geometry.page_size;
+    unsigned int pages = bbt_pages(bbt->blocks);
+    unsigned char *table = malloc((size_t)pages * page_size);
+
+    if( table == NULL )
+        return EXIT_FAILURE;
+    for(unsigned int k = 0; k < pages; k++)
+        if( read_page_part(block * nand_geometry.pages_per_block + k, 0, table + (size_t)k * page_size,
+                page_size) != 0 )
+        {
+            free(table);
+            return EXIT_FAILURE;
+        }
+    for(unsigned int b = 0; b < bbt->blocks; b++)
+    {
+        unsigned int code = (table[b / 4] >> (2 * (b % 4))) & 0x03;
+
+        bbt->state[b] = code == 0x03 ? BBT_BLOCK_GOOD : code == 0x00 ? BBT_BLOCK_FACTORY_BAD : BBT_BLOCK_WORN;
+    }
+    free(table);
+    return 0;
+}
+
+/* finds the table and its mirror and reads the newer one; EXIT_FAILURE if the
+ * chip has no readable table */
+int bbt_read(struct bad_block_table *bbt)
+{
+    unsigned char *spare = malloc(nand_geometry.spare_size);
+    unsigned char version[2] = { 0, 0 };
+    int first;
+
+    if( spare == NULL || nand_geometry.spare_size <= BBT_VERSION_OFFSET || bbt_init(bbt) != 0 )
+    {
+        free(spare);
+        return EXIT_FAILURE;
+    }
+    for(int which = 0; which < 2; which++)
+        bbt->block[which] = bbt_search(which, &version[which], spare);
+    free(spare);
+
+    /* the version byte wraps around: the newer copy is ahead by less than 128 */
+    first = bbt->block[0] < 0 || (bbt->block[1] >= 0 && (int8_t)(version[1] - version[0]) > 0);
+    for(int k = 0; k < 2; k++)
+    {
+        int which = k ? !first : first;
+
+        if( bbt->block[which] < 0 || bbt_read_table(bbt, bbt->block[which]) != 0 )
+            continue;
+        bbt->version = version[which];
+        bbt->from_flash = 1;
+        /* like nand_bbt.c: the search area belongs to the tables, worn out blocks stay so */
+        for(unsigned int n = 0; n < BBT_SEARCH_BLOCKS && n < bbt->blocks; n++)
+            if( bbt->state[bbt->blocks - 1 - n] != BBT_BLOCK_WORN )
+                bbt->state[bbt->blocks - 1 - n] = BBT_BLOCK_RESERVED;
+        return 0;
+    }
+    bbt_free(bbt);
+    return EXIT_FAILURE;
+}
+
+/* the map from the factory bad block markers of every block. The search area
+ * is reserved right away, so a job programming the chip before the table is
+ * written leaves those blocks alone */
+int bbt_scan(struct bad_block_table *bbt)
+{
+    if( bbt_init(bbt) != 0 )
+        return EXIT_FAILURE;
+    printf("Scanning %u blocks for factory bad block markers...\n", bbt->blocks);
+    for(unsigned int block = 0; block < bbt->blocks; block++)
+        if( is_factory_bad_block(block) )
+            bbt->state[block] = BBT_BLOCK_FACTORY_BAD;
+    for(unsigned int k = 0; k < BBT_SEARCH_BLOCKS && k < bbt->blocks; k++)
+        if( bbt->state[bbt->blocks - 1 - k] == BBT_BLOCK_GOOD )
+            bbt->state[bbt->blocks - 1 - k] = BBT_BLOCK_RESERVED;
+    return 0;
+}
+
+/* the on-flash table if there is one, a marker scan otherwise */
+int bbt_load(struct bad_block_table *bbt)
+{
+    if( bbt_read(bbt) == 0 )
+    {
+        printf("Bad block table version %u found in block %d", bbt->version,
+            bbt->block[0] >= 0 ? bbt->block[0] : bbt->block[1]);
+        if( bbt->block[0] >= 0 && bbt->block[1] >= 0 )
+            printf(" (mirror in block %d)", bbt->block[1]);
+        printf(".\n");
+        return 0;
+    }
+    return bbt_scan(bbt);
+}
+
+/* one copy of the table into block: erase, then the table pages with the
+ * signature and version in the spare area of the first one */
+static int bbt_write_copy(const struct bad_block_table *bbt, int which, unsigned int block, unsigned char version)
+{
+    unsigned int page_size = nand_geometry.page_size;
+    unsigned int length = bbt_length(bbt->blocks);
+    unsigned char *page = malloc(nand_page_size_total());
+    int ret = 0;
+
+    if( page == NULL || erase_block(block) != 0 )
+    {
+        free(page);
+        return EXIT_FAILURE;
+    }
+    for(unsigned int k = 0; k < bbt_pages(bbt->blocks) && ret == 0; k++)
+    {
+        memset(page, 0xFF, nand_page_size_total());
+        for(unsigned int n = k * page_size; n < length && n < (k + 1) * page_size; n++)
+            for(unsigned int b = 4 * n; b < 4 * n + 4 && b < bbt->blocks; b++)
+            {
+                /* the reserved blocks are stored like factory bad ones, as nand_bbt.c does */
+                unsigned int code = bbt->state[b] == BBT_BLOCK_GOOD ? 0x03
+                    : bbt->state[b] == BBT_BLOCK_WORN ? 0x02 : 0x00;
+
+                page[n - k * page_size] &= ~((~code & 0x03) << (2 * (b % 4)));
+            }
+        if( k == 0 )
+        {
+            memcpy(page + page_size + BBT_PATTERN_OFFSET, bbt_patterns[which], sizeof(bbt_patterns[which]));
+            page[page_size + BBT_VERSION_OFFSET] = version;
+        }
+        nand_ecc_page(page);
+        ret = program_page(block * nand_geometry.pages_per_block + k, page);
+    }
+    free(page);
+    return ret;
+}
+
+/* writes the table and the mirror with the next version, into the blocks they
+ * were read from or into the last good blocks of the chip; a block that fails
+ * is marked worn out and the next one is tried */
+int bbt_write(struct bad_block_table *bbt)
+{
+    unsigned char version = bbt->version + 1;
+    int written = 0;
+
+    if( nand_geometry.spare_size <= BBT_VERSION_OFFSET )
+    {
+        fprintf(stderr, "The spare area is too small for a bad block table.\n");
+        return EXIT_FAILURE;
+    }
+    /* both copies list the whole search area as reserved */
+    for(unsigned int k = 0; k < BBT_SEARCH_BLOCKS && k < bbt->blocks; k++)
+        if( bbt->state[bbt->blocks - 1 - k] == BBT_BLOCK_GOOD )
+            bbt->state[bbt->blocks - 1 - k] = BBT_BLOCK_RESERVED;
+    for(int which = 0; which < 2; which++)
+    {
+        int block = -1;
+
+        if( bbt->block[which] >= 0 )
+        {
+            if( bbt_write_copy(bbt, which, bbt->block[which], version) == 0 )
+                block = bbt->block[which];
+            else
+                bbt->state[bbt->block[which]] = BBT_BLOCK_WORN;
+        }
+        for(unsigned int k = 0; block < 0 && k < BBT_SEARCH_BLOCKS && k < bbt->blocks; k++)
+        {
+            unsigned int candidate = bbt->blocks - 1 - k;
+
+            /* reserved blocks read from a table look factory bad, so ask the marker */
+            if( (int)candidate == bbt->block[!which] || bbt->state[candidate] == BBT_BLOCK_WORN
+                || is_factory_bad_block(candidate) )
+                continue;
+            if( bbt_write_copy(bbt, which, candidate, version) == 0 )
+                block = (int)candidate;
+            else
+                bbt->state[candidate] = BBT_BLOCK_WORN;
+        }
+        bbt->block[which] = block;
+        if( block < 0 )
+        {
+            fprintf(stderr, "No block left for the bad block %s.\n", bbt_names[which]);
+            continue;
+        }
+        bbt->state[block] = BBT_BLOCK_RESERVED;
+        written++;
+    }
+    if( written == 0 )
+        return EXIT_FAILURE;
+    bbt->version = version;
+    printf("Bad block table version %u written to block %d", version,
+        bbt->block[0] >= 0 ? bbt->block[0] : bbt->block[1]);
+    if( bbt->block[0] >= 0 && bbt->block[1] >= 0 )
+        printf(" (mirror in block %d)", bbt->block[1]);
+    printf(".\n");
+    return 0;
+}
+
+/* worn out, factory bad and reserved blocks are all off limits */
+int bbt_is_bad(const struct bad_block_table *bbt, unsigned int block)
+{
+    return block < bbt->blocks && bbt->state[block] != BBT_BLOCK_GOOD;
+}
+
+void bbt_mark(struct bad_block_table *bbt, unsigned int block, int state)
+{
+    if( block < bbt->blocks )
+        bbt->state[block] = (unsigned char)state;
+}
+
+/* takes a block that failed an erase or program out of service: worn out in
+ * the table, and the bad block marker on the chip for readers without it */
+int bbt_retire(struct bad_block_table *bbt, unsigned int block)
+{
+    int ret;
+
+    bbt_mark(bbt, block, BBT_BLOCK_WORN);
+    ret = mark_bad_block(block);
+    printf("Block %u retired%s.\n", block, ret ? ", but the bad block marker could not be written" : "");
+    return ret;
+}
+
+unsigned int bbt_count(const struct bad_block_table *bbt, int state)
+{
+    unsigned int count = 0;
+
+    for(unsigned int block = 0; block < bbt->blocks; block++)
+        count += bbt->state[block] == state;
+    return count;
+}
+
+void bbt_free(struct bad_block_table *bbt)
+{
+    free(bbt->state);
+    bbt->state = NULL;
+    bbt->blocks = 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \file bbt.h
+ * \brief On-flash bad block table in the Linux MTD format
+ * Linux keeps the bad block map of a chip in the flash itself, as nand_bbt.c
+ * lays it out by default for large page chips: 2 bits per block (11 good,
+ * 10 worn out, 00 factory bad or reserved), in the data area of the first
+ * page(s) of one of the last BBT_SEARCH_BLOCKS blocks, and a mirror copy in
+ * another one. The spare area of the first page of a table carries the
+ * signature ("Bbt0" for the table, "1tbB" for the mirror) and a version byte;
+ * the newer copy counts. Finding the table takes one spare area read per
+ * block searched, and reading it a page or two, instead of a marker scan of
+ * the whole chip. The blocks at the end of the chip are reserved for the
+ * tables. Tables are written with the software Hamming ECC (NAND_ECC_SOFT)
+ * in the spare area, so the kernel reads them back without ECC errors.
+ * A block that fails an erase or program is retired (bbt_retire()): it is
+ * marked worn in the table and gets the factory marker in its spare area.
+ */
+
+#ifndef BBT_H
+#define BBT_H
+
+#define BBT_SEARCH_BLOCKS  4  /* blocks at the end of the chip that may hold a table */
+#define BBT_PATTERN_OFFSET 8  /* of the signature in the spare area */
+#define BBT_VERSION_OFFSET 12
+
+/* states of a block, with the values nand_bbt.c uses in memory */
+enum { BBT_BLOCK_GOOD = 0, BBT_BLOCK_WORN, BBT_BLOCK_RESERVED, BBT_BLOCK_FACTORY_BAD };
+
+struct bad_block_table
+{
+    unsigned char *state;   /* BBT_BLOCK_* of every block */
+    unsigned int blocks;
+    int block[2];           /* block of the table and of the mirror, -1: none */
+    unsigned char version;  /* of the table read or written last */
+    int from_flash;         /* read from a table, not scanned */
+};
+
+int bbt_init(struct bad_block_table *bbt);
+int bbt_read(struct bad_block_table *bbt);
+int bbt_scan(struct bad_block_table *bbt);
+int bbt_load(struct bad_block_table *bbt);
+int bbt_write(struct bad_block_table *bbt);
+int bbt_is_bad(const struct bad_block_table *bbt, unsigned int block);
+void bbt_mark(struct bad_block_table *bbt, unsigned int block, int state);
+int bbt_retire(struct bad_block_table *bbt, unsigned int block);
+unsigned int bbt_count(const struct bad_block_table *bbt, int state);
+void bbt_free(struct bad_block_table *bbt);
+
+#endif /* BBT_H */
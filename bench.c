@@ -0,0 +1,690 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file bench.c
+ * \brief Benchmark of the NAND bus operations against the simulated reader
+ * Runs the standard workloads through the real bus code for every simulated
+ * USB profile and reports throughput and USB transfers per page (or per
+ * operation), together with the number of bus timing violations the chip
+ * model detected. All times are virtual, so the numbers are deterministic and
+ * can be compared against a saved baseline:
+ *
+ *   nand_bench -b baseline.txt   save results
+ *   nand_bench -c baseline.txt   fail if throughput dropped or transfers grew
+ *   nand_bench -f                cost of the recovery paths under injected faults
+ *   nand_bench -j                overshoot of usleep() and rt_wait_us() with and without
+ *                                the real-time options (-R, -L, -A)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nand.h"
+#include "nand_sim.h"
+#include "nand_op.h"
+#include "postproc.h"
+#include "output.h"
+#include "delta.h"
+#include "rt.h"
+
+#define BENCH_BLOCKS        16
+#define BENCH_PROGRAM_PAGES 128
+#define BENCH_RANGE_FIRST   64
+#define BENCH_RANGE_PAGES   128
+#define BENCH_ID_READS      16
+
+#define BENCH_MAX_RESULTS   64
+
+#define BENCH_JITTER_SAMPLES  1000
+#define BENCH_JITTER_PRIORITY 50 /* SCHED_FIFO priority if -j is given without -R */
+
+struct bench_result
+{
+    char backend[32];
+    char workload[32];
+    uint64_t units;     /* pages, blocks or operations */
+    uint64_t bytes;
+    uint64_t time_ns;
+    uint64_t transfers;
+    uint64_t violations; /* bus timing violations */
+};
+
+struct bench_workload
+{
+    const char *name;
+    int (*run)(uint64_t *units, uint64_t *bytes); /* returns the number of failed units */
+};
+
+struct bench_fault_scenario
+{
+    const char *name;
+    sim_fault_t fault; /* SIM_FAULT_COUNT: no fault */
+    double rate;
+};
+
+static const unsigned char bench_ID_register[5] = { 0xAD, 0xDC, 0x10, 0x95, 0x54 };
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static unsigned int results_count;
+static int timing_details; /* -v: report every timing violation */
+
+/* deterministic page content, different for every page */
+static void bench_page_data(unsigned int nPageId, unsigned char *data)
+{
+    uint32_t state = 0x12345678u ^ (nPageId * 2654435761u);
+
+    for(unsigned int k = 0; k < nand_page_size_total(); k++)
+    {
+        state = state * 1664525u + 1013904223u;
+        data[k] = (unsigned char)(state >> 24);
+    }
+}
+
+static int workload_id_read(uint64_t *units, uint64_t *bytes)
+{
+    unsigned char ID_register[5];
+
+    for(unsigned int k = 0; k < BENCH_ID_READS; k++)
+    {
+        read_ID_register(ID_register);
+        if( memcmp(ID_register, bench_ID_register, sizeof(ID_register)) != 0 )
+            return 1;
+    }
+    *units = BENCH_ID_READS;
+    *bytes = BENCH_ID_READS * sizeof(ID_register);
+    return 0;
+}
+
+static int workload_program(uint64_t *units, uint64_t *bytes)
+{
+    unsigned char *data = malloc(nand_page_size_total());
+    int ret = 0;
+
+    if( data == NULL )
+        return 1;
+    for(unsigned int k = 0; k < BENCH_PROGRAM_PAGES; k++)
+    {
+        bench_page_data(k, data);
+        ret += program_page(k, data) != 0;
+    }
+    free(data);
+
+    *units = BENCH_PROGRAM_PAGES;
+    *bytes = (uint64_t)BENCH_PROGRAM_PAGES * nand_page_size_total();
+    return ret;
+}
+
+static int workload_verify(uint64_t *units, uint64_t *bytes)
+{
+    unsigned char *data = malloc(nand_page_size_total());
+    int ret = 0;
+
+    if( data == NULL )
+        return 1;
+    for(unsigned int k = 0; k < BENCH_PROGRAM_PAGES; k++)
+    {
+        bench_page_data(k, data);
+        ret += verify_page(k, data) != 0;
+    }
+    free(data);
+
+    *units = BENCH_PROGRAM_PAGES;
+    *bytes = (uint64_t)BENCH_PROGRAM_PAGES * nand_page_size_total();
+    return ret;
+}
+
+static int bench_dump(unsigned int nFirstPageId, unsigned int nPages, uint64_t *units, uint64_t *bytes)
+{
+    FILE *fp = fopen("/dev/null", "w");
+    uint64_t failures = nand_errors.failures;
+    int ret;
+
+    if( fp == NULL )
+        return 1;
+    ret = dump_memory_range(fp, nFirstPageId, nPages);
+    fclose(fp);
+
+    *units = nPages;
+    *bytes = (uint64_t)nPages * nand_page_size_total();
+    if( ret != 0 && nand_errors.failures != failures )
+        return (int)(nand_errors.failures - failures); /* pages that could not be read */
+    return ret;
+}
+
+static int workload_full_dump(uint64_t *units, uint64_t *bytes)
+{
+    return bench_dump(0, nand_pages_total(), units, bytes);
+}
+
+static int workload_range_dump(uint64_t *units, uint64_t *bytes)
+{
+    return bench_dump(BENCH_RANGE_FIRST, BENCH_RANGE_PAGES, units, bytes);
+}
+
+/* the range dump as resumable operations, all queued on one executor */
+static int workload_op_read(uint64_t *units, uint64_t *bytes)
+{
+    struct nand_executor executor;
+    struct nand_op *ops = malloc(BENCH_RANGE_PAGES * sizeof(*ops));
+    unsigned char *data = malloc((size_t)BENCH_RANGE_PAGES * nand_page_size_total());
+    int ret;
+
+    if( ops == NULL || data == NULL )
+    {
+        free(ops);
+        free(data);
+        return 1;
+    }
+
+    nand_executor_init(&executor);
+    for(unsigned int k = 0; k < BENCH_RANGE_PAGES; k++)
+    {
+        nand_op_read_page(&ops[k], BENCH_RANGE_FIRST + k, 0,
+            data + (size_t)k * nand_page_size_total(), nand_page_size_total());
+        nand_executor_submit(&executor, &ops[k]);
+    }
+    ret = (int)nand_executor_run(&executor, 1);
+    free(ops);
+    free(data);
+
+    *units = BENCH_RANGE_PAGES;
+    *bytes = (uint64_t)BENCH_RANGE_PAGES * nand_page_size_total();
+    return ret;
+}
+
+/* the range dump with digests computed on the worker pool, image written
+ * by the asynchronous writer */
+static int pool_dump(int stages, uint64_t *units, uint64_t *bytes)
+{
+    FILE *fp = fopen("/dev/null", "w");
+    FILE *packed = (stages & POSTPROC_COMPRESS) ? fopen("/dev/null", "w") : NULL;
+    struct dump_output *image = output_open("/dev/null", OUTPUT_ASYNC);
+    struct postproc *pp = NULL;
+    int ret;
+
+    if( fp && image && (packed || !(stages & POSTPROC_COMPRESS)) )
+        pp = postproc_create(0, stages, image, fp, packed);
+    if( pp == NULL )
+    {
+        if( fp )
+            fclose(fp);
+        if( packed )
+            fclose(packed);
+        if( image )
+            output_close(image);
+        return 1;
+    }
+    ret = postproc_dump_range(pp, BENCH_RANGE_FIRST, BENCH_RANGE_PAGES);
+    ret |= postproc_finish(pp, NULL);
+    ret |= output_close(image);
+    fclose(fp);
+    if( packed )
+        fclose(packed);
+
+    *units = BENCH_RANGE_PAGES;
+    *bytes = (uint64_t)BENCH_RANGE_PAGES * nand_page_size_total();
+    return ret;
+}
+
+static int workload_pool_dump(uint64_t *units, uint64_t *bytes)
+{
+    return pool_dump(POSTPROC_HASH, units, bytes);
+}
+
+/* the same with every stage fused into the pass over the pages */
+static int workload_fused_dump(uint64_t *units, uint64_t *bytes)
+{
+    return pool_dump(POSTPROC_HASH | POSTPROC_ECC | POSTPROC_ENTROPY | POSTPROC_COMPRESS, units, bytes);
+}
+
+/* an image of the range as the program workload left it, in a temporary file
+ * (path: a mkstemp() template); every 16th page differs by a bitflip, as if
+ * it had changed since */
+static int bench_previous_image(char *path)
+{
+    unsigned int page_size = nand_page_size_total();
+    unsigned char *data = malloc(page_size);
+    FILE *fp = NULL;
+    int fd, ret = 0;
+
+    fd = mkstemp(path);
+    if( fd >= 0 )
+        fp = fdopen(fd, "w");
+    if( data == NULL || fp == NULL )
+    {
+        if( fd >= 0 )
+        {
+            fp ? fclose(fp) : close(fd);
+            unlink(path);
+        }
+        free(data);
+        return 1;
+    }
+    for(unsigned int k = BENCH_RANGE_FIRST; k < BENCH_RANGE_FIRST + BENCH_RANGE_PAGES; k++)
+    {
+        if( k < BENCH_PROGRAM_PAGES )
+            bench_page_data(k, data);
+        else
+            memset(data, 0xFF, page_size);
+        if( k % 16 == 0 )
+            data[page_size - 1] ^= 0x01;
+        ret += fwrite(data, page_size, 1, fp) != 1;
+    }
+    ret += fclose(fp) != 0;
+    free(data);
+    if( ret )
+        unlink(path);
+    return ret;
+}
+
+/* the range dump against the previous image */
+static int workload_oob_redump(uint64_t *units, uint64_t *bytes)
+{
+    char previous_path[] = "/tmp/nand_bench_XXXXXX";
+    const char *path = output_path;
+    int flags = output_flags;
+    int ret;
+
+    if( bench_previous_image(previous_path) != 0 )
+        return 1;
+    output_path = "/dev/null";
+    output_flags = 0;
+    ret = dump_memory_incremental(BENCH_RANGE_FIRST, BENCH_RANGE_PAGES, previous_path);
+    output_path = path;
+    output_flags = flags;
+    unlink(previous_path);
+
+    *units = BENCH_RANGE_PAGES;
+    *bytes = (uint64_t)BENCH_RANGE_PAGES * nand_page_size_total();
+    return ret;
+}
+
+/* the range dump on the worker pool, stored as a delta against the previous
+ * image instead of the image */
+static int workload_delta_dump(uint64_t *units, uint64_t *bytes)
+{
+    char base_path[] = "/tmp/nand_bench_XXXXXX";
+    struct delta_base *base;
+    struct postproc *pp = NULL;
+    FILE *fp;
+    int ret = 1;
+
+    if( bench_previous_image(base_path) != 0 )
+        return 1;
+    base = delta_base_open(base_path, nand_page_size_total());
+    unlink(base_path);
+    fp = fopen("/dev/null", "w");
+    if( base && fp )
+        pp = postproc_create(0, POSTPROC_HASH, NULL, NULL, NULL);
+    if( pp && postproc_add_delta(pp, base, fp) == 0 )
+        ret = postproc_dump_range(pp, BENCH_RANGE_FIRST, BENCH_RANGE_PAGES);
+    if( pp && postproc_finish(pp, NULL) != 0 )
+        ret = 1;
+    if( fp )
+        fclose(fp);
+    delta_base_close(base);
+
+    *units = BENCH_RANGE_PAGES;
+    *bytes = (uint64_t)BENCH_RANGE_PAGES * nand_page_size_total();
+    return ret;
+}
+
+static int workload_erase(uint64_t *units, uint64_t *bytes)
+{
+    int ret = 0;
+
+    for(unsigned int k = 0; k < nand_geometry.blocks; k++)
+        ret += erase_block(k) != 0;
+
+    *units = nand_geometry.blocks;
+    *bytes = (uint64_t)nand_pages_total() * nand_page_size_total();
+    return ret;
+}
+
+static const struct bench_workload workloads[] =
+{
+    { "id-read",    workload_id_read },
+    { "program",    workload_program },
+    { "verify",     workload_verify },
+    { "full-dump",  workload_full_dump },
+    { "range-dump", workload_range_dump },
+    { "op-read",    workload_op_read },
+    { "pool-dump",  workload_pool_dump },
+    { "fused-dump", workload_fused_dump },
+    { "oob-redump", workload_oob_redump },
+    { "delta-dump", workload_delta_dump },
+    { "erase",      workload_erase },
+};
+
+/* workloads measured under faults; the none scenario is the reference */
+static const struct bench_workload fault_workloads[] =
+{
+    { "program",    workload_program },
+    { "verify",     workload_verify },
+    { "range-dump", workload_range_dump },
+    { "op-read",    workload_op_read },
+    { "erase",      workload_erase },
+};
+
+static const struct bench_fault_scenario fault_scenarios[] =
+{
+    { "none",         SIM_FAULT_COUNT,      0.0 },
+    { "bitflip",      SIM_FAULT_BITFLIP,    1e-5 }, /* per bit read */
+    { "stuck-busy",   SIM_FAULT_STUCK_BUSY, 0.01 }, /* per array operation */
+    { "program-fail", SIM_FAULT_PROGRAM,    0.01 },
+    { "erase-fail",   SIM_FAULT_ERASE,      0.05 },
+    { "usb-drop",     SIM_FAULT_USB_DROP,   1e-5 }, /* per USB transfer */
+    { "disconnect",   SIM_FAULT_DISCONNECT, 5e-6 },
+};
+
+static double result_mbps(const struct bench_result *r)
+{
+    if( r->time_ns == 0 )
+        return 0.0;
+    return (double)r->bytes / (double)r->time_ns * 1e9 / 1e6;
+}
+
+static double result_transfers_per_unit(const struct bench_result *r)
+{
+    if( r->units == 0 )
+        return 0.0;
+    return (double)r->transfers / (double)r->units;
+}
+
+static int run_workloads(const struct sim_usb_profile *profile)
+{
+    for(unsigned int w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        struct bench_result *r;
+
+        if( results_count >= BENCH_MAX_RESULTS )
+            return 1;
+        r = &results[results_count++];
+        memset(r, 0, sizeof(*r));
+        snprintf(r->backend, sizeof(r->backend), "%s", profile->name);
+        snprintf(r->workload, sizeof(r->workload), "%s", workloads[w].name);
+
+        sim_reset_stats();
+        if( workloads[w].run(&r->units, &r->bytes) != 0 )
+        {
+            fprintf(stderr, "workload %s failed on backend %s\n", workloads[w].name, profile->name);
+            return 1;
+        }
+        r->time_ns = sim_stats.time_ns;
+        r->transfers = sim_stats.transfers;
+        r->violations = sim_stats.timing_violations;
+
+        printf("%-12s %-11s %8llu %12.3f %12.6f %14.1f %10llu\n", r->backend, r->workload,
+            (unsigned long long)r->units, (double)r->time_ns / 1e9,
+            result_mbps(r), result_transfers_per_unit(r), (unsigned long long)r->violations);
+        if( timing_details )
+            sim_print_timing_summary(stdout);
+    }
+    return 0;
+}
+
+/* Runs the fault workloads once per scenario on the first USB profile and
+ * reports the time each recovery path adds relative to the fault-free run */
+static int run_fault_scenarios(const struct nand_geometry *geometry)
+{
+    const unsigned int workloads_count = sizeof(fault_workloads) / sizeof(fault_workloads[0]);
+    uint64_t reference_ns[sizeof(fault_workloads) / sizeof(fault_workloads[0])];
+
+    printf("\nrecovery cost on %s (busy timeout %u us, %u retries)\n", sim_usb_profiles[0].name,
+        nand_recovery.busy_timeout_us, nand_recovery.max_retries);
+    printf("%-12s %-11s %12s %9s %8s %8s %8s %8s %7s\n", "fault", "workload", "MB/s", "cost",
+        "injected", "retries", "timeouts", "bus err", "failed");
+
+    for(unsigned int f = 0; f < sizeof(fault_scenarios) / sizeof(fault_scenarios[0]); f++)
+    {
+        const struct bench_fault_scenario *scenario = &fault_scenarios[f];
+
+        memset(sim_faults.rate, 0, sizeof(sim_faults.rate));
+        if( scenario->fault != SIM_FAULT_COUNT )
+            sim_faults.rate[scenario->fault] = scenario->rate;
+
+        if( sim_init(&sim_usb_profiles[0], &sim_default_timing, geometry, bench_ID_register) != 0 )
+            return 1;
+        iobus_set_direction(IOBUS_OUT);
+        nand_select_chip();
+
+        for(unsigned int w = 0; w < workloads_count; w++)
+        {
+            struct bench_result r;
+            struct nand_error_stats errors;
+            uint64_t injected = 0;
+            int failed;
+
+            memset(&r, 0, sizeof(r));
+            memset(&nand_errors, 0, sizeof(nand_errors));
+            sim_reset_stats();
+            failed = fault_workloads[w].run(&r.units, &r.bytes);
+            r.time_ns = sim_stats.time_ns;
+            errors = nand_errors;
+            for(unsigned int k = 0; k < SIM_FAULT_COUNT; k++)
+                injected += sim_stats.faults[k];
+
+            if( f == 0 )
+            {
+                if( failed )
+                {
+                    fprintf(stderr, "workload %s failed without faults\n", fault_workloads[w].name);
+                    return 1;
+                }
+                reference_ns[w] = r.time_ns;
+            }
+
+            printf("%-12s %-11s %12.6f %8.1f%% %8llu %8llu %8llu %8llu %7d\n", scenario->name,
+                fault_workloads[w].name, result_mbps(&r),
+                reference_ns[w] ? ((double)r.time_ns / (double)reference_ns[w] - 1.0) * 100.0 : 0.0,
+                (unsigned long long)injected, (unsigned long long)(errors.retries + errors.rereads),
+                (unsigned long long)errors.busy_timeouts, (unsigned long long)errors.bus_errors, failed);
+        }
+    }
+
+    memset(sim_faults.rate, 0, sizeof(sim_faults.rate));
+    return 0;
+}
+
+static int save_baseline(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to write baseline %s\n", path);
+        return 1;
+    }
+    for(unsigned int k = 0; k < results_count; k++)
+        fprintf(fp, "%s %s %.6f %.1f\n", results[k].backend, results[k].workload,
+            result_mbps(&results[k]), result_transfers_per_unit(&results[k]));
+    fclose(fp);
+    return 0;
+}
+
+/* returns the number of regressions */
+static int compare_baseline(const char *path, double tolerance)
+{
+    FILE *fp = fopen(path, "r");
+    char backend[32], workload[32];
+    double mbps, transfers;
+    int regressions = 0;
+
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to read baseline %s\n", path);
+        return 1;
+    }
+    while( fscanf(fp, "%31s %31s %lf %lf", backend, workload, &mbps, &transfers) == 4 )
+    {
+        for(unsigned int k = 0; k < results_count; k++)
+        {
+            if( strcmp(results[k].backend, backend) != 0 || strcmp(results[k].workload, workload) != 0 )
+                continue;
+            if( result_mbps(&results[k]) < mbps * (1.0 - tolerance) ||
+                result_transfers_per_unit(&results[k]) > transfers * (1.0 + tolerance) )
+            {
+                printf("REGRESSION: %s %s: %.6f MB/s (baseline %.6f), %.1f transfers/unit (baseline %.1f)\n",
+                    backend, workload, result_mbps(&results[k]), mbps,
+                    result_transfers_per_unit(&results[k]), transfers);
+                regressions++;
+            }
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+static const unsigned int jitter_waits_us[] = { REALWORLD_DELAY, 100, 1000 };
+static unsigned int jitter_wait_us;
+
+static void jitter_usleep(void)
+{
+    usleep(jitter_wait_us);
+}
+
+static void jitter_rt_wait(void)
+{
+    rt_wait_us(jitter_wait_us);
+}
+
+/* overshoot of usleep() and of the wait primitive for the bus delay and longer waits */
+static int run_jitter_waits(const char *scheduling)
+{
+    struct rt_latency latency;
+    char label[32];
+
+    printf("%s scheduling, wait spin tail %.1f us\n", scheduling, rt_calibrate_wait() / 1000.0);
+    for(unsigned int k = 0; k < sizeof(jitter_waits_us) / sizeof(jitter_waits_us[0]); k++)
+    {
+        jitter_wait_us = jitter_waits_us[k];
+
+        if( rt_measure(jitter_usleep, BENCH_JITTER_SAMPLES, jitter_wait_us * 1000ull, &latency) != 0 )
+            return EXIT_FAILURE;
+        snprintf(label, sizeof(label), "usleep %u", jitter_wait_us);
+        rt_print_latency(stdout, label, &latency);
+
+        if( rt_measure(jitter_rt_wait, BENCH_JITTER_SAMPLES, jitter_wait_us * 1000ull, &latency) != 0 )
+            return EXIT_FAILURE;
+        snprintf(label, sizeof(label), "rt_wait %u", jitter_wait_us);
+        rt_print_latency(stdout, label, &latency);
+    }
+    return 0;
+}
+
+/* Wall-clock overshoot of the waits: every REALWORLD_DELAY of a dump is such a
+ * wait, so its tail is what timer slack and scheduler jitter add to each transaction */
+static int run_jitter(void)
+{
+    char scheduling[32];
+
+    if( rt_options.priority == 0 && !rt_options.lock_memory && rt_options.cpu < 0 )
+    {
+        rt_options.priority = BENCH_JITTER_PRIORITY;
+        rt_options.lock_memory = 1;
+    }
+
+    printf("\nwait overshoot, %u samples per wait\n", BENCH_JITTER_SAMPLES);
+    rt_print_latency_header(stdout, "overshoot [us]");
+    if( run_jitter_waits("default") != 0 )
+        return EXIT_FAILURE;
+
+    if( rt_apply(&rt_options) != 0 )
+        printf("(real-time options only partly applied)\n");
+    snprintf(scheduling, sizeof(scheduling), "%s%s%s", rt_options.priority > 0 ? "fifo" : "normal",
+        rt_options.lock_memory ? "+lock" : "", rt_options.cpu >= 0 ? "+pin" : "");
+    return run_jitter_waits(scheduling);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b baseline] [-c baseline] [-t tolerance_percent] [-v] [-f] [-j [-R prio] [-L] [-A cpu]]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *save_path = NULL, *compare_path = NULL;
+    double tolerance = 0.005;
+    struct nand_geometry geometry;
+    int opt, faults = 0, jitter = 0;
+
+    while( (opt = getopt(argc, argv, "b:c:t:vfjR:LA:h")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'b': save_path = optarg; break;
+            case 'c': compare_path = optarg; break;
+            case 't': tolerance = atof(optarg) / 100.0; break;
+            case 'v': timing_details = 1; break;
+            case 'f': faults = 1; break;
+            case 'j': jitter = 1; break;
+            case 'R': rt_options.priority = atoi(optarg); break;
+            case 'L': rt_options.lock_memory = 1; break;
+            case 'A':
+                rt_options.cpu = rt_parse_cpu(optarg);
+                if( rt_options.cpu < 0 )
+                    return EXIT_FAILURE;
+                break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    verbose = 0;
+    bus = &sim_backend;
+    if( !timing_details )
+        sim_timing_report_max = 0;
+    geometry = nand_geometry;
+    geometry.blocks = BENCH_BLOCKS;
+    nand_geometry = geometry;
+
+    printf("%-12s %-11s %8s %12s %12s %14s %10s\n", "backend", "workload", "units",
+        "sim time [s]", "MB/s", "transfers/unit", "violations");
+
+    controlbus_reset_value();
+    iobus_reset_value();
+    for(unsigned int p = 0; p < sim_usb_profiles_count; p++)
+    {
+        if( sim_init(&sim_usb_profiles[p], &sim_default_timing, &geometry, bench_ID_register) != 0 )
+            return EXIT_FAILURE;
+
+        iobus_set_direction(IOBUS_OUT);
+        nand_select_chip();
+
+        if( run_workloads(&sim_usb_profiles[p]) != 0 )
+        {
+            sim_free();
+            return EXIT_FAILURE;
+        }
+    }
+    if( faults && run_fault_scenarios(&geometry) != 0 )
+    {
+        sim_free();
+        return EXIT_FAILURE;
+    }
+    sim_free();
+
+    if( jitter && run_jitter() != 0 )
+        return EXIT_FAILURE;
+
+    if( save_path && save_baseline(save_path) != 0 )
+        return EXIT_FAILURE;
+    if( compare_path && compare_baseline(compare_path, tolerance) != 0 )
+        return EXIT_FAILURE;
+
+    return 0;
+}
@@ -0,0 +1,456 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \file delta.c
+ * \brief Dumps stored as a delta against a base image (see delta.h)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "arena.h"
+#include "output.h"
+#include "delta.h"
+
+static const unsigned char delta_magic[4] = { 'N', 'D', 'L', 'T' };
+
+enum { DELTA_COPY = 'C', DELTA_ERASED = 'F', DELTA_PATCH = 'P', DELTA_LITERAL = 'L', DELTA_END = 'E' };
+
+static void put16(unsigned char *p, unsigned int value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static void put32(unsigned char *p, uint32_t value)
+{
+    put16(p, value & 0xFFFF);
+    put16(p + 2, value >> 16);
+}
+
+static void put64(unsigned char *p, uint64_t value)
+{
+    put32(p, (uint32_t)value);
+    put32(p + 4, (uint32_t)(value >> 32));
+}
+
+static unsigned int get16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+/* maps the base image read-only; an empty base has no pages, so every page of
+ * the delta is erased or literal */
+struct delta_base *delta_base_open(const char *path, unsigned int page_size)
+{
+    struct delta_base *base = calloc(1, sizeof(*base));
+    struct stat st;
+    int fd;
+
+    if( base == NULL )
+        return NULL;
+    base->page_size = page_size;
+    fd = open(path, O_RDONLY);
+    if( fd < 0 || fstat(fd, &st) != 0 )
+    {
+        fprintf(stderr, "unable to open the base image %s: %s\n", path, strerror(errno));
+        if( fd >= 0 )
+            close(fd);
+        free(base);
+        return NULL;
+    }
+    base->size = st.st_size;
+    base->pages = base->size / page_size;
+    if( base->size > 0 )
+    {
+        void *map = mmap(NULL, base->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if( map == MAP_FAILED )
+        {
+            fprintf(stderr, "unable to map the base image %s: %s\n", path, strerror(errno));
+            close(fd);
+            free(base);
+            return NULL;
+        }
+        /* both the encoder and delta_apply() walk the base from front to back */
+        madvise(map, base->size, MADV_SEQUENTIAL);
+        base->map = map;
+    }
+    close(fd);
+    return base;
+}
+
+void delta_base_close(struct delta_base *base)
+{
+    if( base == NULL )
+        return;
+    if( base->map )
+        munmap((void *)base->map, base->size);
+    free(base);
+}
+
+static const unsigned char *delta_base_page(const struct delta_base *base, uint64_t index)
+{
+    return index < base->pages ? base->map + index * base->page_size : NULL;
+}
+
+/* upper limit of the encoded size of pages; also covers a patch given up halfway */
+size_t delta_bound(unsigned int pages, unsigned int page_size)
+{
+    size_t record = 1 + (size_t)page_size;
+
+    if( record < 3 + 3 * (DELTA_PATCH_MAX + 1) )
+        record = 3 + 3 * (DELTA_PATCH_MAX + 1);
+    return (size_t)pages * record;
+}
+
+/* starts a new output buffer of delta_bound() bytes; records never span two */
+void delta_encoder_reset(struct delta_encoder *enc, const struct delta_base *base, unsigned char *out)
+{
+    enc->base = base;
+    enc->out = out;
+    enc->length = 0;
+    enc->run = NULL;
+}
+
+static void delta_run(struct delta_encoder *enc, unsigned char op)
+{
+    if( enc->run && enc->run[0] == op )
+    {
+        put32(enc->run + 1, get32(enc->run + 1) + 1);
+        return;
+    }
+    enc->run = enc->out + enc->length;
+    enc->run[0] = op;
+    put32(enc->run + 1, 1);
+    enc->length += 5;
+}
+
+/* the XOR patch of page against its base page; 0 if more than
+ * DELTA_PATCH_MAX bytes differ */
+static size_t delta_patch(unsigned char *out, const unsigned char *page, const unsigned char *base,
+    unsigned int page_size)
+{
+    unsigned int changed = 0, k = 0;
+    unsigned char *p = out + 3;
+
+    while( k < page_size )
+    {
+        uint64_t a, b;
+
+        /* equal words are skipped a word at a time */
+        if( k + 8 <= page_size )
+        {
+            memcpy(&a, page + k, 8);
+            memcpy(&b, base + k, 8);
+            if( a == b )
+            {
+                k += 8;
+                continue;
+            }
+        }
+        for(unsigned int end = k + 8 < page_size ? k + 8 : page_size; k < end; k++)
+        {
+            if( page[k] == base[k] )
+                continue;
+            if( ++changed > DELTA_PATCH_MAX )
+                return 0;
+            put16(p, k);
+            p[2] = page[k] ^ base[k];
+            p += 3;
+        }
+    }
+    out[0] = DELTA_PATCH;
+    put16(out + 1, changed);
+    return p - out;
+}
+
+/* appends the record of page index of the dump; erased: the page is all 0xFF */
+void delta_encode_page(struct delta_encoder *enc, uint64_t index, const unsigned char *page, int erased)
+{
+    const unsigned char *base = delta_base_page(enc->base, index);
+    unsigned int page_size = enc->base->page_size;
+    unsigned char *out = enc->out + enc->length;
+    size_t length;
+
+    if( erased )
+    {
+        delta_run(enc, DELTA_ERASED);
+        enc->stats.erased++;
+        return;
+    }
+    if( base && memcmp(page, base, page_size) == 0 )
+    {
+        delta_run(enc, DELTA_COPY);
+        enc->stats.copied++;
+        return;
+    }
+
+    enc->run = NULL;
+    if( base && (length = delta_patch(out, page, base, page_size)) > 0 )
+    {
+        enc->length += length;
+        enc->stats.patched++;
+        enc->stats.patch_bytes += get16(out + 1);
+        return;
+    }
+    out[0] = DELTA_LITERAL;
+    memcpy(out + 1, page, page_size);
+    enc->length += 1 + (size_t)page_size;
+    enc->stats.literal++;
+}
+
+int delta_write_header(FILE *fp, const struct delta_base *base, uint64_t pages)
+{
+    unsigned char header[DELTA_HEADER_SIZE] = { 0 };
+
+    memcpy(header, delta_magic, sizeof(delta_magic));
+    put32(header + 4, DELTA_VERSION);
+    put32(header + 8, base->page_size);
+    put64(header + 16, pages);
+    put64(header + 24, base->size);
+    return fwrite(header, sizeof(header), 1, fp) == 1 ? 0 : EXIT_FAILURE;
+}
+
+int delta_write_end(FILE *fp)
+{
+    return fputc(DELTA_END, fp) == EOF ? EXIT_FAILURE : 0;
+}
+
+/* the delta of an image that already is on disk, e.g. an earlier full dump */
+int delta_encode_image(const char *image_path, const char *base_path, const char *delta_path,
+    unsigned int page_size, struct delta_stats *stats)
+{
+    struct delta_base *base = delta_base_open(base_path, page_size);
+    struct delta_encoder enc;
+    unsigned char *page = malloc(page_size), *out = malloc(delta_bound(DELTA_BATCH_PAGES, page_size));
+    FILE *image = fopen(image_path, "rb"), *fp = NULL;
+    uint64_t pages = 0, index = 0;
+    struct stat st;
+    int ret = EXIT_FAILURE;
+
+    if( base == NULL || page == NULL || out == NULL || image == NULL )
+    {
+        if( image == NULL )
+            fprintf(stderr, "unable to open %s\n", image_path);
+        goto done;
+    }
+    if( fstat(fileno(image), &st) == 0 )
+        pages = (uint64_t)st.st_size / page_size;
+    fp = fopen(delta_path, "wb");
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to open %s\n", delta_path);
+        goto done;
+    }
+    memset(&enc, 0, sizeof(enc));
+    if( delta_write_header(fp, base, pages) != 0 )
+        goto done;
+
+    while( index < pages )
+    {
+        delta_encoder_reset(&enc, base, out);
+        for(unsigned int k = 0; k < DELTA_BATCH_PAGES && index < pages; k++, index++)
+        {
+            unsigned char all = 0xFF;
+
+            if( fread(page, page_size, 1, image) != 1 )
+            {
+                fprintf(stderr, "Failed to read %s\n", image_path);
+                goto done;
+            }
+            for(unsigned int n = 0; n < page_size; n++)
+                all &= page[n];
+            delta_encode_page(&enc, index, page, all == 0xFF);
+        }
+        if( fwrite(out, 1, enc.length, fp) != enc.length )
+            goto done;
+        enc.stats.bytes += enc.length;
+    }
+    if( delta_write_end(fp) == 0 )
+        ret = 0;
+    enc.stats.bytes += DELTA_HEADER_SIZE + 1;
+    if( stats )
+        *stats = enc.stats;
+
+done:
+    if( fp && fclose(fp) != 0 )
+        ret = EXIT_FAILURE;
+    if( ret != 0 && fp )
+        fprintf(stderr, "Failed to write the delta %s\n", delta_path);
+    if( image )
+        fclose(image);
+    delta_base_close(base);
+    free(page);
+    free(out);
+    return ret;
+}
+
+/* the next page of the image, from one record of the delta */
+static int delta_read_page(FILE *fp, const struct delta_base *base, uint64_t index, unsigned char *page,
+    uint32_t *run, unsigned char *op)
+{
+    unsigned int page_size = base->page_size;
+    const unsigned char *base_page = delta_base_page(base, index);
+    unsigned char field[4];
+
+    if( *run == 0 )
+    {
+        int c = getc(fp);
+
+        if( c == EOF )
+            return EXIT_FAILURE;
+        *op = (unsigned char)c;
+        if( *op == DELTA_COPY || *op == DELTA_ERASED )
+        {
+            if( fread(field, 4, 1, fp) != 1 || (*run = get32(field)) == 0 )
+                return EXIT_FAILURE;
+        }
+        else
+            *run = 1;
+    }
+    (*run)--;
+
+    switch( *op )
+    {
+        case DELTA_ERASED:
+            memset(page, 0xFF, page_size);
+            return 0;
+        case DELTA_LITERAL:
+            return fread(page, page_size, 1, fp) == 1 ? 0 : EXIT_FAILURE;
+        case DELTA_COPY:
+        case DELTA_PATCH:
+            break;
+        default:
+            return EXIT_FAILURE;
+    }
+    if( base_page == NULL )
+    {
+        fprintf(stderr, "the delta refers to page %llu, beyond the end of the base image\n",
+            (unsigned long long)index);
+        return EXIT_FAILURE;
+    }
+    memcpy(page, base_page, page_size);
+    if( *op == DELTA_PATCH )
+    {
+        unsigned int changed;
+
+        if( fread(field, 2, 1, fp) != 1 )
+            return EXIT_FAILURE;
+        changed = get16(field);
+        for(unsigned int k = 0; k < changed; k++)
+        {
+            unsigned int offset;
+
+            if( fread(field, 3, 1, fp) != 1 || (offset = get16(field)) >= page_size )
+                return EXIT_FAILURE;
+            page[offset] ^= field[2];
+        }
+    }
+    return 0;
+}
+
+/* rebuilds the image of a delta into image_path (output_flags apply) */
+int delta_apply(const char *delta_path, const char *base_path, const char *image_path)
+{
+    unsigned char header[DELTA_HEADER_SIZE];
+    struct delta_base *base = NULL;
+    struct page_arena *arena = NULL;
+    struct dump_output *out = NULL;
+    unsigned int page_size, batch;
+    uint64_t pages, index;
+    uint32_t run = 0;
+    unsigned char op = 0;
+    FILE *fp;
+    int ret = EXIT_FAILURE;
+
+    fp = fopen(delta_path, "rb");
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to open %s\n", delta_path);
+        return EXIT_FAILURE;
+    }
+    setvbuf(fp, NULL, _IOFBF, OUTPUT_STAGE_SIZE);
+    if( fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, delta_magic, sizeof(delta_magic)) != 0
+        || get32(header + 4) != DELTA_VERSION || get32(header + 8) == 0 )
+    {
+        fprintf(stderr, "%s is not a delta image\n", delta_path);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    page_size = get32(header + 8);
+    pages = get64(header + 16);
+
+    base = delta_base_open(base_path, page_size);
+    if( base && base->size != get64(header + 24) )
+    {
+        fprintf(stderr, "%s has %llu bytes, the base of the delta had %llu\n", base_path,
+            (unsigned long long)base->size, (unsigned long long)get64(header + 24));
+        goto done;
+    }
+    if( base )
+        arena = arena_create((size_t)DELTA_BATCH_PAGES * page_size, 2, arena_flags);
+    if( arena )
+        out = output_open(image_path, output_flags);
+    if( out == NULL || output_reserve(out, pages * page_size) != 0 )
+        goto done;
+
+    for( index = 0; index < pages; index += batch )
+    {
+        /* as in dump_memory(): a mapped image is filled in place, buffers alternate for pipes */
+        unsigned char *data;
+
+        batch = pages - index < DELTA_BATCH_PAGES ? pages - index : DELTA_BATCH_PAGES;
+        data = output_window(out, index * page_size, (size_t)batch * page_size);
+        if( data == NULL )
+            data = arena_buffer(arena, (index / DELTA_BATCH_PAGES) % 2);
+        for(unsigned int k = 0; k < batch; k++)
+            if( delta_read_page(fp, base, index + k, data + (size_t)k * page_size, &run, &op) != 0 )
+            {
+                fprintf(stderr, "%s is damaged at page %llu\n", delta_path, (unsigned long long)(index + k));
+                goto done;
+            }
+        if( output_write(out, data, (size_t)batch * page_size) != 0 )
+            goto done;
+    }
+    if( run != 0 || getc(fp) != DELTA_END )
+        fprintf(stderr, "%s does not end after %llu pages\n", delta_path, (unsigned long long)pages);
+    else
+        ret = 0;
+
+done:
+    if( out && output_close(out) != 0 )
+        ret = EXIT_FAILURE;
+    arena_destroy(arena);
+    delta_base_close(base);
+    fclose(fp);
+    return ret;
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \file delta.h
+ * \brief Dumps stored as a delta against a base image
+ * Successive dumps of one unit differ in few pages, so a dump can be kept as
+ * a list of page records against a base image of the same page range:
+ *
+ *   header   "NDLT", version, page size, pages, size of the base image
+ *   'C' n    the next n pages are the pages at the same place in the base
+ *   'F' n    the next n pages are erased (all 0xFF)
+ *   'P' m    the base page with m bytes changed: m times (offset, XOR mask)
+ *   'L'      a literal page
+ *   'E'      end of the delta
+ *
+ * Numbers are little endian; n is 32 bits, m and the offsets 16 bits. A page
+ * becomes a patch if at most DELTA_PATCH_MAX of its bytes differ from the
+ * base, which covers bitflips and small updates. The encoder works on one
+ * page at a time into a caller's buffer, so the workers of the pipelined dump
+ * (postproc.h) run it like any other stage. The base is mapped, and
+ * delta_apply() rebuilds the image batch by batch through the dump output
+ * (output.h).
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define DELTA_VERSION     1
+#define DELTA_HEADER_SIZE 32
+#define DELTA_PATCH_MAX   64 /* changed bytes up to which a page is patched */
+#define DELTA_BATCH_PAGES 64 /* pages per write when the image is rebuilt */
+
+struct delta_base
+{
+    const unsigned char *map; /* NULL for an empty base */
+    uint64_t size;
+    uint64_t pages;
+    unsigned int page_size;
+};
+
+struct delta_stats
+{
+    uint64_t copied;   /* pages taken from the base */
+    uint64_t erased;
+    uint64_t patched;
+    uint64_t literal;
+    uint64_t patch_bytes; /* bytes changed by the patches */
+    uint64_t bytes;    /* size of the delta */
+};
+
+struct delta_encoder
+{
+    const struct delta_base *base;
+    unsigned char *out;
+    size_t length;
+    unsigned char *run; /* open 'C' or 'F' record the next page may extend, NULL: none */
+    struct delta_stats stats;
+};
+
+struct delta_base *delta_base_open(const char *path, unsigned int page_size);
+void delta_base_close(struct delta_base *base);
+
+size_t delta_bound(unsigned int pages, unsigned int page_size);
+void delta_encoder_reset(struct delta_encoder *enc, const struct delta_base *base, unsigned char *out);
+void delta_encode_page(struct delta_encoder *enc, uint64_t index, const unsigned char *page, int erased);
+int delta_write_header(FILE *fp, const struct delta_base *base, uint64_t pages);
+int delta_write_end(FILE *fp);
+
+int delta_encode_image(const char *image_path, const char *base_path, const char *delta_path,
+    unsigned int page_size, struct delta_stats *stats);
+int delta_apply(const char *delta_path, const char *base_path, const char *image_path);
+
+#endif /* DELTA_H */
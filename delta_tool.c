@@ -0,0 +1,95 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \file delta_tool.c
+ * \brief Delta images of dumps (see delta.h)
+ * Rebuilds the image of a delta stored by `program -Y`, or encodes an image
+ * that is already on disk as a delta against an older one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "nand.h"
+#include "output.h"
+#include "delta.h"
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s -b base [-M] -o image delta\n"
+        "       %s -b base [-p page_size] -e image -o delta\n"
+        "  -b FILE    base image the delta refers to\n"
+        "  -o FILE    image to rebuild, or the delta to write with -e (\"-\": stdout when rebuilding)\n"
+        "  -e FILE    encode FILE as a delta against the base\n"
+        "  -p BYTES   page size with spare area for -e (default %u)\n"
+        "  -M         preallocate the rebuilt image and write it through a shared mapping\n",
+        name, name, PAGE_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *base_path = NULL, *encode_path = NULL, *out_path = NULL;
+    unsigned int page_size = PAGE_SIZE;
+    struct delta_stats stats;
+    double start;
+    int opt, ret;
+
+    while( (opt = getopt(argc, argv, "b:e:o:p:Mh")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'b': base_path = optarg; break;
+            case 'e': encode_path = optarg; break;
+            case 'o': out_path = optarg; break;
+            case 'p': page_size = strtoul(optarg, NULL, 0); break;
+            case 'M': output_flags |= OUTPUT_MMAP; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if( base_path == NULL || out_path == NULL || page_size == 0 || (encode_path == NULL && optind >= argc) )
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    start = now_s();
+    if( encode_path )
+    {
+        ret = delta_encode_image(encode_path, base_path, out_path, page_size, &stats);
+        if( ret == 0 )
+            printf("%llu pages unchanged, %llu erased, %llu patched (%llu bytes), %llu literal; %llu bytes\n",
+                (unsigned long long)stats.copied, (unsigned long long)stats.erased,
+                (unsigned long long)stats.patched, (unsigned long long)stats.patch_bytes,
+                (unsigned long long)stats.literal, (unsigned long long)stats.bytes);
+        return ret;
+    }
+
+    if( strcmp(out_path, OUTPUT_STDOUT) == 0 && output_claim_stdout() != 0 )
+        return EXIT_FAILURE;
+    ret = delta_apply(argv[optind], base_path, out_path);
+    if( ret == 0 )
+        printf("rebuilt %s in %.3f s\n", out_path, now_s() - start);
+    return ret;
+}
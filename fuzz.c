@@ -0,0 +1,491 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file fuzz.c
+ * \brief Protocol fuzzing of the bus operations against the simulated chip
+ * Every sequence picks a USB profile, a chip geometry, a recovery policy and
+ * fault rates from its seed and then runs random operations (ID read, page
+ * read, program, verify, erase, range dump, reset) through the real bus code.
+ * A shadow copy of the flash content and a pin monitor between the bus code
+ * and the simulated reader check after every operation that
+ *  - no byte was lost or changed: reads and dumps match the shadow copy
+ *  - the bus code never drives an illegal pin state (CLE and ALE together,
+ *    nWE and nRE together, nRE low while the host drives the I/O bus)
+ *  - a failed program / erase status is reported exactly when the chip had one
+ *  - buses with USB latency never violate the AC timing of the chip
+ * A failing sequence is reported with its seed and can be rerun alone with -s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nand.h"
+#include "nand_sim.h"
+#include "trace.h"
+
+#define FUZZ_MAX_DUMP_PAGES 16
+
+static const unsigned char fuzz_ID_register[5] = { 0xAD, 0xDC, 0x10, 0x95, 0x54 };
+
+static uint64_t fuzz_random;
+static const char *trace_prefix; /* -t: protocol trace of failing sequences */
+
+static struct
+{
+    const struct bus_backend *inner;
+    unsigned char control;
+    iobus_inout_t direction;
+    uint64_t bus_errors;    /* bus errors at the start of the operation */
+    const char *violation;  /* first illegal pin state seen in the operation */
+} monitor;
+
+static struct
+{
+    unsigned char *data;    /* expected flash content */
+    unsigned char *known;   /* per page: content is defined (not after a failed program / erase) */
+    unsigned int pages;
+    unsigned int page_size;
+} shadow;
+
+static uint32_t fuzz_next(void)
+{
+    fuzz_random ^= fuzz_random << 13;
+    fuzz_random ^= fuzz_random >> 7;
+    fuzz_random ^= fuzz_random << 17;
+    return (uint32_t)(fuzz_random >> 32);
+}
+
+static unsigned int fuzz_below(unsigned int n)
+{
+    return n ? fuzz_next() % n : 0;
+}
+
+/* pin states are only judged while the operation has not seen a failed
+ * transfer: after that the host's view of the pins may be stale on purpose */
+static void monitor_violation(const char *what)
+{
+    if( nand_errors.bus_errors == monitor.bus_errors && monitor.violation == NULL )
+        monitor.violation = what;
+}
+
+static void monitor_check(unsigned char control, iobus_inout_t direction)
+{
+    if( control & PIN_nCE )
+        return;
+    if( (control & PIN_CLE) && (control & PIN_ALE) )
+        monitor_violation("CLE and ALE high at the same time");
+    if( !(control & PIN_nWE) && !(control & PIN_nRE) )
+        monitor_violation("nWE and nRE low at the same time");
+    if( !(control & PIN_nRE) && (control & (PIN_CLE | PIN_ALE)) )
+        monitor_violation("nRE low while CLE or ALE is high");
+    if( !(control & PIN_nRE) && direction == IOBUS_OUT )
+        monitor_violation("nRE low while the host drives the I/O bus");
+}
+
+static int monitor_write_controlbus(unsigned char value)
+{
+    int ret = monitor.inner->write_controlbus(value);
+
+    if( ret >= 0 )
+    {
+        monitor_check(value, monitor.direction);
+        monitor.control = value;
+    }
+    return ret;
+}
+
+static int monitor_write_iobus(unsigned char value)
+{
+    return monitor.inner->write_iobus(value);
+}
+
+static int monitor_set_iobus_direction(iobus_inout_t inout)
+{
+    int ret = monitor.inner->set_iobus_direction(inout);
+
+    if( ret >= 0 )
+    {
+        monitor_check(monitor.control, inout);
+        monitor.direction = inout;
+    }
+    return ret;
+}
+
+static unsigned char monitor_read_controlbus(void)
+{
+    return monitor.inner->read_controlbus();
+}
+
+static unsigned char monitor_read_iobus(void)
+{
+    return monitor.inner->read_iobus();
+}
+
+static void monitor_delay_us(unsigned int usec)
+{
+    monitor.inner->delay_us(usec);
+}
+
+static uint64_t monitor_now_ns(void)
+{
+    return monitor.inner->now_ns();
+}
+
+static const struct bus_backend monitor_backend =
+{
+    "monitor",
+    monitor_write_controlbus,
+    monitor_write_iobus,
+    monitor_set_iobus_direction,
+    monitor_read_controlbus,
+    monitor_read_iobus,
+    monitor_delay_us,
+    monitor_now_ns
+};
+
+static void fuzz_page_data(unsigned char *data)
+{
+    unsigned int fill = fuzz_below(4);
+
+    for(unsigned int k = 0; k < shadow.page_size; k++)
+    {
+        switch( fill )
+        {
+            case 0: data[k] = (unsigned char)fuzz_next(); break;
+            case 1: data[k] = 0x00; break;
+            case 2: data[k] = (k & 1) ? 0x55 : 0xAA; break;
+            default: data[k] = fuzz_below(8) ? 0xFF : (unsigned char)fuzz_next(); break; /* sparse */
+        }
+    }
+}
+
+static unsigned char *shadow_page(unsigned int nPageId)
+{
+    return shadow.data + (size_t)nPageId * shadow.page_size;
+}
+
+/* checks the outcome of a program or erase against the faults the chip injected */
+static const char *check_status(int ret, uint64_t status_faults, uint64_t bus_errors)
+{
+    if( ret == NAND_FAIL_STATUS && status_faults == 0 )
+        return "failed status reported although the chip succeeded";
+    if( ret == 0 && status_faults != 0 && nand_errors.bus_errors == bus_errors )
+        return "failed status of the chip was not reported";
+    if( ret != 0 && ret != NAND_FAIL_STATUS )
+        return "operation failed after all retries";
+    return NULL;
+}
+
+static const char *compare_page(unsigned int nPageId, const unsigned char *data)
+{
+    if( shadow.known[nPageId] && memcmp(data, shadow_page(nPageId), shadow.page_size) != 0 )
+        return "page content differs from the shadow copy";
+    return NULL;
+}
+
+static const char *op_read_ID(char *desc, size_t size)
+{
+    unsigned char ID_register[5];
+
+    snprintf(desc, size, "read ID");
+    read_ID_register(ID_register);
+    if( memcmp(ID_register, fuzz_ID_register, sizeof(ID_register)) != 0 )
+        return "ID register differs";
+    return NULL;
+}
+
+static const char *op_read_page(char *desc, size_t size, unsigned char *buf)
+{
+    unsigned int nPageId = fuzz_below(shadow.pages);
+
+    snprintf(desc, size, "read page %u", nPageId);
+    if( read_page(nPageId, buf) != 0 )
+        return "page read failed after all retries";
+    return compare_page(nPageId, buf);
+}
+
+static const char *op_program(char *desc, size_t size, unsigned char *buf)
+{
+    unsigned int nPageId = fuzz_below(shadow.pages);
+    uint64_t faults = sim_stats.faults[SIM_FAULT_PROGRAM];
+    uint64_t bus_errors = nand_errors.bus_errors;
+    const char *error;
+    int ret;
+
+    snprintf(desc, size, "program page %u", nPageId);
+    fuzz_page_data(buf);
+    ret = program_page(nPageId, buf);
+    error = check_status(ret, sim_stats.faults[SIM_FAULT_PROGRAM] - faults, bus_errors);
+
+    if( ret == 0 )
+    {
+        unsigned char *page = shadow_page(nPageId);
+        for(unsigned int k = 0; k < shadow.page_size; k++)
+            page[k] &= buf[k];
+    }
+    else
+        shadow.known[nPageId] = 0;
+    return error;
+}
+
+static const char *op_verify(char *desc, size_t size)
+{
+    unsigned int nPageId = fuzz_below(shadow.pages);
+
+    snprintf(desc, size, "verify page %u", nPageId);
+    if( !shadow.known[nPageId] )
+        return NULL;
+    if( verify_page(nPageId, shadow_page(nPageId)) != 0 )
+        return "verify of a page with known content failed";
+    return NULL;
+}
+
+static const char *op_erase(char *desc, size_t size)
+{
+    unsigned int nBlockId = fuzz_below(nand_geometry.blocks);
+    unsigned int first = nBlockId * nand_geometry.pages_per_block;
+    uint64_t faults = sim_stats.faults[SIM_FAULT_ERASE];
+    uint64_t bus_errors = nand_errors.bus_errors;
+    const char *error;
+    int ret;
+
+    snprintf(desc, size, "erase block %u", nBlockId);
+    ret = erase_block(nBlockId);
+    error = check_status(ret, sim_stats.faults[SIM_FAULT_ERASE] - faults, bus_errors);
+
+    for(unsigned int k = first; k < first + nand_geometry.pages_per_block; k++)
+    {
+        if( ret == 0 )
+            memset(shadow_page(k), 0xFF, shadow.page_size);
+        shadow.known[k] = ret == 0;
+    }
+    return error;
+}
+
+static const char *op_dump(char *desc, size_t size, unsigned char *buf)
+{
+    unsigned int first = fuzz_below(shadow.pages);
+    unsigned int pages = 1 + fuzz_below(FUZZ_MAX_DUMP_PAGES);
+    FILE *fp;
+    const char *error = NULL;
+
+    if( pages > shadow.pages - first )
+        pages = shadow.pages - first;
+    snprintf(desc, size, "dump pages %u..%u", first, first + pages - 1);
+
+    fp = tmpfile();
+    if( fp == NULL )
+        return "unable to create a temporary file";
+    if( dump_memory_range(fp, first, pages) != 0 )
+        error = "dump failed";
+    else if( ftell(fp) != (long)pages * shadow.page_size )
+        error = "dump has the wrong length";
+
+    rewind(fp);
+    for(unsigned int k = 0; k < pages && error == NULL; k++)
+    {
+        if( fread(buf, 1, shadow.page_size, fp) != shadow.page_size )
+            error = "dump is short";
+        else
+            error = compare_page(first + k, buf);
+    }
+    fclose(fp);
+    return error;
+}
+
+static const char *op_reset(char *desc, size_t size)
+{
+    snprintf(desc, size, "reset");
+    if( reset_chip() != 0 )
+        return "chip did not become ready after reset";
+    return NULL;
+}
+
+/* bus parameters of the sequence: profile, geometry, recovery policy and fault rates */
+static const struct sim_usb_profile *fuzz_setup(struct nand_geometry *geometry)
+{
+    static const struct nand_geometry geometries[] =
+    {
+        { 512, 16, 32, 16 },
+        { 2048, 64, 64, 8 },
+        { 2048, 64, 4, 32 },
+        { 4032, 64, 2, 16 },
+    };
+    const struct sim_usb_profile *profile = &sim_usb_profiles[fuzz_below(sim_usb_profiles_count)];
+
+    *geometry = geometries[fuzz_below(sizeof(geometries) / sizeof(geometries[0]))];
+
+    nand_recovery.max_retries = 3 + fuzz_below(8);
+    nand_recovery.read_retries = fuzz_below(3);
+    nand_recovery.busy_timeout_us = 5000 + fuzz_below(20000);
+    nand_recovery.retry_delay_us = fuzz_below(2000);
+
+    memset(sim_faults.rate, 0, sizeof(sim_faults.rate));
+    sim_faults.seed = fuzz_next();
+    if( fuzz_below(2) )
+        sim_faults.rate[SIM_FAULT_STUCK_BUSY] = 0.02;
+    if( fuzz_below(2) )
+        sim_faults.rate[SIM_FAULT_PROGRAM] = 0.05;
+    if( fuzz_below(2) )
+        sim_faults.rate[SIM_FAULT_ERASE] = 0.1;
+    if( fuzz_below(2) )
+        sim_faults.rate[SIM_FAULT_USB_DROP] = 2e-5;
+
+    return profile;
+}
+
+/* returns 0 if all invariants held */
+static int fuzz_sequence(uint64_t seed, unsigned int ops, int quiet)
+{
+    const struct sim_usb_profile *profile;
+    struct nand_geometry geometry;
+    unsigned char *buf;
+    char desc[64];
+    const char *error = NULL;
+    unsigned int n;
+
+    fuzz_random = seed * 0x9E3779B97F4A7C15ull + 1;
+    profile = fuzz_setup(&geometry);
+    nand_geometry = geometry;
+
+    shadow.pages = nand_pages_total();
+    shadow.page_size = nand_page_size_total();
+    shadow.data = malloc((size_t)shadow.pages * shadow.page_size);
+    shadow.known = malloc(shadow.pages);
+    buf = malloc(shadow.page_size);
+    if( shadow.data == NULL || shadow.known == NULL || buf == NULL ||
+        sim_init(profile, &sim_default_timing, &geometry, fuzz_ID_register) != 0 )
+    {
+        fprintf(stderr, "Failed to allocate the fuzz buffers.\n");
+        free(shadow.data);
+        free(shadow.known);
+        free(buf);
+        return 1;
+    }
+    if( trace_prefix )
+        trace_init(TRACE_CONTINUOUS, trace_prefix, 16);
+    memset(shadow.data, 0xFF, (size_t)shadow.pages * shadow.page_size);
+    memset(shadow.known, 1, shadow.pages);
+
+    memset(&monitor, 0, sizeof(monitor));
+    monitor.inner = &sim_backend;
+    monitor.control = PIN_nCE | PIN_nWE | PIN_nRE;
+    monitor.direction = IOBUS_OUT;
+    bus = &monitor_backend;
+    memset(&nand_errors, 0, sizeof(nand_errors));
+
+    controlbus_reset_value();
+    iobus_reset_value();
+    iobus_set_direction(IOBUS_OUT);
+    nand_select_chip();
+
+    for(n = 0; n < ops && error == NULL; n++)
+    {
+        monitor.bus_errors = nand_errors.bus_errors;
+        monitor.violation = NULL;
+
+        switch( fuzz_below(7) )
+        {
+            case 0: error = op_read_ID(desc, sizeof(desc)); break;
+            case 1: error = op_read_page(desc, sizeof(desc), buf); break;
+            case 2: error = op_program(desc, sizeof(desc), buf); break;
+            case 3: error = op_verify(desc, sizeof(desc)); break;
+            case 4: error = op_erase(desc, sizeof(desc)); break;
+            case 5: error = op_dump(desc, sizeof(desc), buf); break;
+            default: error = op_reset(desc, sizeof(desc)); break;
+        }
+
+        if( error == NULL )
+            error = monitor.violation;
+        if( error == NULL && profile->frame_ns && sim_stats.timing_violations )
+            error = "AC timing violated";
+    }
+
+    if( error )
+    {
+        printf("FAIL seed %llu: operation %u (%s) on %s, %u x %u+%u bytes: %s\n",
+            (unsigned long long)seed, n - 1, desc, profile->name, shadow.pages,
+            geometry.page_size, geometry.spare_size, error);
+        if( trace_prefix )
+        {
+            char path[4096];
+
+            trace_trigger();
+            snprintf(path, sizeof(path), "%s-%llu.vcd", trace_prefix, (unsigned long long)seed);
+            if( trace_write_vcd(path) == 0 )
+                printf("     trace of the last operations written to %s\n", path);
+        }
+    }
+    else if( !quiet )
+        printf("ok   seed %llu: %u operations on %s, %u x %u+%u bytes, %llu retries, %llu bus errors\n",
+            (unsigned long long)seed, ops, profile->name, shadow.pages, geometry.page_size,
+            geometry.spare_size, (unsigned long long)nand_errors.retries,
+            (unsigned long long)nand_errors.bus_errors);
+
+    /* the trace is written above for failing sequences only */
+    trace_mode = TRACE_OFF;
+    trace_finish();
+    sim_free();
+    free(shadow.data);
+    free(shadow.known);
+    free(buf);
+    return error != NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n sequences] [-o operations] [-t trace_prefix] [-v]\n"
+        "  -s SEED    first seed (a single failing sequence is rerun with -s SEED -n 1)\n"
+        "  -n N       number of sequences, seeds SEED..SEED+N-1\n"
+        "  -o N       operations per sequence\n"
+        "  -t PREFIX  write the protocol trace of a failing sequence to PREFIX-SEED.vcd\n"
+        "  -v         report every sequence and keep the messages of the bus code\n",
+        name);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t seed = 1;
+    unsigned int sequences = 100, ops = 40, failures = 0;
+    int opt, details = 0;
+
+    while( (opt = getopt(argc, argv, "s:n:o:t:vh")) != -1 )
+    {
+        switch( opt )
+        {
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 'n': sequences = strtoul(optarg, NULL, 0); break;
+            case 'o': ops = strtoul(optarg, NULL, 0); break;
+            case 't': trace_prefix = optarg; break;
+            case 'v': details = 1; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    verbose = 0;
+    sim_timing_report_max = 0;
+    /* injected faults make the bus code report failures on stderr */
+    if( !details && freopen("/dev/null", "w", stderr) == NULL )
+        return EXIT_FAILURE;
+
+    for(unsigned int k = 0; k < sequences; k++)
+        failures += fuzz_sequence(seed + k, ops, !details) != 0;
+
+    printf("%u of %u sequences failed\n", failures, sequences);
+    return failures ? EXIT_FAILURE : 0;
+}
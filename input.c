@@ -0,0 +1,646 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file input.c
+ * \brief Streaming image input for programming the chip (see input.h)
+ * The queue is a ring of page buffers from an arena: the reader fills the
+ * slot after the queued pages, the bus thread owns the oldest one until it
+ * asks for the next page. The bytes the reader looked at to recognize a
+ * compressed image are already consumed, so a feeder thread passes them and
+ * the rest of the input on to the decompressor.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "nand.h"
+#include "arena.h"
+#include "bbt.h"
+#include "input.h"
+
+#define INPUT_PEEK_SIZE   8
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+/* Android sparse image format (libsparse sparse_format.h) */
+#define SPARSE_MAGIC          0xED26FF3Au
+#define SPARSE_HEADER_SIZE    28
+#define SPARSE_CHUNK_SIZE     12
+#define SPARSE_CHUNK_RAW      0xCAC1
+#define SPARSE_CHUNK_FILL     0xCAC2
+#define SPARSE_CHUNK_DONTCARE 0xCAC3
+#define SPARSE_CHUNK_CRC32    0xCAC4
+
+static const struct
+{
+    unsigned char magic[INPUT_PEEK_SIZE];
+    unsigned int length;
+    const char *tool;
+} input_compressors[] =
+{
+    { { 0x1F, 0x8B }, 2, "gzip" },
+    { { 0xFD, '7', 'z', 'X', 'Z', 0x00 }, 6, "xz" },
+    { { 0x28, 0xB5, 0x2F, 0xFD }, 4, "zstd" },
+    { { 'B', 'Z', 'h' }, 3, "bzip2" },
+    { { 0x04, 0x22, 0x4D, 0x18 }, 4, "lz4" },
+};
+
+struct image_input
+{
+    int source;                /* the input itself */
+    int fd;                    /* the stream parsed: the input or the decompressor output */
+    pid_t decompressor;
+    int feed;                  /* write end of the decompressor input, -1: no feeder */
+    pthread_t feeder;
+    pthread_t thread;
+    unsigned char peek[INPUT_PEEK_SIZE];
+    size_t peeked, peek_pos;
+    unsigned char buffer[INPUT_BUFFER_SIZE];
+    size_t buffered, pos;
+
+    unsigned int page_size;
+    struct page_arena *arena;
+    unsigned char *current;    /* page being assembled */
+    size_t filled;
+    int needed;                /* the page holds bytes that are not erased */
+    uint64_t page_index;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint64_t page[INPUT_QUEUE_PAGES];
+    unsigned int head, count;
+    int held;                  /* the bus thread owns the slot at head */
+    int done;                  /* the reader has queued its last page */
+    int failed;
+    struct input_stats stats;
+};
+
+/* reads from the peeked bytes first, then from fd; 0 at the end of the stream */
+static ssize_t input_read(struct image_input *in, int fd, unsigned char *data, size_t length)
+{
+    ssize_t n;
+
+    if( fd == in->source && in->peek_pos < in->peeked )
+    {
+        n = in->peeked - in->peek_pos < length ? in->peeked - in->peek_pos : length;
+        memcpy(data, in->peek + in->peek_pos, n);
+        in->peek_pos += n;
+        return n;
+    }
+    do
+        n = read(fd, data, length);
+    while( n < 0 && errno == EINTR );
+    if( n < 0 )
+        fprintf(stderr, "Failed to read the image: %s\n", strerror(errno));
+    return n;
+}
+
+/* exactly length bytes of the parsed stream; EXIT_FAILURE on a short image */
+static int input_fetch(struct image_input *in, unsigned char *data, size_t length)
+{
+    while( length > 0 )
+    {
+        size_t n;
+
+        if( in->pos == in->buffered )
+        {
+            ssize_t got = input_read(in, in->fd, in->buffer, sizeof(in->buffer));
+
+            if( got <= 0 )
+            {
+                if( got == 0 )
+                    fprintf(stderr, "The image ends in the middle of a sparse chunk.\n");
+                return EXIT_FAILURE;
+            }
+            in->buffered = got;
+            in->pos = 0;
+        }
+        n = in->buffered - in->pos < length ? in->buffered - in->pos : length;
+        memcpy(data, in->buffer + in->pos, n);
+        in->pos += n;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void *input_feeder(void *arg)
+{
+    struct image_input *in = arg;
+    unsigned char buffer[INPUT_BUFFER_SIZE];
+    sigset_t pipe_signal;
+    ssize_t n;
+
+    /* an early exit of the decompressor is reported by its status, not by SIGPIPE */
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    while( (n = input_read(in, in->source, buffer, sizeof(buffer))) > 0 )
+    {
+        for(ssize_t done = 0; done < n; )
+        {
+            ssize_t w = write(in->feed, buffer + done, n - done);
+
+            if( w < 0 && errno == EINTR )
+                continue;
+            if( w < 0 )
+            {
+                close(in->feed);
+                return NULL;
+            }
+            done += w;
+        }
+    }
+    close(in->feed);
+    return NULL;
+}
+
+/* starts tool -dc with the input on its stdin; its output becomes the stream */
+static int input_decompress(struct image_input *in, const char *tool)
+{
+    int to_tool[2], from_tool[2];
+
+    if( pipe2(to_tool, O_CLOEXEC) != 0 )
+        return EXIT_FAILURE;
+    if( pipe2(from_tool, O_CLOEXEC) != 0 )
+    {
+        close(to_tool[0]);
+        close(to_tool[1]);
+        return EXIT_FAILURE;
+    }
+
+    in->decompressor = fork();
+    if( in->decompressor == 0 )
+    {
+        dup2(to_tool[0], STDIN_FILENO);
+        dup2(from_tool[1], STDOUT_FILENO);
+        execlp(tool, tool, "-dc", (char *)NULL);
+        _exit(127);
+    }
+    close(to_tool[0]);
+    close(from_tool[1]);
+    if( in->decompressor < 0 )
+    {
+        close(to_tool[1]);
+        close(from_tool[0]);
+        return EXIT_FAILURE;
+    }
+
+    in->fd = from_tool[0];
+    in->feed = to_tool[1];
+    if( pthread_create(&in->feeder, NULL, input_feeder, in) != 0 )
+    {
+        close(in->feed);
+        in->feed = -1;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+/* queues the assembled page and waits for a free slot for the next one;
+ * called by the reader */
+static int input_queue(struct image_input *in)
+{
+    int ret;
+
+    pthread_mutex_lock(&in->lock);
+    in->page[(in->head + in->count) % INPUT_QUEUE_PAGES] = in->page_index;
+    in->count++;
+    in->stats.queued++;
+    pthread_cond_broadcast(&in->changed);
+    if( in->count == INPUT_QUEUE_PAGES )
+    {
+        in->stats.stalls++;
+        while( in->count == INPUT_QUEUE_PAGES && !in->failed )
+            pthread_cond_wait(&in->changed, &in->lock);
+    }
+    in->current = arena_buffer(in->arena, (in->head + in->count) % INPUT_QUEUE_PAGES);
+    ret = in->failed ? EXIT_FAILURE : 0;
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+/* appends length bytes to the image: data, the 4-byte fill pattern, or
+ * (both NULL) bytes that do not matter and are left erased */
+static int input_emit(struct image_input *in, const unsigned char *data, const unsigned char *pattern,
+    uint64_t length)
+{
+    int erased = data == NULL && (pattern == NULL || memcmp(pattern, "\xFF\xFF\xFF\xFF", 4) == 0);
+    uint64_t offset = 0;
+
+    while( offset < length )
+    {
+        size_t n = in->page_size - in->filled;
+        unsigned char *dst = in->current + in->filled;
+
+        /* whole erased pages are only counted */
+        if( erased && in->filled == 0 && length - offset >= in->page_size )
+        {
+            in->page_index += (length - offset) / in->page_size;
+            offset += (length - offset) / in->page_size * in->page_size;
+            continue;
+        }
+        if( n > length - offset )
+            n = length - offset;
+        if( data )
+            memcpy(dst, data + offset, n);
+        else if( pattern )
+            for(size_t k = 0; k < n; k++)
+                dst[k] = pattern[(offset + k) % 4];
+        else
+            memset(dst, 0xFF, n);
+        for(size_t k = 0; !erased && !in->needed && k < n; k++)
+            in->needed = dst[k] != 0xFF;
+        in->filled += n;
+        offset += n;
+
+        if( in->filled == in->page_size )
+        {
+            int ret = in->needed ? input_queue(in) : 0;
+
+            in->filled = 0;
+            in->needed = 0;
+            in->page_index++;
+            if( ret != 0 )
+                return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int input_parse_sparse(struct image_input *in)
+{
+    unsigned char header[SPARSE_HEADER_SIZE], chunk[SPARSE_CHUNK_SIZE], skip[64];
+    unsigned int header_size, chunk_header_size, block_size, chunks;
+
+    if( input_fetch(in, header, sizeof(header)) != 0 )
+        return EXIT_FAILURE;
+    header_size = header[8] | header[9] << 8;
+    chunk_header_size = header[10] | header[11] << 8;
+    block_size = get_le32(header + 12);
+    chunks = get_le32(header + 20);
+    if( header[4] != 1 || header_size < SPARSE_HEADER_SIZE || header_size - SPARSE_HEADER_SIZE > sizeof(skip)
+        || chunk_header_size < SPARSE_CHUNK_SIZE || chunk_header_size - SPARSE_CHUNK_SIZE > sizeof(skip)
+        || block_size == 0 || block_size % 4 != 0 )
+    {
+        fprintf(stderr, "Unsupported sparse image (version %u, block size %u).\n", header[4], block_size);
+        return EXIT_FAILURE;
+    }
+    if( input_fetch(in, skip, header_size - SPARSE_HEADER_SIZE) != 0 )
+        return EXIT_FAILURE;
+
+    for(unsigned int k = 0; k < chunks; k++)
+    {
+        unsigned int type;
+        uint64_t length;
+        unsigned char value[4];
+
+        if( input_fetch(in, chunk, sizeof(chunk)) != 0
+            || input_fetch(in, skip, chunk_header_size - SPARSE_CHUNK_SIZE) != 0 )
+            return EXIT_FAILURE;
+        type = chunk[0] | chunk[1] << 8;
+        length = (uint64_t)get_le32(chunk + 4) * block_size;
+
+        switch( type )
+        {
+            case SPARSE_CHUNK_RAW:
+                while( length > 0 )
+                {
+                    unsigned char data[4096];
+                    size_t n = length < sizeof(data) ? length : sizeof(data);
+
+                    if( input_fetch(in, data, n) != 0 || input_emit(in, data, NULL, n) != 0 )
+                        return EXIT_FAILURE;
+                    length -= n;
+                }
+                break;
+            case SPARSE_CHUNK_FILL:
+                if( input_fetch(in, value, 4) != 0 || input_emit(in, NULL, value, length) != 0 )
+                    return EXIT_FAILURE;
+                break;
+            case SPARSE_CHUNK_DONTCARE:
+                if( input_emit(in, NULL, NULL, length) != 0 )
+                    return EXIT_FAILURE;
+                break;
+            case SPARSE_CHUNK_CRC32:
+                if( input_fetch(in, value, 4) != 0 )
+                    return EXIT_FAILURE;
+                break;
+            default:
+                fprintf(stderr, "Unknown sparse chunk type %04Xh.\n", type);
+                return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
+
+static int input_parse_raw(struct image_input *in)
+{
+    for(;;)
+    {
+        ssize_t n;
+
+        if( in->pos < in->buffered )
+        {
+            if( input_emit(in, in->buffer + in->pos, NULL, in->buffered - in->pos) != 0 )
+                return EXIT_FAILURE;
+            in->pos = in->buffered;
+        }
+        n = input_read(in, in->fd, in->buffer, sizeof(in->buffer));
+        if( n <= 0 )
+            return n < 0 ? EXIT_FAILURE : 0;
+        in->buffered = n;
+        in->pos = 0;
+    }
+}
+
+static void *input_reader(void *arg)
+{
+    struct image_input *in = arg;
+    int ret;
+
+    /* the sparse magic is only complete once the decompressor produced it */
+    while( in->buffered < 4 )
+    {
+        ssize_t n = input_read(in, in->fd, in->buffer + in->buffered, sizeof(in->buffer) - in->buffered);
+
+        if( n <= 0 )
+            break;
+        in->buffered += n;
+    }
+    in->stats.sparse = in->buffered >= 4 && get_le32(in->buffer) == SPARSE_MAGIC;
+    ret = in->stats.sparse ? input_parse_sparse(in) : input_parse_raw(in);
+
+    /* a partial last page is padded with erased bytes */
+    if( ret == 0 && in->filled > 0 )
+        ret = input_emit(in, NULL, NULL, in->page_size - in->filled);
+
+    pthread_mutex_lock(&in->lock);
+    if( ret != 0 )
+        in->failed = 1;
+    in->stats.pages = in->page_index;
+    in->done = 1;
+    pthread_cond_broadcast(&in->changed);
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+}
+
+/* path: a file, a FIFO or INPUT_STDIN; NULL if the input cannot be opened */
+struct image_input *input_open(const char *path, unsigned int page_size)
+{
+    struct image_input *in = calloc(1, sizeof(*in));
+    ssize_t n;
+
+    if( in == NULL )
+        return NULL;
+    in->page_size = page_size;
+    in->feed = -1;
+    in->source = strcmp(path, INPUT_STDIN) == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+    if( in->source < 0 )
+    {
+        fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+        free(in);
+        return NULL;
+    }
+    in->fd = in->source;
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->changed, NULL);
+
+    in->arena = arena_create(page_size, INPUT_QUEUE_PAGES, arena_flags);
+    if( in->arena == NULL )
+        goto fail;
+    in->current = arena_buffer(in->arena, 0);
+
+    /* the magic of a compressed image; a short image is simply not compressed */
+    while( in->peeked < INPUT_PEEK_SIZE )
+    {
+        n = read(in->source, in->peek + in->peeked, INPUT_PEEK_SIZE - in->peeked);
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            break;
+        in->peeked += n;
+    }
+    for(unsigned int k = 0; k < sizeof(input_compressors) / sizeof(input_compressors[0]); k++)
+    {
+        if( in->peeked >= input_compressors[k].length
+            && memcmp(in->peek, input_compressors[k].magic, input_compressors[k].length) == 0 )
+        {
+            in->stats.compression = input_compressors[k].tool;
+            if( input_decompress(in, input_compressors[k].tool) != 0 )
+            {
+                fprintf(stderr, "unable to start %s: %s\n", input_compressors[k].tool, strerror(errno));
+                goto fail;
+            }
+            break;
+        }
+    }
+
+    if( pthread_create(&in->thread, NULL, input_reader, in) != 0 )
+    {
+        fprintf(stderr, "unable to start the image reader\n");
+        goto fail;
+    }
+    return in;
+
+fail:
+    if( in->fd != in->source )
+        close(in->fd);
+    if( in->feed >= 0 )
+        pthread_join(in->feeder, NULL);
+    if( in->decompressor > 0 )
+        waitpid(in->decompressor, NULL, 0);
+    arena_destroy(in->arena);
+    close(in->source);
+    free(in);
+    return NULL;
+}
+
+/* the next page that needs programming: *page is its index in the image and
+ * *data stays valid until the next call. At the end of the image *data is
+ * NULL and *page the number of pages in the image */
+int input_next(struct image_input *in, uint64_t *page, unsigned char **data)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&in->lock);
+    if( in->held )
+    {
+        in->head = (in->head + 1) % INPUT_QUEUE_PAGES;
+        in->count--;
+        in->held = 0;
+        pthread_cond_broadcast(&in->changed);
+    }
+    while( in->count == 0 && !in->done )
+        pthread_cond_wait(&in->changed, &in->lock);
+
+    if( in->failed )
+        ret = EXIT_FAILURE;
+    else if( in->count > 0 )
+    {
+        *page = in->page[in->head];
+        *data = arena_buffer(in->arena, in->head);
+        in->held = 1;
+    }
+    else
+    {
+        *page = in->stats.pages;
+        *data = NULL;
+    }
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+/* stops the reader (also in the middle of the image) and the decompressor;
+ * EXIT_FAILURE if the image could not be read completely */
+int input_close(struct image_input *in, struct input_stats *stats)
+{
+    int ret, status;
+
+    pthread_mutex_lock(&in->lock);
+    if( !in->done )
+        in->failed = 1; /* the bus thread gave up: let a waiting reader go */
+    pthread_cond_broadcast(&in->changed);
+    pthread_mutex_unlock(&in->lock);
+
+    /* closing the stream ends a reader blocked in read() at the latest when
+     * the decompressor notices; a plain input is read to its end */
+    pthread_join(in->thread, NULL);
+    ret = in->failed ? EXIT_FAILURE : 0;
+    if( in->decompressor > 0 )
+    {
+        close(in->fd);
+        pthread_join(in->feeder, NULL);
+        if( waitpid(in->decompressor, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+        {
+            if( ret == 0 )
+                fprintf(stderr, "%s could not unpack the image.\n", in->stats.compression);
+            ret = EXIT_FAILURE;
+        }
+    }
+    if( stats )
+        *stats = in->stats;
+    arena_destroy(in->arena);
+    close(in->source);
+    free(in);
+    return ret;
+}
+
+/* erases every block the image covers and programs the pages of the image
+ * that are not erased; the image starts at a block boundary. Blocks that bbt
+ * lists as bad are neither erased nor programmed, and a block that fails an
+ * erase or a program is retired (bbt_retire()) and skipped from then on */
+int program_image(const char *path, unsigned int nFirstPageId, struct bad_block_table *bbt)
+{
+    unsigned int page_size = nand_page_size_total();
+    unsigned int pages_per_block = nand_geometry.pages_per_block;
+    unsigned int next_block = nFirstPageId / pages_per_block;
+    unsigned int erased = 0, failed = 0, skipped = 0, retired = 0;
+    uint64_t dropped = 0;
+    struct image_input *in;
+    struct input_stats stats;
+    unsigned char *data;
+    uint64_t page;
+    int ret;
+
+    if( nFirstPageId % pages_per_block != 0 )
+    {
+        fprintf(stderr, "The image has to start at the first page of a block.\n");
+        return EXIT_FAILURE;
+    }
+    in = input_open(path, page_size);
+    if( in == NULL )
+        return EXIT_FAILURE;
+
+    while( (ret = input_next(in, &page, &data)) == 0 )
+    {
+        /* erase up to the block of this page, or up to the end of the image */
+        uint64_t end = data ? nFirstPageId + page + 1 : nFirstPageId + page;
+        unsigned int block = (unsigned int)((nFirstPageId + page) / pages_per_block);
+
+        if( end > nand_pages_total() )
+        {
+            fprintf(stderr, "The image is larger than the chip (%llu pages from page %u).\n",
+                (unsigned long long)(end - nFirstPageId), nFirstPageId);
+            ret = EXIT_FAILURE;
+            break;
+        }
+        for( ; (uint64_t)next_block * pages_per_block < end; next_block++ )
+        {
+            if( bbt_is_bad(bbt, next_block) )
+            {
+                dbg_printf("Skipping bad block %u\n", next_block);
+                skipped++;
+                continue;
+            }
+            dbg_printf("Erasing block %u\n", next_block);
+            erased++;
+            if( erase_block(next_block) != 0 )
+            {
+                failed++;
+                retired++;
+                bbt_retire(bbt, next_block);
+            }
+        }
+        if( data == NULL )
+            break;
+
+        /* the pages of a bad block are dropped, the image keeps its layout */
+        if( bbt_is_bad(bbt, block) )
+        {
+            dropped++;
+            continue;
+        }
+        dbg_printf("Programming page %llu\n", (unsigned long long)(nFirstPageId + page));
+        if( program_page(nFirstPageId + (unsigned int)page, data) != 0 )
+        {
+            failed++;
+            retired++;
+            bbt_retire(bbt, block);
+        }
+    }
+
+    if( input_close(in, &stats) != 0 )
+        ret = EXIT_FAILURE;
+    printf("image: %s%s%s, %llu pages, %llu programmed, %llu left erased, %u blocks erased,"
+        " reader waited %llu times\n",
+        stats.sparse ? "sparse" : "raw", stats.compression ? ", unpacked by " : "",
+        stats.compression ? stats.compression : "", (unsigned long long)stats.pages,
+        (unsigned long long)(stats.queued - dropped), (unsigned long long)(stats.pages - stats.queued), erased,
+        (unsigned long long)stats.stalls);
+    if( skipped || retired )
+        printf("bad blocks: %u skipped, %u retired, %llu pages of the image dropped\n",
+            skipped, retired, (unsigned long long)dropped);
+    if( failed )
+    {
+        fprintf(stderr, "%u blocks or pages could not be erased or programmed.\n", failed);
+        ret = EXIT_FAILURE;
+    }
+    return ret;
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file input.h
+ * \brief Streaming image input for programming the chip
+ * The image has the layout of a dump: pages of data plus spare area, one after
+ * the other. It is read from a file, a pipe or stdin ("-") by a thread of its
+ * own, which cuts it into pages and queues them for the bus thread, up to
+ * INPUT_QUEUE_PAGES ahead. A compressed image (gzip, xz, zstd, bzip2, lz4) is
+ * recognized by its magic and unpacked by the matching tool in a child
+ * process. Android sparse images are expanded on the fly: "don't care" chunks
+ * become erased bytes, and pages that end up completely erased (don't care,
+ * 0xFF fills or plain 0xFF data) are not queued at all, as the erase already
+ * left them in that state.
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdint.h>
+
+#define INPUT_QUEUE_PAGES 64
+#define INPUT_STDIN       "-"
+
+struct input_stats
+{
+    const char *compression;  /* tool that unpacked the image, NULL: not compressed */
+    int sparse;               /* Android sparse image */
+    uint64_t pages;           /* pages in the image */
+    uint64_t queued;          /* pages that need programming */
+    uint64_t stalls;          /* times the reader waited for the bus thread */
+};
+
+struct image_input;
+struct bad_block_table;
+
+struct image_input *input_open(const char *path, unsigned int page_size);
+int input_next(struct image_input *in, uint64_t *page, unsigned char **data);
+int input_close(struct image_input *in, struct input_stats *stats);
+int program_image(const char *path, unsigned int nFirstPageId, struct bad_block_table *bbt);
+
+#endif /* INPUT_H */
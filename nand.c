@@ -0,0 +1,1640 @@
+/* 
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file nand.c
+ * \brief NAND flash bus operations (command, address and data input, data output)
+ * The pin states are kept locally and written to the chip through the selected
+ * bus backend, so the same code drives real hardware and the simulated chip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "nand.h"
+#include "trace.h"
+#include "arena.h"
+#include "output.h"
+
+const unsigned char CMD_READID = 0x90; /* read ID register */
+const unsigned char CMD_READ1[2] = { 0x00, 0x30 }; /* page read */
+const unsigned char CMD_BLOCKERASE[2] = { 0x60, 0xD0 }; /* block erase */
+const unsigned char CMD_READSTATUS = 0x70; /* read status */
+const unsigned char CMD_PAGEPROGRAM[2] = { 0x80, 0x10 }; /* program page */
+const unsigned char CMD_RESET = 0xFF; /* reset */
+const unsigned char CMD_READPARAM = 0xEC; /* read parameter page */
+const unsigned char CMD_READUNIQUEID = 0xED; /* read unique ID */
+const unsigned char CMD_SETFEATURES = 0xEF; /* set features */
+
+unsigned char iobus_value;
+unsigned char controlbus_value;
+
+const struct bus_backend *bus;
+
+struct nand_geometry nand_geometry = { PAGE_SIZE_NOSPARE, PAGE_SIZE - PAGE_SIZE_NOSPARE, 64, 4096 };
+
+int verbose = 1;
+
+/* tBERS is 10 ms max.; ten repeats back off for about a second in total,
+ * long enough for a USB device to re-enumerate */
+struct nand_recovery nand_recovery = { 10, 2, 20000, 1000 };
+struct nand_error_stats nand_errors;
+
+void controlbus_reset_value()
+{
+    controlbus_value = 0x00;
+}
+
+void controlbus_pin_set(unsigned char pin, onoff_t val)
+{
+    if(val == ON)
+        controlbus_value |= pin;
+    else
+        controlbus_value &= (unsigned char)0xFF ^ pin;
+}
+
+void controlbus_update_output()
+{
+    trace_record(TRACE_CONTROLBUS_OUT, controlbus_value);
+    if( bus->write_controlbus(controlbus_value) < 0 )
+        nand_errors.bus_errors++;
+}
+
+void test_controlbus()
+{
+    #define CONTROLBUS_TEST_DELAY 1000000 /* 1 sec */
+
+    printf("  CLE on\n");
+    controlbus_pin_set(PIN_CLE, ON);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  ALE on\n");
+    controlbus_pin_set(PIN_ALE, ON);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  nCE on\n");
+    controlbus_pin_set(PIN_nCE, ON);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  nWE on\n");
+    controlbus_pin_set(PIN_nWE, ON);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+
+    printf("  nRE on\n");
+    controlbus_pin_set(PIN_nRE, ON);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  nWP on\n");
+    controlbus_pin_set(PIN_nWP, ON);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  LED on\n");
+    controlbus_pin_set(PIN_LED, ON);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+
+    printf("  CLE off\n");
+    controlbus_pin_set(PIN_CLE, OFF);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  ALE off\n");
+    controlbus_pin_set(PIN_ALE, OFF);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  nCE off\n");
+    controlbus_pin_set(PIN_nCE, OFF);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  nWE off\n");
+    controlbus_pin_set(PIN_nWE, OFF);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  nRE off\n");
+    controlbus_pin_set(PIN_nRE, OFF);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  nWP off\n");
+    controlbus_pin_set(PIN_nWP, OFF);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+
+    printf("  LED off\n");
+    controlbus_pin_set(PIN_LED, OFF);
+    controlbus_update_output();
+    bus->delay_us(CONTROLBUS_TEST_DELAY);
+}
+
+void iobus_set_direction(iobus_inout_t inout)
+{
+    trace_record(TRACE_IOBUS_DIR, inout == IOBUS_OUT);
+    if( bus->set_iobus_direction(inout) < 0 )
+        nand_errors.bus_errors++;
+}
+
+void iobus_reset_value()
+{
+    iobus_value = 0x00;
+}
+
+void iobus_pin_set(unsigned char pin, onoff_t val)
+{
+    if(val == ON)
+        iobus_value |= pin;
+    else
+        iobus_value &= (unsigned char)0xFF ^ pin;
+}
+
+void iobus_set_value(unsigned char value)
+{
+    iobus_value = value;
+}
+
+void iobus_update_output()
+{
+    trace_record(TRACE_IOBUS_OUT, iobus_value);
+    if( bus->write_iobus(iobus_value) < 0 )
+        nand_errors.bus_errors++;
+}
+
+unsigned char iobus_read_input()
+{
+    unsigned char value = bus->read_iobus();
+    trace_record(TRACE_IOBUS_IN, value);
+    return value;
+}
+
+unsigned char controlbus_read_input()
+{
+    unsigned char value = bus->read_controlbus();
+    trace_record(TRACE_CONTROLBUS_IN, value);
+    return value;
+}
+
+
+void test_iobus()
+{
+    #define IOBUS_TEST_DELAY 1000000 /* 1 sec */
+
+    printf("  DIO0 on\n");
+    iobus_pin_set(PIN_DIO0, ON);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    printf("  DIO1 on\n");
+    iobus_pin_set(PIN_DIO1, ON);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    printf("  DIO2 on\n");
+    iobus_pin_set(PIN_DIO2, ON);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    printf("  DIO3 on\n");
+    iobus_pin_set(PIN_DIO3, ON);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    printf("  DIO4 on\n");
+    iobus_pin_set(PIN_DIO4, ON);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    printf("  DIO5 on\n");
+    iobus_pin_set(PIN_DIO5, ON);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    printf("  DIO6 on\n");
+    iobus_pin_set(PIN_DIO6, ON);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    printf("  DIO7 on\n");
+    iobus_pin_set(PIN_DIO7, ON);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+
+    iobus_pin_set(PIN_DIO0, OFF);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    iobus_pin_set(PIN_DIO1, OFF);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    iobus_pin_set(PIN_DIO2, OFF);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    iobus_pin_set(PIN_DIO3, OFF);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    iobus_pin_set(PIN_DIO4, OFF);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    iobus_pin_set(PIN_DIO5, OFF);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    iobus_pin_set(PIN_DIO6, OFF);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    iobus_pin_set(PIN_DIO7, OFF);
+    iobus_update_output();
+    bus->delay_us(IOBUS_TEST_DELAY);
+
+    bus->delay_us(5 * IOBUS_TEST_DELAY);
+    iobus_set_value(0xFF);
+    iobus_update_output();
+    bus->delay_us(5 * IOBUS_TEST_DELAY);
+    iobus_set_value(0xAA);
+    iobus_update_output();
+    bus->delay_us(5 * IOBUS_TEST_DELAY);
+    iobus_set_value(0x55);
+    iobus_update_output();
+    bus->delay_us(5 * IOBUS_TEST_DELAY);
+    iobus_set_value(0x00);
+    iobus_update_output();
+
+    
+    iobus_pin_set(PIN_DIO0, ON);
+    iobus_pin_set(PIN_DIO2, ON);
+    iobus_pin_set(PIN_DIO4, ON);
+    iobus_pin_set(PIN_DIO6, ON);
+    iobus_update_output();
+    bus->delay_us(2* 100000);
+
+}
+
+/* "Command Input bus operation is used to give a command to the memory device. Command are accepted with Chip
+Enable low, Command Latch Enable High, Address Latch Enable low and Read Enable High and latched on the rising
+edge of Write Enable. Moreover for commands that starts a modify operation (write/erase) the Write Protect pin must be
+high."" */
+int latch_command(unsigned char command)
+{
+    /* check if ALE is low and nRE is high */
+    if( controlbus_value & PIN_nCE )
+    {
+        trace_trigger();
+        fprintf(stderr, "latch_command requires nCE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+    else if( ~controlbus_value & PIN_nRE )
+    {
+        trace_trigger();
+        fprintf(stderr, "latch_command requires nRE pin to be high\n");
+        return EXIT_FAILURE;
+    }
+
+    /* debug info */
+    dbg_printf("latch_command(0x%02X)\n", command);
+
+    /* toggle CLE high (activates the latching of the IO inputs inside the 
+     * Command Register on the Rising edge of nWE) */
+    dbg_printf("  setting CLE high\n");
+    controlbus_pin_set(PIN_CLE, ON);
+    controlbus_update_output();
+
+    // toggle nWE low
+    dbg_printf("  setting nWE low\n");
+    controlbus_pin_set(PIN_nWE, OFF);
+    controlbus_update_output();
+
+    // change I/O pins
+    dbg_printf("  setting I/O bus to command\n");
+    iobus_set_value(command);
+    iobus_update_output();
+
+    // toggle nWE back high (acts as clock to latch the command!)
+    dbg_printf("  setting nWE high\n");
+    controlbus_pin_set(PIN_nWE, ON);
+    controlbus_update_output();
+
+    // toggle CLE low
+    dbg_printf("  setting CLE low\n");
+    controlbus_pin_set(PIN_CLE, OFF);
+    controlbus_update_output();
+
+    return 0;
+}
+
+/** 
+ * "Address Input bus operation allows the insertion of the memory address. 
+ * Five cycles are required to input the addresses for the 4Gbit devices. 
+ * Addresses are accepted with Chip Enable low, Address Latch Enable High, Command Latch Enable low and 
+ * Read Enable High and latched on the rising edge of Write Enable.
+ * Moreover for commands that starts a modifying operation (write/erase) the Write Protect pin must be high. 
+ * See Figure 5 and Table 13 for details of the timings requirements.
+ * Addresses are always applied on IO7:0 regardless of the bus configuration (x8 or x16).""
+ */
+int latch_address(unsigned char address[], unsigned int addr_length)
+{
+    unsigned int addr_idx = 0;
+
+    /* check if ALE is low and nRE is high */
+    if( controlbus_value & PIN_nCE )
+    {
+        trace_trigger();
+        fprintf(stderr, "latch_address requires nCE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+    else if( controlbus_value & PIN_CLE )
+    {
+        trace_trigger();
+        fprintf(stderr, "latch_address requires CLE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+    else if( ~controlbus_value & PIN_nRE )
+    {
+        trace_trigger();
+        fprintf(stderr, "latch_address requires nRE pin to be high\n");
+        return EXIT_FAILURE;
+    }
+
+    /* toggle ALE high (activates the latching of the IO inputs inside
+     * the Address Register on the Rising edge of nWE. */
+    controlbus_pin_set(PIN_ALE, ON);
+    controlbus_update_output();
+
+    for(addr_idx = 0; addr_idx < addr_length; addr_idx++)
+    {
+        // toggle nWE low
+        controlbus_pin_set(PIN_nWE, OFF);
+        controlbus_update_output();
+        bus->delay_us(REALWORLD_DELAY);
+
+        // change I/O pins
+        iobus_set_value(address[addr_idx]);
+        iobus_update_output();
+        bus->delay_us(REALWORLD_DELAY); /* TODO: assure setup delay */
+
+        // toggle nWE back high (acts as clock to latch the current address byte!)
+        controlbus_pin_set(PIN_nWE, ON);
+        controlbus_update_output();
+        bus->delay_us(REALWORLD_DELAY); /* TODO: assure hold delay */
+    }
+
+    // toggle ALE low
+    controlbus_pin_set(PIN_ALE, OFF);
+    controlbus_update_output();
+
+    // wait for ALE to nRE Delay tAR before nRE is taken low (nanoseconds!)
+
+    return 0;
+}
+
+/* Data Output bus operation allows to read data from the memory array and to 
+ * check the status register content, the EDC register content and the ID data.
+ * Data can be serially shifted out by toggling the Read Enable pin with Chip 
+ * Enable low, Write Enable High, Address Latch Enable low, and Command Latch 
+ * Enable low. */
+int latch_register(unsigned char reg[], unsigned int reg_length)
+{
+    unsigned int addr_idx = 0;
+
+    /* check if ALE is low and nRE is high */
+    if( controlbus_value & PIN_nCE )
+    {
+        trace_trigger();
+        fprintf(stderr, "latch_address requires nCE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+    else if( ~controlbus_value & PIN_nWE )
+    {
+        trace_trigger();
+        fprintf(stderr, "latch_address requires nWE pin to be high\n");
+        return EXIT_FAILURE;
+    }
+    else if( controlbus_value & PIN_ALE )
+    {
+        trace_trigger();
+        fprintf(stderr, "latch_address requires ALE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+
+    iobus_set_direction(IOBUS_IN);
+
+    for(addr_idx = 0; addr_idx < reg_length; addr_idx++)
+    {
+        /* toggle nRE low; acts like a clock to latch out the data;
+         * data is valid tREA after the falling edge of nRE 
+         * (also increments the internal column address counter by one) */
+        controlbus_pin_set(PIN_nRE, OFF);
+        controlbus_update_output();
+        bus->delay_us(REALWORLD_DELAY); /* TODO: assure tREA delay */
+
+        // read I/O pins
+        reg[addr_idx] = iobus_read_input();
+
+        // toggle nRE back high
+        controlbus_pin_set(PIN_nRE, ON);
+        controlbus_update_output();
+        bus->delay_us(REALWORLD_DELAY); /* TODO: assure tREH and tRHZ delays */
+    }
+
+    iobus_set_direction(IOBUS_OUT);
+
+    return 0;
+}
+
+void read_ID_register(unsigned char* ID_register)
+{
+    unsigned char address[] = { 0x00 };
+
+    latch_command(CMD_READID); /* command input operation; command: READ ID */
+    latch_address(address, 1); /* address input operation */
+    latch_register(ID_register, 5); /* data output operation */
+}
+
+void check_ID_register(unsigned char* ID_register)
+{
+    unsigned char ID_register_exp[5] = { 0xAD, 0xDC, 0x10, 0x95, 0x54 };
+
+    /* output the retrieved ID register content */
+    printf("actual ID register:   0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+        ID_register[0], ID_register[1], ID_register[2],
+        ID_register[3], ID_register[4] ); 
+
+    /* output the expected ID register content */
+    printf("expected ID register: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+        ID_register_exp[0], ID_register_exp[1], ID_register_exp[2],
+        ID_register_exp[3], ID_register_exp[4] ); 
+
+    if( strncmp( (char *)ID_register_exp, (char *)ID_register, 5 ) == 0 )
+    {
+        printf("PASS: ID register did match\n");
+    }
+    else
+    {
+        printf("FAIL: ID register did not match\n");
+    }
+}
+
+static unsigned int parity8(unsigned char value)
+{
+    value ^= value >> 4;
+    value ^= value >> 2;
+    value ^= value >> 1;
+    return value & 1;
+}
+
+/* software Hamming code of the Linux MTD layer: 3 bytes per 256 data bytes,
+ * line parities rp15..rp8 in code[0] and rp7..rp0 in code[1] (the default
+ * order, not the SmartMedia one), column parities in code[2] */
+void nand_ecc_hamming(const unsigned char *data, unsigned char code[3])
+{
+    unsigned char odd[8] = { 0 }, all = 0;
+
+    /* the parity of the bytes whose index has bit n set; bit n clear is the rest */
+    for(unsigned int i = 0; i < NAND_ECC_STEP; i++)
+    {
+        all ^= data[i];
+        for(unsigned int bit = 0; bit < 8; bit++)
+            if( i & (1u << bit) )
+                odd[bit] ^= data[i];
+    }
+    code[0] = code[1] = 0;
+    for(unsigned int bit = 0; bit < 8; bit++)
+    {
+        unsigned int even = !parity8(all ^ odd[bit]), set = !parity8(odd[bit]);
+
+        if( bit < 4 )
+            code[1] |= (even << (2 * bit)) | (set << (2 * bit + 1));
+        else
+            code[0] |= (even << (2 * bit - 8)) | (set << (2 * bit - 7));
+    }
+    code[2] = (!parity8(all & 0xF0) << 7) | (!parity8(all & 0x0F) << 6) | (!parity8(all & 0xCC) << 5)
+        | (!parity8(all & 0x33) << 4) | (!parity8(all & 0xAA) << 3) | (!parity8(all & 0x55) << 2) | 0x03;
+}
+
+/* fills the Hamming ECC of the data area into the last 3 bytes per 256 of the
+ * spare area, as the Linux software ECC writes it */
+void nand_ecc_page(unsigned char *page)
+{
+    unsigned int steps = nand_geometry.page_size / NAND_ECC_STEP;
+    unsigned char *code = page + nand_geometry.page_size + nand_geometry.spare_size - 3 * steps;
+
+    if( 3 * steps > nand_geometry.spare_size )
+        return;
+    for(unsigned int k = 0; k < steps; k++)
+        nand_ecc_hamming(page + k * NAND_ECC_STEP, code + 3 * k);
+}
+
+/* CRC-16 of the ONFI parameter page: polynomial 8005h, initial value 4F4Eh, MSB first */
+uint16_t onfi_crc16(const unsigned char* data, unsigned int length)
+{
+    uint16_t crc = 0x4F4E;
+
+    for(unsigned int k = 0; k < length; k++)
+    {
+        crc ^= (uint16_t)data[k] << 8;
+        for(unsigned int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+/* Read Parameter Page: command ECh, address 00h, wait for tR, then latch out
+ * the redundant copies of the page */
+int read_parameter_page(unsigned char* data, unsigned int length)
+{
+    unsigned char address[] = { 0x00 };
+    uint64_t bus_errors = nand_errors.bus_errors;
+    int ret;
+
+    latch_command(CMD_READPARAM);
+    latch_address(address, 1);
+    ret = wait_ready();
+    if( ret != 0 )
+        return ret;
+    latch_register(data, length);
+
+    return nand_errors.bus_errors != bus_errors ? NAND_FAIL_BUS : 0;
+}
+
+static int parameter_page_crc_ok(const unsigned char* page)
+{
+    return onfi_crc16(page, ONFI_PARAM_PAGE_SIZE - 2) ==
+        (page[ONFI_PARAM_PAGE_SIZE - 2] | (page[ONFI_PARAM_PAGE_SIZE - 1] << 8));
+}
+
+/* Reads all redundant copies of the parameter page in one burst and takes the
+ * first one with a valid CRC. If no copy is intact the copies are voted bitwise
+ * (a bit is set if it is set in most copies), which repairs errors that hit
+ * different bytes in different copies; returns NAND_FAIL_STATUS if the voted
+ * page does not pass the CRC either */
+int read_valid_parameter_page(unsigned char* page)
+{
+    unsigned char copies[ONFI_PARAM_PAGE_COPIES * ONFI_PARAM_PAGE_SIZE];
+    unsigned int votes;
+    int ret;
+
+    ret = read_parameter_page(copies, sizeof(copies));
+    if( ret != 0 )
+        return ret;
+
+    for(unsigned int n = 0; n < ONFI_PARAM_PAGE_COPIES; n++)
+    {
+        if( parameter_page_crc_ok(&copies[n * ONFI_PARAM_PAGE_SIZE]) )
+        {
+            if( n > 0 )
+                dbg_printf("Parameter page copy %u is the first intact copy\n", n);
+            memcpy(page, &copies[n * ONFI_PARAM_PAGE_SIZE], ONFI_PARAM_PAGE_SIZE);
+            return 0;
+        }
+    }
+
+    for(unsigned int k = 0; k < ONFI_PARAM_PAGE_SIZE; k++)
+    {
+        page[k] = 0;
+        for(unsigned int bit = 0; bit < 8; bit++)
+        {
+            votes = 0;
+            for(unsigned int n = 0; n < ONFI_PARAM_PAGE_COPIES; n++)
+                votes += (copies[n * ONFI_PARAM_PAGE_SIZE + k] >> bit) & 1;
+            if( 2 * votes > ONFI_PARAM_PAGE_COPIES )
+                page[k] |= 1 << bit;
+        }
+    }
+    if( parameter_page_crc_ok(page) )
+    {
+        dbg_printf("Parameter page repaired by voting over %u copies\n", ONFI_PARAM_PAGE_COPIES);
+        return 0;
+    }
+
+    dbg_printf("No intact copy of the parameter page\n");
+    return NAND_FAIL_STATUS;
+}
+
+static uint32_t get_le(const unsigned char* p, unsigned int bytes)
+{
+    uint32_t value = 0;
+
+    while( bytes-- )
+        value = (value << 8) | p[bytes];
+    return value;
+}
+
+/* Takes geometry, address cycles (byte 101: column cycles in the high, row cycles
+ * in the low nibble) and optional features from one copy of the parameter page;
+ * returns 1 if the signature or the CRC (bytes 254..255) does not match or the
+ * reader cannot address the geometry */
+int parse_parameter_page(const unsigned char* page, struct nand_geometry* geometry, unsigned int* features)
+{
+    unsigned int optional_commands;
+
+    if( memcmp(page, "ONFI", 4) != 0 || !parameter_page_crc_ok(page) )
+        return 1;
+
+    geometry->page_size = get_le(&page[80], 4);
+    geometry->spare_size = get_le(&page[84], 2);
+    geometry->pages_per_block = get_le(&page[92], 4);
+    geometry->blocks = get_le(&page[96], 4) * (page[100] ? page[100] : 1);
+    geometry->column_cycles = page[101] >> 4;
+    geometry->row_cycles = page[101] & 0x0F;
+    if( geometry->page_size == 0 || geometry->pages_per_block == 0 || geometry->blocks == 0 )
+        return 1;
+    if( !nand_geometry_addressable(geometry) )
+    {
+        fprintf(stderr, "Geometry of the parameter page (%u + %u bytes per page, %u + %u address cycles) "
+            "is not supported.\n", geometry->page_size, geometry->spare_size,
+            nand_column_cycles(geometry), nand_row_cycles(geometry));
+        return 1;
+    }
+
+    optional_commands = get_le(&page[8], 2);
+    *features = NAND_FEATURE_ONFI;
+    if( optional_commands & 0x0002 )
+        *features |= NAND_FEATURE_CACHE_READ;
+    if( optional_commands & 0x0004 )
+        *features |= NAND_FEATURE_SET_FEATURES;
+    if( optional_commands & 0x0020 )
+        *features |= NAND_FEATURE_UNIQUE_ID;
+    return 0;
+}
+
+/* Read Unique ID: command EDh, address 00h, wait for tR; every copy is followed by
+ * its complement, the first copy that matches its complement is taken */
+int read_unique_id(unsigned char* unique_id)
+{
+    unsigned char address[] = { 0x00 };
+    unsigned char copy[2 * UNIQUE_ID_SIZE];
+    uint64_t bus_errors = nand_errors.bus_errors;
+    unsigned int k;
+    int ret;
+
+    latch_command(CMD_READUNIQUEID);
+    latch_address(address, 1);
+    ret = wait_ready();
+    if( ret != 0 )
+        return ret;
+
+    for(unsigned int n = 0; n < UNIQUE_ID_COPIES; n++)
+    {
+        latch_register(copy, sizeof(copy));
+        if( nand_errors.bus_errors != bus_errors )
+            return NAND_FAIL_BUS;
+        for(k = 0; k < UNIQUE_ID_SIZE && (copy[k] ^ copy[UNIQUE_ID_SIZE + k]) == 0xFF; k++)
+            ;
+        if( k == UNIQUE_ID_SIZE )
+        {
+            memcpy(unique_id, copy, UNIQUE_ID_SIZE);
+            return 0;
+        }
+        dbg_printf("Unique ID copy %u does not match its complement\n", n);
+    }
+
+    fprintf(stderr, "No valid copy of the unique ID.\n");
+    return NAND_FAIL_STATUS;
+}
+
+/* Set Features: command EFh, feature address, four parameter bytes, wait for tFEAT */
+int set_feature(unsigned char feature, const unsigned char* parameters)
+{
+    unsigned char address[] = { feature };
+    unsigned char data[4];
+    uint64_t bus_errors = nand_errors.bus_errors;
+    int ret;
+
+    memcpy(data, parameters, sizeof(data));
+    latch_command(CMD_SETFEATURES);
+    latch_address(address, 1);
+    latch_data_out(data, sizeof(data));
+    ret = wait_ready();
+    if( ret != 0 )
+        return ret;
+
+    return nand_errors.bus_errors != bus_errors ? NAND_FAIL_BUS : 0;
+}
+
+/* Reads the first pages of the OTP area: switches the array operation mode to OTP,
+ * reads the pages like normal pages and switches back */
+int read_otp_area(unsigned char* data, unsigned int nPages)
+{
+    unsigned char mode[4] = { FEATURE_MODE_OTP, 0, 0, 0 };
+    int ret;
+
+    if( nPages > NAND_OTP_PAGES )
+        nPages = NAND_OTP_PAGES;
+
+    ret = set_feature(FEATURE_ARRAY_OPERATION_MODE, mode);
+    for(unsigned int k = 0; ret == 0 && k < nPages; k++)
+        ret = read_page(NAND_OTP_FIRST_PAGE + k, data + (size_t)k * nand_page_size_total());
+
+    mode[0] = FEATURE_MODE_NORMAL;
+    if( set_feature(FEATURE_ARRAY_OPERATION_MODE, mode) != 0 && ret == 0 )
+        ret = NAND_FAIL_BUS;
+    return ret;
+}
+
+/* Geometry of pre-ONFI chips from the 4th and 5th ID byte (Samsung / Hynix scheme):
+ * page size 1 KiB << n, spare 8 or 16 bytes per 512 bytes, block size 64 KiB << n,
+ * number of planes and plane size 64 Mbit << n, the address cycles are derived;
+ * returns 1 if the bytes make no sense or the reader cannot address the geometry */
+int decode_ID_geometry(const unsigned char* ID_register, struct nand_geometry* geometry)
+{
+    unsigned char id4 = ID_register[3], id5 = ID_register[4];
+    uint64_t chip_size = ((uint64_t)8 << 20 << ((id5 >> 4) & 0x07)) << ((id5 >> 2) & 0x03);
+    unsigned int block_size = (64 * 1024) << ((id4 >> 4) & 0x03);
+
+    if( ID_register[0] == 0x00 || ID_register[0] == 0xFF )
+        return 1;
+
+    geometry->page_size = 1024 << (id4 & 0x03);
+    geometry->spare_size = (geometry->page_size / 512) * ((id4 & 0x04) ? 16 : 8);
+    geometry->pages_per_block = block_size / geometry->page_size;
+    geometry->blocks = (unsigned int)(chip_size / block_size);
+    geometry->column_cycles = 0;
+    geometry->row_cycles = 0;
+    return nand_geometry_addressable(geometry) ? 0 : 1;
+}
+
+/* Factory bad block marker: first spare byte of the first or second page of the
+ * block is not FFh; a block that cannot be read is reported as bad as well */
+int is_factory_bad_block(unsigned int nBlockId)
+{
+    unsigned char marker;
+
+    for(unsigned int k = 0; k < 2; k++)
+    {
+        if( read_page_part(nBlockId * nand_geometry.pages_per_block + k, nand_geometry.page_size, &marker, 1) != 0 ||
+            marker != 0xFF )
+            return 1;
+    }
+    return 0;
+}
+
+/* smallest number of address cycles that holds values up to max_value, at least two */
+static unsigned int nand_cycles_for(uint32_t max_value)
+{
+    unsigned int cycles = 2;
+
+    while( cycles < 4 && (max_value >> (8 * cycles)) != 0 )
+        cycles++;
+    return cycles;
+}
+
+/* Column address cycles of the geometry: from the parameter page if it gave them,
+ * enough for the page including the spare area otherwise */
+unsigned int nand_column_cycles(const struct nand_geometry* geometry)
+{
+    if( geometry->column_cycles )
+        return geometry->column_cycles;
+    return nand_cycles_for(geometry->page_size + geometry->spare_size - 1);
+}
+
+/* Row address cycles of the geometry: from the parameter page if it gave them,
+ * enough for the last page of the chip otherwise */
+unsigned int nand_row_cycles(const struct nand_geometry* geometry)
+{
+    if( geometry->row_cycles )
+        return geometry->row_cycles;
+    return nand_cycles_for(geometry->pages_per_block * geometry->blocks - 1);
+}
+
+/* The reader can address the geometry: the address cycles fit the bus sequences
+ * and every column (spare area included) and page fits in its cycles */
+int nand_geometry_addressable(const struct nand_geometry* geometry)
+{
+    unsigned int column_cycles = nand_column_cycles(geometry);
+    unsigned int row_cycles = nand_row_cycles(geometry);
+    uint64_t pages = (uint64_t)geometry->pages_per_block * geometry->blocks;
+
+    if( column_cycles > NAND_MAX_COLUMN_CYCLES || row_cycles > NAND_MAX_ROW_CYCLES )
+        return 0;
+    return (uint64_t)geometry->page_size + geometry->spare_size <= (uint64_t)1 << (8 * column_cycles) &&
+        pages <= (uint64_t)1 << (8 * row_cycles);
+}
+
+/* Address cycles of a page: the row cycles alone, as for Block Erase; returns their number */
+unsigned int nand_row_address(unsigned int nPageId, unsigned char* cycles)
+{
+    unsigned int row_cycles = nand_row_cycles(&nand_geometry);
+
+    for(unsigned int k = 0; k < row_cycles; k++)
+        cycles[k] = (unsigned char)(nPageId >> (8 * k));
+    return row_cycles;
+}
+
+/* Address cycles of a byte in a page: the column cycles, then the row cycles,
+ * both least significant byte first; returns their number */
+unsigned int nand_page_address(unsigned int nPageId, unsigned int nColumn, unsigned char* cycles)
+{
+    unsigned int column_cycles = nand_column_cycles(&nand_geometry);
+
+    for(unsigned int k = 0; k < column_cycles; k++)
+        cycles[k] = (unsigned char)(nColumn >> (8 * k));
+    return column_cycles + nand_row_address(nPageId, cycles + column_cycles);
+}
+
+/* Bus state of one reader; lets a single thread switch between several readers */
+void nand_save_bus_state(struct nand_bus_state *state)
+{
+    state->bus = bus;
+    state->controlbus_value = controlbus_value;
+    state->iobus_value = iobus_value;
+    state->geometry = nand_geometry;
+}
+
+void nand_restore_bus_state(const struct nand_bus_state *state)
+{
+    bus = state->bus;
+    controlbus_value = state->controlbus_value;
+    iobus_value = state->iobus_value;
+    nand_geometry = state->geometry;
+}
+
+/* Pin setup before the first command: nRE and nWE high, nCE low and
+ * nWP low (hardware protection against undesired program / erase operations) */
+void nand_select_chip(void)
+{
+    controlbus_pin_set(PIN_nRE, ON);
+    controlbus_pin_set(PIN_nWE, ON);
+    controlbus_pin_set(PIN_nCE, OFF);
+    controlbus_pin_set(PIN_nWP, OFF);
+    controlbus_update_output();
+}
+
+unsigned int nand_page_size_total(void)
+{
+    return nand_geometry.page_size + nand_geometry.spare_size;
+}
+
+unsigned int nand_pages_total(void)
+{
+    return nand_geometry.pages_per_block * nand_geometry.blocks;
+}
+
+/* one sample of the busy line; returns 1 if the chip is ready */
+int poll_ready(void)
+{
+    unsigned char controlbus_val;
+    uint64_t bus_errors = nand_errors.bus_errors;
+
+    controlbus_val = controlbus_read_input();
+    if( nand_errors.bus_errors != bus_errors )
+    {
+        /* a lost sample is harmless, the next one is taken anyway */
+        nand_errors.bus_errors = bus_errors;
+        nand_errors.lost_polls++;
+        return 0;
+    }
+    return (controlbus_val & PIN_RDY) != 0;
+}
+
+/* busy-wait for high level at the busy line; returns NAND_FAIL_TIMEOUT if
+ * the chip is still busy after the configured timeout */
+int wait_ready(void)
+{
+    uint64_t deadline = bus->now_ns() + (uint64_t)nand_recovery.busy_timeout_us * 1000;
+
+    dbg_printf("Checking for busy line...\n");
+    while( !poll_ready() )
+    {
+        if( bus->now_ns() > deadline )
+        {
+            nand_errors.busy_timeouts++;
+            trace_trigger();
+            fprintf(stderr, "Timeout waiting for the busy line.\n");
+            return NAND_FAIL_TIMEOUT;
+        }
+    }
+
+    dbg_printf("  done\n");
+    return 0;
+}
+
+int reset_chip(void)
+{
+    nand_errors.resets++;
+    dbg_printf("Resetting the chip...\n");
+
+    controlbus_pin_set(PIN_nRE, ON);
+    controlbus_pin_set(PIN_nWE, ON);
+    controlbus_pin_set(PIN_CLE, OFF);
+    controlbus_pin_set(PIN_ALE, OFF);
+    iobus_set_direction(IOBUS_OUT);
+    latch_command(CMD_RESET);
+    return wait_ready();
+}
+
+/**
+ * Runs a page or block operation and repeats it after a chip reset as long as
+ * it fails with a busy timeout or a bus error. A failed status (IO0) is the
+ * chip's verdict on the cells and is returned without retrying.
+ * Program and erase are not confirmed after a bus error during the setup, so
+ * a repeat never builds on a half-loaded page or a wrong block address.
+ */
+static int nand_retry(const char *what, unsigned int nId,
+    int (*operation)(unsigned int, unsigned int, unsigned char *, unsigned int),
+    unsigned int nColumn, unsigned char *data, unsigned int length)
+{
+    int ret;
+
+    for(unsigned int attempt = 0; ; attempt++)
+    {
+        ret = operation(nId, nColumn, data, length);
+        if( ret == 0 || ret == NAND_FAIL_STATUS )
+            return ret;
+        if( attempt >= nand_recovery.max_retries )
+            break;
+
+        nand_errors.retries++;
+        dbg_printf("%s %u failed (%d), retrying\n", what, nId, ret);
+        bus->delay_us(nand_recovery.retry_delay_us << (attempt < 16 ? attempt : 16));
+        reset_chip();
+    }
+
+    nand_errors.failures++;
+    trace_trigger();
+    fprintf(stderr, "%s %u failed after %u retries.\n", what, nId, nand_recovery.max_retries);
+    return ret;
+}
+
+/**
+ * Page Read
+ *
+ * Loads the page into the data register (read setup command, the address cycles,
+ * read confirm command), waits for the busy line and latches out the requested
+ * bytes starting at the given column (the whole page including the spare area
+ * for read_page()). nand_read_page_setup() issues the cycles up to the wait for
+ * the blocking calls and the resumable operations (nand_op.c) alike.
+ */
+void nand_read_page_setup(unsigned int nPageId, unsigned int nColumn)
+{
+    unsigned char addr_cylces[NAND_MAX_ADDRESS_CYCLES];
+    unsigned int addr_count;
+
+    dbg_printf("Reading data from page %u, column %u\n", nPageId, nColumn);
+    addr_count = nand_page_address(nPageId, nColumn, addr_cylces);
+
+    dbg_printf("Latching first command byte to read a page...\n");
+    latch_command(CMD_READ1[0]);
+
+    dbg_printf("Latching %u address cycles...\n", addr_count);
+    latch_address(addr_cylces, addr_count);
+
+    dbg_printf("Latching second command byte to read a page...\n");
+    latch_command(CMD_READ1[1]);
+}
+
+static int read_page_once(unsigned int nPageId, unsigned int nColumn, unsigned char* data, unsigned int length)
+{
+    uint64_t bus_errors = nand_errors.bus_errors;
+
+    nand_read_page_setup(nPageId, nColumn);
+
+    if( wait_ready() != 0 )
+        return NAND_FAIL_TIMEOUT;
+
+    dbg_printf("Latching out data block...\n");
+    latch_register(data, length);
+
+    return nand_errors.bus_errors != bus_errors ? NAND_FAIL_BUS : 0;
+}
+
+int read_page(unsigned int nPageId, unsigned char* data)
+{
+    return nand_retry("Page read", nPageId, read_page_once, 0, data, nand_page_size_total());
+}
+
+int read_page_part(unsigned int nPageId, unsigned int nColumn, unsigned char* data, unsigned int length)
+{
+    return nand_retry("Page read", nPageId, read_page_once, nColumn, data, length);
+}
+
+int dump_memory_range(FILE *fp, unsigned int nFirstPageId, unsigned int nPages)
+{
+    unsigned int page_idx;
+    unsigned int page_size = nand_page_size_total();
+    unsigned char *mem_large_block; /* page content */
+    unsigned int failed = 0;
+
+    mem_large_block = malloc(page_size);
+    if( mem_large_block == NULL )
+    {
+        fprintf(stderr, "Failed to allocate page buffer.\n");
+        return 1;
+    }
+
+    for( page_idx = 0; page_idx < nPages; page_idx++ )
+    {
+        dbg_printf("Reading data from page %d / %d (%.2f %%)\n", nFirstPageId + page_idx,
+            nFirstPageId + nPages, (float)page_idx/(float)nPages * 100 );
+
+        /* an unreadable page is still written, so the dump keeps its layout */
+        if( read_page(nFirstPageId + page_idx, mem_large_block) != 0 )
+            failed++;
+
+        // Dumping memory to file
+        if( fwrite(mem_large_block, 1, page_size, fp) != page_size )
+        {
+            fprintf(stderr, "Failed to write page %d to the dump file.\n", nFirstPageId + page_idx);
+            free(mem_large_block);
+            return 1;
+        }
+    }
+
+    free(mem_large_block);
+
+    if( failed )
+    {
+        fprintf(stderr, "%u pages could not be read.\n", failed);
+        return 1;
+    }
+    return 0;
+}
+
+/* Pages are read into buffers of the page arena and written in batches:
+ * 64 pages of 2112 bytes are a whole number of O_DIRECT blocks. The two
+ * buffers alternate, as a pipe may still hold the pages of the last batch */
+int dump_memory(unsigned int nFirstPageId, unsigned int nPages)
+{
+    unsigned int page_size = nand_page_size_total();
+    unsigned int page_idx, batch, failed = 0;
+    struct page_arena *arena;
+    struct dump_output *out;
+    int ret = 0;
+
+    arena = arena_create((size_t)DUMP_BATCH_PAGES * page_size, 2, arena_flags);
+    if( arena == NULL )
+        return 1;
+
+    dbg_printf("Trying to open file for storing the binary dump...\n");
+    out = output_open(output_path, output_flags);
+    if( out == NULL )
+    {
+        printf("  Error when opening the file...\n");
+        arena_destroy(arena);
+        return 1;
+    }
+    if( output_reserve(out, (uint64_t)nPages * page_size) != 0 )
+        ret = 1;
+    dbg_printf("  File opened successfully%s...\n",
+        out->map ? " (mapped)" : out->direct ? " (O_DIRECT)" : out->pipe ? " (pipe)" : "");
+
+    for( page_idx = 0; page_idx < nPages && ret == 0; page_idx += batch )
+    {
+        /* a mapped image is read into directly */
+        unsigned char *data;
+
+        batch = nPages - page_idx < DUMP_BATCH_PAGES ? nPages - page_idx : DUMP_BATCH_PAGES;
+        data = output_window(out, (uint64_t)page_idx * page_size, (size_t)batch * page_size);
+        if( data == NULL )
+            data = arena_buffer(arena, (page_idx / DUMP_BATCH_PAGES) % 2);
+        for(unsigned int k = 0; k < batch; k++)
+        {
+            dbg_printf("Reading data from page %d / %d (%.2f %%)\n", nFirstPageId + page_idx + k,
+                nFirstPageId + nPages, (float)(page_idx + k)/(float)nPages * 100 );
+
+            /* an unreadable page is still written, so the dump keeps its layout */
+            if( read_page(nFirstPageId + page_idx + k, data + (size_t)k * page_size) != 0 )
+                failed++;
+        }
+        ret = output_write(out, data, (size_t)batch * page_size);
+    }
+
+    dbg_printf("Closing binary dump file (%llu bytes spliced)...\n", (unsigned long long)out->spliced);
+    if( output_close(out) != 0 )
+        ret = 1;
+    arena_destroy(arena);
+
+    if( failed )
+    {
+        fprintf(stderr, "%u pages could not be read.\n", failed);
+        return 1;
+    }
+    return ret;
+}
+
+/* dump_memory() against a previous image of the same pages: only the spare
+ * area of a page is read and compared with the previous image, as the ECC
+ * bytes in there change along with the data. Pages with a different spare
+ * area, or beyond the end of the previous image, are read in full; the others
+ * are taken over from the previous image */
+int dump_memory_incremental(unsigned int nFirstPageId, unsigned int nPages, const char *previous_path)
+{
+    unsigned int page_size = nand_page_size_total();
+    unsigned int spare_size = nand_geometry.spare_size;
+    unsigned int page_idx, batch, failed = 0, reread = 0, added = 0;
+    uint64_t previous_pages;
+    unsigned char *spare;
+    struct page_arena *arena;
+    struct dump_output *out;
+    struct stat st, st_out;
+    int previous, ret = 0;
+
+    previous = open(previous_path, O_RDONLY);
+    if( previous < 0 || fstat(previous, &st) != 0 )
+    {
+        fprintf(stderr, "unable to open the previous image %s: %s\n", previous_path, strerror(errno));
+        if( previous >= 0 )
+            close(previous);
+        return 1;
+    }
+    /* the output is truncated when it is opened */
+    if( stat(output_path, &st_out) == 0 && st_out.st_dev == st.st_dev && st_out.st_ino == st.st_ino )
+    {
+        fprintf(stderr, "the previous image %s cannot be the output of the dump\n", previous_path);
+        close(previous);
+        return 1;
+    }
+    previous_pages = (uint64_t)st.st_size / page_size;
+
+    spare = malloc(spare_size);
+    arena = arena_create((size_t)DUMP_BATCH_PAGES * page_size, 2, arena_flags);
+    if( spare == NULL || arena == NULL )
+    {
+        free(spare);
+        arena_destroy(arena);
+        close(previous);
+        return 1;
+    }
+
+    out = output_open(output_path, output_flags);
+    if( out == NULL )
+    {
+        printf("  Error when opening the file...\n");
+        free(spare);
+        arena_destroy(arena);
+        close(previous);
+        return 1;
+    }
+    if( output_reserve(out, (uint64_t)nPages * page_size) != 0 )
+        ret = 1;
+
+    for( page_idx = 0; page_idx < nPages && ret == 0; page_idx += batch )
+    {
+        unsigned char *data;
+        unsigned int known = 0;
+        size_t length, done;
+
+        batch = nPages - page_idx < DUMP_BATCH_PAGES ? nPages - page_idx : DUMP_BATCH_PAGES;
+        data = output_window(out, (uint64_t)page_idx * page_size, (size_t)batch * page_size);
+        if( data == NULL )
+            data = arena_buffer(arena, (page_idx / DUMP_BATCH_PAGES) % 2);
+
+        if( page_idx < previous_pages )
+            known = previous_pages - page_idx < batch ? previous_pages - page_idx : batch;
+        length = (size_t)known * page_size;
+        for( done = 0; done < length; )
+        {
+            ssize_t n = pread(previous, data + done, length - done, (off_t)page_idx * page_size + done);
+
+            if( n < 0 && errno == EINTR )
+                continue;
+            if( n <= 0 )
+            {
+                fprintf(stderr, "Failed to read the previous image: %s\n", n < 0 ? strerror(errno) : "unexpected end");
+                ret = 1;
+                break;
+            }
+            done += n;
+        }
+
+        for(unsigned int k = 0; k < batch && ret == 0; k++)
+        {
+            unsigned int page = nFirstPageId + page_idx + k;
+            unsigned char *page_data = data + (size_t)k * page_size;
+
+            if( k < known )
+            {
+                /* a spare area that cannot be read counts as changed */
+                if( read_page_part(page, nand_geometry.page_size, spare, spare_size) == 0 &&
+                    memcmp(spare, page_data + nand_geometry.page_size, spare_size) == 0 )
+                    continue;
+                dbg_printf("Spare area of page %u changed, reading it again\n", page);
+                reread++;
+            }
+            else
+                added++;
+            if( read_page(page, page_data) != 0 )
+                failed++;
+        }
+        if( ret == 0 )
+            ret = output_write(out, data, (size_t)batch * page_size);
+    }
+
+    dbg_printf("Incremental dump: %u pages, %u unchanged, %u changed, %u not in the previous image\n",
+        nPages, nPages - reread - added, reread, added);
+
+    if( output_close(out) != 0 )
+        ret = 1;
+    arena_destroy(arena);
+    free(spare);
+    close(previous);
+
+    if( failed )
+    {
+        fprintf(stderr, "%u pages could not be read.\n", failed);
+        return 1;
+    }
+    return ret;
+}
+
+/* writes the whole OTP area (data and spare of every page) to a file */
+int dump_otp(const char* path)
+{
+    unsigned char *data = malloc((size_t)NAND_OTP_PAGES * nand_page_size_total());
+    FILE *fp;
+    int ret;
+
+    if( data == NULL )
+        return EXIT_FAILURE;
+    ret = read_otp_area(data, NAND_OTP_PAGES);
+    if( ret != 0 )
+    {
+        fprintf(stderr, "Failed to read the OTP area.\n");
+        free(data);
+        return ret;
+    }
+
+    fp = fopen(path, "wb");
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to open %s\n", path);
+        free(data);
+        return EXIT_FAILURE;
+    }
+    fwrite(data, nand_page_size_total(), NAND_OTP_PAGES, fp);
+    fclose(fp);
+    free(data);
+    printf("OTP area (%u pages) written to %s\n", NAND_OTP_PAGES, path);
+    return 0;
+}
+
+/* Reads back a page and compares it with the expected content; a mismatch is
+ * read again (it may be a transient bitflip) before it is reported.
+ * Returns the number of mismatching bytes (0 when the page is as expected) */
+int verify_page(unsigned int nPageId, unsigned char* data)
+{
+    unsigned int page_size = nand_page_size_total();
+    unsigned char *page_data;
+    int mismatches = 0;
+    int ret;
+
+    page_data = malloc(page_size);
+    if( page_data == NULL )
+    {
+        fprintf(stderr, "Failed to allocate page buffer.\n");
+        return -1;
+    }
+
+    for(unsigned int attempt = 0; ; attempt++)
+    {
+        ret = read_page(nPageId, page_data);
+        mismatches = 0;
+        for(unsigned int k = 0; k < page_size; k++)
+        {
+            if( page_data[k] != data[k] )
+                mismatches++;
+        }
+        if( (ret == 0 && mismatches == 0) || attempt >= nand_recovery.read_retries )
+            break;
+        nand_errors.rereads++;
+    }
+
+    free(page_data);
+
+    if( mismatches )
+    {
+        trace_trigger();
+        fprintf(stderr, "Verify of page %d failed: %d bytes differ.\n", nPageId, mismatches);
+    }
+    return mismatches;
+}
+
+/**
+ * BlockErase
+ *
+ * "The Erase operation is done on a block basis.
+ * Block address loading is accomplished in there cycles initiated by an Erase Setup command (60h).
+ * Only address A18 to A29 is valid while A12 to A17 is ignored (x8).
+ *
+ * The Erase Confirm command (D0h) following the block address loading initiates the internal erasing process.
+ * This two step sequence of setup followed by execution command ensures that memory contents are not
+ * accidentally erased due to external noise conditions.
+ *
+ * At the rising edge of WE after the erase confirm command input,
+ * the internal write controller handles erase and erase verify.
+ *
+ * Once the erase process starts, the Read Status Register command may be entered to read the status register.
+ * The system controller can detect the completion of an erase by monitoring the R/B output,
+ * or the Status bit (I/O 6) of the Status Register.
+ * Only the Read Status command and Reset command are valid while erasing is in progress.
+ * When the erase operation is completed, the Write Status Bit (I/O 0) may be checked."
+ *
+ * nand_erase_block_setup() issues the cycles up to the erase confirm and
+ * nand_program_erase_finish() those after the busy period, for the blocking
+ * call and the resumable operation (nand_op.c) alike.
+ */
+int nand_erase_block_setup(unsigned int nBlockId)
+{
+	unsigned char addr_cylces[NAND_MAX_ROW_CYCLES];
+	unsigned int addr_count;
+	uint64_t bus_errors = nand_errors.bus_errors;
+
+	/* row address of the first page of the block */
+	addr_count = nand_row_address(nBlockId * nand_geometry.pages_per_block, addr_cylces);
+
+	/* remove write protection */
+	controlbus_pin_set(PIN_nWP, ON);
+
+	dbg_printf("Latching first command byte to erase a block...\n");
+	latch_command(CMD_BLOCKERASE[0]); /* block erase setup command */
+
+	dbg_printf("Erasing block %u\n", nBlockId);
+	dbg_printf("Latching page(row) address (%u bytes)...\n", addr_count);
+	latch_address(addr_cylces, addr_count);
+
+	/* a lost address byte would erase another block: abort before the confirm */
+	if( nand_errors.bus_errors != bus_errors )
+	{
+		controlbus_pin_set(PIN_nWP, OFF);
+		return NAND_FAIL_BUS;
+	}
+
+	dbg_printf("Latching second command byte to erase a block...\n");
+	latch_command(CMD_BLOCKERASE[1]);
+
+	/* tWB: WE High to Busy is 100 ns -> ignore it here as it takes some time for the next command to execute */
+	return 0;
+}
+
+/* After tPROG or tBERS: reads the status register unless the wait for the busy line
+ * failed and activates the write protection again; returns the status register */
+unsigned char nand_program_erase_finish(int ret)
+{
+	unsigned char status_register = 0;
+
+	if( ret == 0 )
+	{
+		/* Read status */
+		dbg_printf("Latching command byte to read status...\n");
+		latch_command(CMD_READSTATUS);
+
+		latch_register(&status_register, 1); /* data output operation */
+
+		/* output the retrieved status register content */
+		dbg_printf("Status register content:   0x%02X\n", status_register);
+	}
+
+	/* activate write protection again */
+	controlbus_pin_set(PIN_nWP, OFF);
+
+	return status_register;
+}
+
+/* Result of a program or erase: the failed wait, a lost transfer or the Write
+ * Status Bit (I/O 0) of the status register */
+int nand_program_erase_result(const char* what, int ret, int bus_failed, unsigned char status_register)
+{
+	if( ret != 0 )
+		return ret;
+	else if( bus_failed )
+		return NAND_FAIL_BUS;
+	else if(status_register & STATUSREG_IO0)
+	{
+		trace_trigger();
+		fprintf(stderr, "Failed to %s.\n", what);
+		return NAND_FAIL_STATUS;
+	}
+	else
+	{
+		dbg_printf("Successfully completed: %s.\n", what);
+		return 0;
+	}
+}
+
+static int erase_block_once(unsigned int nBlockId, unsigned int nColumn, unsigned char* unused, unsigned int length)
+{
+	uint64_t bus_errors = nand_errors.bus_errors;
+	unsigned char status_register;
+	int ret;
+
+	ret = nand_erase_block_setup(nBlockId);
+	if( ret != 0 )
+		return ret;
+
+	ret = wait_ready();
+	status_register = nand_program_erase_finish(ret);
+
+	return nand_program_erase_result("erase block", ret, nand_errors.bus_errors != bus_errors, status_register);
+}
+
+int erase_block(unsigned int nBlockId)
+{
+	return nand_retry("Block erase", nBlockId, erase_block_once, 0, NULL, 0);
+}
+
+
+int latch_data_out(unsigned char data[], unsigned int length)
+{
+//	printf("\n");
+
+    for(unsigned int k = 0; k < length; k++)
+    {
+        // toggle nWE low
+        controlbus_pin_set(PIN_nWE, OFF);
+        controlbus_update_output();
+        bus->delay_us(REALWORLD_DELAY);
+
+        // change I/O pins
+        iobus_set_value(data[k]);
+        iobus_update_output();
+        bus->delay_us(REALWORLD_DELAY); /* TODO: assure setup delay */
+
+//        printf("0x%02X ", data[k]);
+
+        // toggle nWE back high (acts as clock to latch the current address byte!)
+        controlbus_pin_set(PIN_nWE, ON);
+        controlbus_update_output();
+        bus->delay_us(REALWORLD_DELAY); /* TODO: assure hold delay */
+    }
+
+//    printf("\n");
+
+    return 0;
+}
+
+/**
+ * Page Program
+ *
+ * "The device is programmed by page.
+ * The number of consecutive partial page programming operation within the same page
+ * without an intervening erase operation must not exceed 8 times.
+ *
+ * The addressing should be done on each pages in a block.
+ * A page program cycle consists of a serial data loading period in which up to 2112 bytes of data
+ * may be loaded into the data register, followed by a non-volatile programming period where the loaded data
+ * is programmed into the appropriate cell.
+ *
+ * The serial data loading period begins by inputting the Serial Data Input command (80h),
+ * followed by the five cycle address inputs and then serial data.
+ *
+ * The bytes other than those to be programmed do not need to be loaded.
+ *
+ * The device supports random data input in a page.
+ * The column address of next data, which will be entered, may be changed to the address which follows
+ * random data input command (85h).
+ * Random data input may be operated multiple times regardless of how many times it is done in a page.
+ *
+ * The Page Program confirm command (10h) initiates the programming process.
+ * Writing 10h alone without pre-viously entering the serial data will not initiate the programming process.
+ * The internal write state controller automatically executes the algorithms and timings necessary for
+ * program and verify, thereby freeing the system controller for other tasks.
+ * Once the program process starts, the Read Status Register command may be entered to read the status register.
+ * The system controller can detect the completion of a program cycle by monitoring the R/B output,
+ * or the Status bit (I/O 6) of the Status Register.
+ * Only the Read Status command and Reset command are valid while programming is in progress.
+ *
+ * When the Page Program is complete, the Write Status Bit (I/O 0) may be checked.
+ * The internal write verify detects only errors for "1"s that are not successfully programmed to "0"s.
+ *
+ * The command register remains in Read Status command mode until another valid command is written to the
+ * command register.
+ *
+ * nand_program_page_setup() issues the cycles up to the program confirm, for the
+ * blocking call and the resumable operation (nand_op.c) alike.
+ */
+int nand_program_page_setup(unsigned int nPageId, unsigned int nColumn, unsigned char* data, unsigned int length)
+{
+    unsigned char addr_cylces[NAND_MAX_ADDRESS_CYCLES];
+    unsigned int addr_count;
+	uint64_t bus_errors = nand_errors.bus_errors;
+
+	/* remove write protection */
+	controlbus_pin_set(PIN_nWP, ON);
+
+	dbg_printf("Writing data to page %u\n", nPageId);
+    addr_count = nand_page_address(nPageId, nColumn, addr_cylces);
+
+	dbg_printf("Latching first command byte to write a page (%u bytes from column %u)...\n",
+			length, nColumn);
+	latch_command(CMD_PAGEPROGRAM[0]); /* Serial Data Input command */
+
+	dbg_printf("Latching %u address cycles...\n", addr_count);
+    latch_address(addr_cylces, addr_count);
+
+	dbg_printf("Latching out the data of the page...\n");
+	latch_data_out(data, length); /* bytes that are not loaded stay FFh in the data register */
+
+	/* a transfer lost while loading would program wrong data: abort before the confirm */
+	if( nand_errors.bus_errors != bus_errors )
+	{
+		controlbus_pin_set(PIN_nWP, OFF);
+		return NAND_FAIL_BUS;
+	}
+
+	dbg_printf("Latching second command byte to write a page...\n");
+	latch_command(CMD_PAGEPROGRAM[1]); /* Page Program confirm command command */
+	return 0;
+}
+
+static int program_page_once(unsigned int nPageId, unsigned int nColumn, unsigned char* data, unsigned int length)
+{
+	uint64_t bus_errors = nand_errors.bus_errors;
+	unsigned char status_register;
+	int ret;
+
+	ret = nand_program_page_setup(nPageId, nColumn, data, length);
+	if( ret != 0 )
+		return ret;
+
+	ret = wait_ready();
+	status_register = nand_program_erase_finish(ret);
+
+	return nand_program_erase_result("program page", ret, nand_errors.bus_errors != bus_errors, status_register);
+}
+
+int program_page(unsigned int nPageId, unsigned char* data)
+{
+	return nand_retry("Page program", nPageId, program_page_once, 0, data, nand_page_size_total());
+}
+
+/* programs length bytes from column nColumn on and leaves the rest of the page as it is */
+int program_page_part(unsigned int nPageId, unsigned int nColumn, unsigned char* data, unsigned int length)
+{
+	return nand_retry("Page program", nPageId, program_page_once, nColumn, data, length);
+}
+
+/* Retires a block: 00h into the first spare byte of its first and second page,
+ * where is_factory_bad_block() looks. Only the marker byte is loaded, so this is
+ * a partial program of the spare area and needs no full page transfer */
+int mark_bad_block(unsigned int nBlockId)
+{
+	unsigned char marker = 0x00;
+	int ret = 0;
+
+	for(unsigned int k = 0; k < 2; k++)
+		if( program_page_part(nBlockId * nand_geometry.pages_per_block + k, nand_geometry.page_size,
+				&marker, 1) != 0 )
+			ret = 1;
+	return ret;
+}
+
+void get_page_dummy_data(unsigned char* page_data)
+{
+	for(unsigned int k=0; k<nand_geometry.page_size; k++)
+	{
+		unsigned int m = k % 8;
+		switch( m )
+		{
+			case 0:
+			case 4:
+				page_data[k] = 0xDE;
+				break;
+			case 1:
+			case 5:
+				page_data[k] = 0xAD;
+				break;
+			case 2:
+			case 6:
+				page_data[k] = 0xBE;
+				break;
+			case 3:
+			case 7:
+				page_data[k] = 0xEF;
+				break;
+		}
+	}
+	for(unsigned int k=nand_geometry.page_size; k<nand_page_size_total(); k++)
+	{
+		page_data[k] = 0x11;
+	}
+}
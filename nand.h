@@ -0,0 +1,237 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file nand.h
+ * \brief NAND flash bus operations on top of an exchangeable bus backend
+ * The backend either drives the two channels of a real FT2232H in bit-bang IO
+ * mode (see bitbang_ft2232.c) or a simulated FT2232H + NAND chip (see nand_sim.c).
+ */
+
+#ifndef NAND_H
+#define NAND_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Pins on ADBUS0..7 (I/O bus) */
+#define PIN_DIO0 0x01
+#define PIN_DIO1 0x02
+#define PIN_DIO2 0x04
+#define PIN_DIO3 0x08
+#define PIN_DIO4 0x10
+#define PIN_DIO5 0x20
+#define PIN_DIO6 0x40
+#define PIN_DIO7 0x80
+#define IOBUS_BITMASK_WRITE 0xFF
+#define IOBUS_BITMASK_READ  0x00
+
+/* Pins on BDBUS0..7 (control bus) */
+#define PIN_CLE  0x01
+#define PIN_ALE  0x02
+#define PIN_nCE  0x04
+#define PIN_nWE  0x08
+#define PIN_nRE  0x10
+#define PIN_nWP  0x20
+#define PIN_RDY  0x40 /* READY / nBUSY output signal */
+#define PIN_LED  0x80
+#define CONTROLBUS_BITMASK 0xBF /* 0b1011 1111 = 0xBF */
+
+#define STATUSREG_IO0  0x01
+#define STATUSREG_IO6  0x40 /* ready */
+#define STATUSREG_IO7  0x80 /* not write protected */
+
+#define REALWORLD_DELAY 10 /* 10 usec */
+
+#define PAGE_SIZE 2112
+#define PAGE_SIZE_NOSPARE 2048
+
+#define DUMP_BATCH_PAGES 64 /* pages per write of dump_memory() */
+#define NAND_ECC_STEP    256 /* data bytes per 3 bytes of software Hamming ECC */
+
+/* address cycles of the page operations: column (A0..A15) and row (page) address */
+#define NAND_MAX_COLUMN_CYCLES  2
+#define NAND_MAX_ROW_CYCLES     4
+#define NAND_MAX_ADDRESS_CYCLES (NAND_MAX_COLUMN_CYCLES + NAND_MAX_ROW_CYCLES)
+
+typedef enum { OFF=0, ON=1 } onoff_t;
+typedef enum { IOBUS_IN=0, IOBUS_OUT=1 } iobus_inout_t;
+
+/* Chip organisation; defaults to the 4 Gbit x8 device the reader was written for */
+struct nand_geometry
+{
+    unsigned int page_size;       /* data bytes per page (without spare area) */
+    unsigned int spare_size;      /* spare area (OOB) bytes per page */
+    unsigned int pages_per_block;
+    unsigned int blocks;
+    unsigned int column_cycles;   /* column address cycles, 0: derived from the page size */
+    unsigned int row_cycles;      /* row address cycles, 0: derived from the number of pages */
+};
+
+/* ONFI parameter page; the chip repeats it at least three times */
+#define ONFI_PARAM_PAGE_SIZE   256
+#define ONFI_PARAM_PAGE_COPIES 3
+
+/* Optional features of the chip, from the parameter page */
+#define NAND_FEATURE_ONFI       0x01 /* chip answered with a valid parameter page */
+#define NAND_FEATURE_CACHE_READ 0x02 /* read cache (31h / 3Fh) */
+#define NAND_FEATURE_UNIQUE_ID  0x04 /* read unique ID (EDh) */
+#define NAND_FEATURE_SET_FEATURES 0x08 /* get / set features (EEh / EFh), needed for the OTP area */
+
+/* ONFI unique ID: 16 bytes followed by their complement, repeated 16 times */
+#define UNIQUE_ID_SIZE   16
+#define UNIQUE_ID_COPIES 16
+
+/* OTP area: pages 02h..0Bh, readable while the array operation mode feature selects it */
+#define FEATURE_ARRAY_OPERATION_MODE 0x90
+#define FEATURE_MODE_NORMAL 0x00
+#define FEATURE_MODE_OTP    0x01
+#define NAND_OTP_FIRST_PAGE 2
+#define NAND_OTP_PAGES      10
+
+/* Result of an operation that failed (0: success) */
+#define NAND_FAIL_STATUS  1 /* chip reported a failed program / erase (status IO0) */
+#define NAND_FAIL_TIMEOUT 2 /* busy line did not return to ready */
+#define NAND_FAIL_BUS     3 /* USB transfer failed during the operation */
+
+/* Recovery policy for busy timeouts and bus errors */
+struct nand_recovery
+{
+    unsigned int max_retries;     /* operation repeats after a chip reset */
+    unsigned int read_retries;    /* re-reads of a page that does not verify */
+    unsigned int busy_timeout_us;
+    unsigned int retry_delay_us;  /* delay before the first repeat, doubled for every further one */
+};
+
+struct nand_error_stats
+{
+    uint64_t bus_errors;    /* failed transfers; the backends count failed reads themselves */
+    uint64_t lost_polls;    /* failed reads of the busy line (not counted as bus errors) */
+    uint64_t busy_timeouts;
+    uint64_t resets;
+    uint64_t retries;       /* repeated operations */
+    uint64_t rereads;       /* page re-reads during verify */
+    uint64_t failures;      /* operations given up after all retries */
+};
+
+/**
+ * Bus backend
+ *
+ * Every transfer to or from the FT2232H channels goes through one of these
+ * callbacks: one callback invocation corresponds to one USB transfer.
+ * The write callbacks return the number of bytes written or a negative
+ * value on error (like ftdi_write_data()).
+ */
+struct bus_backend
+{
+    const char *name;
+    int (*write_controlbus)(unsigned char value);
+    int (*write_iobus)(unsigned char value);
+    int (*set_iobus_direction)(iobus_inout_t inout);
+    unsigned char (*read_controlbus)(void);
+    unsigned char (*read_iobus)(void);
+    void (*delay_us)(unsigned int usec);
+    uint64_t (*now_ns)(void); /* monotonic clock, used for timestamps */
+};
+
+/* Pin and chip state of one reader (see nand_op.h) */
+struct nand_bus_state
+{
+    const struct bus_backend *bus;
+    unsigned char controlbus_value;
+    unsigned char iobus_value;
+    struct nand_geometry geometry;
+};
+
+extern const unsigned char CMD_READ1[2];
+extern const unsigned char CMD_BLOCKERASE[2];
+extern const unsigned char CMD_READSTATUS;
+extern const unsigned char CMD_PAGEPROGRAM[2];
+
+extern const struct bus_backend *bus;
+extern struct nand_geometry nand_geometry;
+extern int verbose;
+extern struct nand_recovery nand_recovery;
+extern struct nand_error_stats nand_errors;
+
+/* chatty progress output of the bus operations; switched off by the benchmark */
+#define dbg_printf(...) do { if( verbose ) printf(__VA_ARGS__); } while(0)
+
+void controlbus_reset_value(void);
+void controlbus_pin_set(unsigned char pin, onoff_t val);
+void controlbus_update_output(void);
+unsigned char controlbus_read_input(void);
+void test_controlbus(void);
+
+void iobus_set_direction(iobus_inout_t inout);
+void iobus_reset_value(void);
+void iobus_pin_set(unsigned char pin, onoff_t val);
+void iobus_set_value(unsigned char value);
+void iobus_update_output(void);
+unsigned char iobus_read_input(void);
+void test_iobus(void);
+
+int latch_command(unsigned char command);
+int latch_address(unsigned char address[], unsigned int addr_length);
+int latch_register(unsigned char reg[], unsigned int reg_length);
+int latch_data_out(unsigned char data[], unsigned int length);
+int poll_ready(void);
+int wait_ready(void);
+int reset_chip(void);
+void nand_select_chip(void);
+void nand_save_bus_state(struct nand_bus_state *state);
+void nand_restore_bus_state(const struct nand_bus_state *state);
+
+unsigned int nand_page_size_total(void);
+unsigned int nand_pages_total(void);
+unsigned int nand_column_cycles(const struct nand_geometry* geometry);
+unsigned int nand_row_cycles(const struct nand_geometry* geometry);
+int nand_geometry_addressable(const struct nand_geometry* geometry);
+unsigned int nand_page_address(unsigned int nPageId, unsigned int nColumn, unsigned char* cycles);
+unsigned int nand_row_address(unsigned int nPageId, unsigned char* cycles);
+
+void read_ID_register(unsigned char* ID_register);
+void check_ID_register(unsigned char* ID_register);
+void nand_read_page_setup(unsigned int nPageId, unsigned int nColumn);
+int nand_program_page_setup(unsigned int nPageId, unsigned int nColumn, unsigned char* data, unsigned int length);
+int nand_erase_block_setup(unsigned int nBlockId);
+unsigned char nand_program_erase_finish(int ret);
+int nand_program_erase_result(const char* what, int ret, int bus_failed, unsigned char status_register);
+int read_page(unsigned int nPageId, unsigned char* data);
+int read_page_part(unsigned int nPageId, unsigned int nColumn, unsigned char* data, unsigned int length);
+int read_parameter_page(unsigned char* data, unsigned int length);
+int read_valid_parameter_page(unsigned char* page);
+int read_unique_id(unsigned char* unique_id);
+int set_feature(unsigned char feature, const unsigned char* parameters);
+int read_otp_area(unsigned char* data, unsigned int nPages);
+int dump_otp(const char* path);
+void nand_ecc_hamming(const unsigned char *data, unsigned char code[3]);
+void nand_ecc_page(unsigned char *page);
+uint16_t onfi_crc16(const unsigned char* data, unsigned int length);
+int parse_parameter_page(const unsigned char* page, struct nand_geometry* geometry, unsigned int* features);
+int decode_ID_geometry(const unsigned char* ID_register, struct nand_geometry* geometry);
+int is_factory_bad_block(unsigned int nBlockId);
+int dump_memory_range(FILE *fp, unsigned int nFirstPageId, unsigned int nPages);
+int dump_memory(unsigned int nFirstPageId, unsigned int nPages);
+int dump_memory_incremental(unsigned int nFirstPageId, unsigned int nPages, const char *previous_path);
+int erase_block(unsigned int nBlockId);
+int program_page(unsigned int nPageId, unsigned char* data);
+int program_page_part(unsigned int nPageId, unsigned int nColumn, unsigned char* data, unsigned int length);
+int mark_bad_block(unsigned int nBlockId);
+int verify_page(unsigned int nPageId, unsigned char* data);
+void get_page_dummy_data(unsigned char* page_data);
+
+#endif /* NAND_H */
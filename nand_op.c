@@ -0,0 +1,245 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file nand_op.c
+ * \brief Resumable NAND operations and a per-device executor (see nand_op.h)
+ * The operations issue the bus cycles of read_page(), program_page() and
+ * erase_block() through the same sequence helpers of nand.c (nand_*_setup(),
+ * nand_program_erase_finish()); only the ready-wait hands control back to the
+ * executor, which polls the busy line once per resumption. Timeouts and bus errors are
+ * repeated after a chip reset like nand_retry() does for the blocking calls.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "nand.h"
+#include "nand_op.h"
+#include "trace.h"
+
+/* one poll of the busy line for the current ready-wait; returns 1 when the
+ * operation can go on, with op->result set to NAND_FAIL_TIMEOUT if it timed out */
+int nand_op_ready(struct nand_op *op)
+{
+    if( op->deadline_ns == 0 )
+        op->deadline_ns = bus->now_ns() + (uint64_t)nand_recovery.busy_timeout_us * 1000;
+
+    if( poll_ready() )
+        return 1;
+    if( bus->now_ns() <= op->deadline_ns )
+        return 0;
+
+    nand_errors.busy_timeouts++;
+    trace_trigger();
+    fprintf(stderr, "Timeout waiting for the busy line.\n");
+    op->result = NAND_FAIL_TIMEOUT;
+    return 1;
+}
+
+/* returns 1 if a transfer of this operation failed; other devices' errors
+ * in between the steps are not counted */
+int nand_op_bus_failed(const struct nand_op *op)
+{
+    return op->bus_errors + (nand_errors.bus_errors - op->step_bus_errors) != 0;
+}
+
+static void nand_op_init(struct nand_op *op, int (*step)(struct nand_op *op),
+    unsigned int nId, unsigned int nColumn, unsigned char *data, unsigned int length)
+{
+    op->step = step;
+    op->state = 0;
+    op->result = 0;
+    op->nId = nId;
+    op->nColumn = nColumn;
+    op->data = data;
+    op->length = length;
+    op->status = 0;
+    op->deadline_ns = 0;
+    op->bus_errors = 0;
+    op->step_bus_errors = 0;
+    op->done = NULL;
+    op->context = NULL;
+    op->next = NULL;
+}
+
+/* Page Read: read setup, the address cycles, read confirm, wait for tR, data output */
+static int read_page_step(struct nand_op *op)
+{
+    NAND_OP_BEGIN(op);
+
+    nand_read_page_setup(op->nId, op->nColumn);
+
+    NAND_OP_AWAIT_READY(op);
+
+    if( op->result == 0 )
+    {
+        latch_register(op->data, op->length);
+        if( nand_op_bus_failed(op) )
+            op->result = NAND_FAIL_BUS;
+    }
+
+    NAND_OP_END(op);
+}
+
+/* reads the status register after a program or erase and checks it */
+static void finish_status(struct nand_op *op, const char *what)
+{
+    op->status = nand_program_erase_finish(op->result);
+    op->result = nand_program_erase_result(what, op->result, nand_op_bus_failed(op), op->status);
+}
+
+/* Page Program: serial data input, the address cycles, the page, program
+ * confirm, wait for tPROG, read status */
+static int program_page_step(struct nand_op *op)
+{
+    NAND_OP_BEGIN(op);
+
+    op->result = nand_program_page_setup(op->nId, 0, op->data, op->length);
+    if( op->result != 0 )
+        return NAND_OP_DONE;
+
+    NAND_OP_AWAIT_READY(op);
+
+    finish_status(op, "program page");
+
+    NAND_OP_END(op);
+}
+
+/* Block Erase: erase setup, the row address cycles, erase confirm, wait for
+ * tBERS, read status */
+static int erase_block_step(struct nand_op *op)
+{
+    NAND_OP_BEGIN(op);
+
+    op->result = nand_erase_block_setup(op->nId);
+    if( op->result != 0 )
+        return NAND_OP_DONE;
+
+    NAND_OP_AWAIT_READY(op);
+
+    finish_status(op, "erase block");
+
+    NAND_OP_END(op);
+}
+
+void nand_op_read_page(struct nand_op *op, unsigned int nPageId, unsigned int nColumn,
+    unsigned char *data, unsigned int length)
+{
+    nand_op_init(op, read_page_step, nPageId, nColumn, data, length);
+}
+
+void nand_op_program_page(struct nand_op *op, unsigned int nPageId, unsigned char *data)
+{
+    nand_op_init(op, program_page_step, nPageId, 0, data, nand_page_size_total());
+}
+
+void nand_op_erase_block(struct nand_op *op, unsigned int nBlockId)
+{
+    nand_op_init(op, erase_block_step, nBlockId, 0, NULL, 0);
+}
+
+/* binds an executor to the currently selected bus backend and pin state */
+void nand_executor_init(struct nand_executor *executor)
+{
+    nand_save_bus_state(&executor->bus_state);
+    executor->head = NULL;
+    executor->tail = NULL;
+    executor->attempt = 0;
+    executor->failed = 0;
+}
+
+void nand_executor_submit(struct nand_executor *executor, struct nand_op *op)
+{
+    op->next = NULL;
+    if( executor->tail )
+        executor->tail->next = op;
+    else
+        executor->head = op;
+    executor->tail = op;
+}
+
+/* completes the head operation or restarts it after a reset */
+static void nand_executor_complete(struct nand_executor *executor, struct nand_op *op)
+{
+    if( op->result == NAND_FAIL_TIMEOUT || op->result == NAND_FAIL_BUS )
+    {
+        if( executor->attempt < nand_recovery.max_retries )
+        {
+            nand_errors.retries++;
+            dbg_printf("Operation on %u failed (%d), retrying\n", op->nId, op->result);
+            bus->delay_us(nand_recovery.retry_delay_us << (executor->attempt < 16 ? executor->attempt : 16));
+            executor->attempt++;
+            reset_chip();
+            op->state = 0;
+            op->result = 0;
+            op->bus_errors = 0;
+            return;
+        }
+        nand_errors.failures++;
+        trace_trigger();
+        fprintf(stderr, "Operation on %u failed after %u retries.\n", op->nId, nand_recovery.max_retries);
+    }
+    if( op->result != 0 )
+        executor->failed++;
+
+    executor->attempt = 0;
+    executor->head = op->next;
+    if( executor->head == NULL )
+        executor->tail = NULL;
+    if( op->done )
+        op->done(op);
+}
+
+/* resumes the head operation once with the executor's pin state;
+ * returns 1 while operations are queued */
+int nand_executor_step(struct nand_executor *executor)
+{
+    struct nand_op *op = executor->head;
+    int ret;
+
+    if( op == NULL )
+        return 0;
+
+    nand_restore_bus_state(&executor->bus_state);
+    op->step_bus_errors = nand_errors.bus_errors;
+    ret = op->step(op);
+    op->bus_errors += nand_errors.bus_errors - op->step_bus_errors;
+    if( ret == NAND_OP_DONE )
+        nand_executor_complete(executor, op);
+    nand_save_bus_state(&executor->bus_state);
+
+    return executor->head != NULL;
+}
+
+/* runs all queued operations of the executors to completion, resuming them in
+ * turn; returns the number of operations that failed during this run */
+unsigned int nand_executor_run(struct nand_executor *executors, unsigned int count)
+{
+    unsigned int busy, failed = 0;
+
+    for(unsigned int k = 0; k < count; k++)
+        executors[k].failed = 0;
+    do
+    {
+        busy = 0;
+        for(unsigned int k = 0; k < count; k++)
+            busy += nand_executor_step(&executors[k]);
+    } while( busy );
+
+    for(unsigned int k = 0; k < count; k++)
+        failed += executors[k].failed;
+    return failed;
+}
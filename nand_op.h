@@ -0,0 +1,91 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file nand_op.h
+ * \brief Resumable NAND operations and a per-device executor
+ * An operation is a step function built from the bus sequences of nand.c
+ * (nand_read_page_setup() and friends) that suspends where the chip goes busy (NAND_OP_AWAIT_READY) instead of spinning
+ * on the busy line. The step keeps its resume point and everything it needs
+ * across a suspension in struct nand_op, so locals must not be relied upon
+ * after an await. Each device gets an executor with a queue of operations;
+ * nand_executor_run() resumes the operation at the head of every queue in
+ * turn from a single thread, switching the pin state between the devices.
+ * Experimental: only the benchmark (op-read) runs operations this way; the
+ * reader itself uses the blocking calls of nand.c.
+ */
+
+#ifndef NAND_OP_H
+#define NAND_OP_H
+
+#include <stdint.h>
+#include "nand.h"
+
+/* Return value of a step function */
+#define NAND_OP_DONE    0
+#define NAND_OP_PENDING 1 /* chip busy, resume later */
+
+struct nand_op
+{
+    int (*step)(struct nand_op *op);
+    int state;              /* resume point, 0: not started */
+    int result;             /* 0 or NAND_FAIL_* once done */
+    unsigned int nId;       /* page or block */
+    unsigned int nColumn;
+    unsigned char *data;
+    unsigned int length;
+    unsigned char status;   /* status register after program / erase */
+    uint64_t deadline_ns;   /* busy timeout of the current ready-wait, 0: not armed */
+    uint64_t bus_errors;    /* failed transfers in the steps run so far */
+    uint64_t step_bus_errors; /* error counter when the current step was resumed */
+    void (*done)(struct nand_op *op); /* optional completion callback */
+    void *context;
+    struct nand_op *next;
+};
+
+struct nand_executor
+{
+    struct nand_bus_state bus_state;
+    struct nand_op *head, *tail; /* the head is in flight */
+    unsigned int attempt;        /* repeats of the head after a timeout or bus error */
+    unsigned int failed;         /* operations given up */
+};
+
+/* Protothread-style resume points: the step function is one switch statement */
+#define NAND_OP_BEGIN(op) switch( (op)->state ) { case 0:
+#define NAND_OP_AWAIT_READY(op) \
+    do { \
+        (op)->deadline_ns = 0; \
+        (op)->state = __LINE__; case __LINE__: \
+        if( !nand_op_ready(op) ) \
+            return NAND_OP_PENDING; \
+    } while(0)
+#define NAND_OP_END(op) } (op)->state = 0; return NAND_OP_DONE
+
+int nand_op_ready(struct nand_op *op);
+int nand_op_bus_failed(const struct nand_op *op);
+
+void nand_op_read_page(struct nand_op *op, unsigned int nPageId, unsigned int nColumn,
+    unsigned char *data, unsigned int length);
+void nand_op_program_page(struct nand_op *op, unsigned int nPageId, unsigned char *data);
+void nand_op_erase_block(struct nand_op *op, unsigned int nBlockId);
+
+void nand_executor_init(struct nand_executor *executor);
+void nand_executor_submit(struct nand_executor *executor, struct nand_op *op);
+int nand_executor_step(struct nand_executor *executor);
+unsigned int nand_executor_run(struct nand_executor *executors, unsigned int count);
+
+#endif /* NAND_OP_H */
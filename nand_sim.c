@@ -0,0 +1,841 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file nand_sim.c
+ * \brief Simulated FT2232H + NAND flash bus backend
+ * The chip model reacts to pin edges the way the datasheet describes it:
+ * commands, addresses and data are latched on the rising edge of nWE,
+ * data is driven onto the I/O bus on the falling edge of nRE.
+ * Block contents are allocated on first program; unallocated blocks read as erased.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nand_sim.h"
+
+const struct sim_usb_profile sim_usb_profiles[] =
+{
+    /* name          frame    overhead  byte */
+    { "ft2232h-hs",  125000,  20000,    17 },  /* USB 2.0 high speed, 125 us microframes */
+    { "ft2232h-fs",  1000000, 50000,    17 },  /* behind a full speed hub, 1 ms frames */
+    { "ideal",       0,       0,        17 },  /* no USB latency, bit-bang clock only */
+};
+const unsigned int sim_usb_profiles_count = sizeof(sim_usb_profiles) / sizeof(sim_usb_profiles[0]);
+
+const struct sim_nand_timing sim_default_timing =
+{
+    25000,   /* tR */
+    200000,  /* tPROG */
+    2000000, /* tBERS */
+    5000     /* tRST */
+};
+
+struct sim_stats sim_stats;
+
+const struct sim_responder *sim_responder;
+
+/* AC characteristics of the 4 Gbit x8 device (HY27UF084G2B) */
+struct sim_bus_timing sim_bus_timing[SIM_TIMING_COUNT] =
+{
+    { "tCS",  20 },
+    { "tCLS", 12 },
+    { "tCLH", 5 },
+    { "tALS", 12 },
+    { "tALH", 5 },
+    { "tWP",  12 },
+    { "tWH",  10 },
+    { "tWC",  25 },
+    { "tDS",  12 },
+    { "tDH",  5 },
+    { "tADL", 70 },
+    { "tWB",  100 },
+    { "tWHR", 60 },
+    { "tAR",  10 },
+    { "tCLR", 10 },
+    { "tRR",  20 },
+    { "tRP",  12 },
+    { "tREH", 10 },
+    { "tRC",  25 },
+    { "tREA", 20 },
+    { "tRHZ", 100 },
+};
+
+unsigned int sim_timing_report_max = 10; /* violations reported in detail */
+
+struct sim_faults sim_faults = { { 0 }, 1000000, 500000000, 1 };
+
+unsigned char sim_unique_id[UNIQUE_ID_SIZE] =
+{
+    0x48, 0x59, 0x32, 0x37, 0x55, 0x46, 0x30, 0x38, 0x34, 0x47, 0x32, 0x42, 0x00, 0x00, 0x00, 0x01
+};
+
+const char *const sim_fault_names[SIM_FAULT_COUNT] =
+{
+    "bitflip", "stuck-busy", "program-fail", "erase-fail", "usb-drop", "disconnect"
+};
+
+#define SIM_NEVER UINT64_MAX
+
+typedef enum { SIM_OUT_NONE=0, SIM_OUT_ID, SIM_OUT_DATA, SIM_OUT_STATUS, SIM_OUT_PARAM, SIM_OUT_UNIQUE_ID } sim_output_t;
+
+#define SIM_FEATURE_BUSY_NS 1000 /* tFEAT */
+
+static struct
+{
+    const struct sim_usb_profile *profile;
+    struct sim_nand_timing timing;
+    struct nand_geometry geometry;
+    unsigned char ID_register[5];
+    unsigned char parameter_page[ONFI_PARAM_PAGE_COPIES * ONFI_PARAM_PAGE_SIZE];
+    unsigned char parameter_output[ONFI_PARAM_PAGE_COPIES * ONFI_PARAM_PAGE_SIZE]; /* as read out, with bitflips */
+
+    unsigned char control;      /* control bus as driven by the host */
+    unsigned char io_host;      /* I/O bus as driven by the host */
+    unsigned char io_chip;      /* I/O bus as driven by the chip */
+    iobus_inout_t io_direction;
+
+    unsigned char command;      /* last latched command */
+    unsigned char address[NAND_MAX_ADDRESS_CYCLES];
+    unsigned int address_count;
+    sim_output_t output;
+    unsigned int column;        /* column address counter */
+    uint32_t row;
+    int data_input;             /* serial data input after 80h is active */
+    unsigned char feature_address;
+    unsigned char feature_parameters[4];
+    int otp_mode;               /* array operation mode: page reads and programs go to the OTP area */
+
+    unsigned char *data_register;
+    unsigned char status;
+    uint64_t busy_until;        /* virtual time the chip becomes ready again */
+
+    unsigned char **blocks;     /* NULL: erased block */
+    unsigned char *otp;         /* OTP area, NAND_OTP_PAGES pages */
+
+    /* time of the last edges, SIM_NEVER if there was none yet */
+    uint64_t t_nce_fall;
+    uint64_t t_cle_rise, t_cle_fall, t_ale_rise, t_ale_fall;
+    uint64_t t_nwe_fall, t_nwe_rise, t_nre_fall, t_nre_rise;
+    uint64_t t_io_change;
+    uint64_t t_address_latch;   /* nWE rise of the last address cycle */
+    uint64_t t_busy_start;      /* nWE rise of the last command that made the chip busy */
+    int ready_pending;          /* busy period whose end has not been followed by nRE yet */
+
+    uint32_t random;            /* fault generator state */
+    uint64_t disconnected_until;
+} sim;
+
+static unsigned int sim_page_size_total(void)
+{
+    return sim.geometry.page_size + sim.geometry.spare_size;
+}
+
+/* xorshift32; returns 1 with the probability of the given fault */
+static int sim_inject(sim_fault_t fault)
+{
+    if( sim_faults.rate[fault] <= 0.0 )
+        return 0;
+
+    sim.random ^= sim.random << 13;
+    sim.random ^= sim.random >> 17;
+    sim.random ^= sim.random << 5;
+    if( (double)sim.random / 4294967296.0 >= sim_faults.rate[fault] )
+        return 0;
+
+    sim_stats.faults[fault]++;
+    return 1;
+}
+
+/* one synchronous USB transfer carrying the given number of bytes;
+ * returns -1 if the transfer failed */
+static int sim_usb_transfer(unsigned int bytes)
+{
+    uint64_t t = sim_stats.time_ns + sim.profile->transfer_ns;
+
+    if( sim_stats.time_ns < sim.disconnected_until )
+    {
+        sim_stats.time_ns = t; /* no device: fails right away */
+        return -1;
+    }
+    if( sim_inject(SIM_FAULT_DISCONNECT) )
+    {
+        sim.disconnected_until = t + sim_faults.disconnect_ns;
+        sim_stats.time_ns = t;
+        return -1;
+    }
+    if( sim_inject(SIM_FAULT_USB_DROP) )
+    {
+        sim_stats.time_ns += sim_faults.usb_timeout_ns;
+        return -1;
+    }
+
+    if( sim.profile->frame_ns )
+        t = (t + sim.profile->frame_ns - 1) / sim.profile->frame_ns * sim.profile->frame_ns;
+
+    sim_stats.time_ns = t + (uint64_t)bytes * sim.profile->byte_ns;
+    sim_stats.transfers++;
+    return 0;
+}
+
+static int sim_ready(void)
+{
+    return sim_stats.time_ns >= sim.busy_until;
+}
+
+static void sim_set_busy(unsigned int duration_ns)
+{
+    sim.busy_until = sim_stats.time_ns + duration_ns;
+    sim_stats.busy_ns += duration_ns;
+}
+
+/* busy period of an array operation, which may hang until the next reset */
+static void sim_set_busy_operation(unsigned int duration_ns)
+{
+    sim_set_busy(duration_ns);
+    if( sim_inject(SIM_FAULT_STUCK_BUSY) )
+        sim.busy_until = SIM_NEVER;
+}
+
+static void sim_inject_bitflips(unsigned char *data, unsigned int size)
+{
+    if( sim_faults.rate[SIM_FAULT_BITFLIP] <= 0.0 )
+        return;
+    for(unsigned int k = 0; k < size; k++)
+        for(unsigned int bit = 0; bit < 8; bit++)
+            if( sim_inject(SIM_FAULT_BITFLIP) )
+                data[k] ^= 1 << bit;
+}
+
+static unsigned char *sim_page(uint32_t row, int allocate)
+{
+    unsigned int block = row / sim.geometry.pages_per_block;
+    unsigned int page_size = sim_page_size_total();
+
+    if( sim.otp_mode )
+    {
+        if( row < NAND_OTP_FIRST_PAGE || row >= NAND_OTP_FIRST_PAGE + NAND_OTP_PAGES )
+            return NULL;
+        return sim.otp + (size_t)(row - NAND_OTP_FIRST_PAGE) * page_size;
+    }
+
+    if( block >= sim.geometry.blocks )
+        return NULL;
+
+    if( sim.blocks[block] == NULL )
+    {
+        if( !allocate )
+            return NULL;
+        sim.blocks[block] = malloc((size_t)page_size * sim.geometry.pages_per_block);
+        if( sim.blocks[block] == NULL )
+            return NULL;
+        memset(sim.blocks[block], 0xFF, (size_t)page_size * sim.geometry.pages_per_block);
+    }
+
+    return sim.blocks[block] + (size_t)(row % sim.geometry.pages_per_block) * page_size;
+}
+
+/* value of address cycles, least significant byte first */
+static uint32_t sim_address_value(const unsigned char *cycles, unsigned int count)
+{
+    uint32_t value = 0;
+
+    while( count-- )
+        value = (value << 8) | cycles[count];
+    return value;
+}
+
+static unsigned int sim_address_cycles(void)
+{
+    return sim.geometry.column_cycles + sim.geometry.row_cycles;
+}
+
+static void sim_decode_address(void)
+{
+    sim.column = sim_address_value(sim.address, sim.geometry.column_cycles);
+    sim.row = sim_address_value(sim.address + sim.geometry.column_cycles, sim.geometry.row_cycles);
+}
+
+/* recorded outcome of a program or erase operation overrides the model */
+static void sim_apply_responder_status(unsigned char command, uint32_t row, unsigned int *busy_ns)
+{
+    unsigned char status;
+
+    if( sim_responder && sim_responder->status(command, row, &status, busy_ns) )
+        sim.status = (sim.status & ~STATUSREG_IO0) | (status & STATUSREG_IO0);
+}
+
+static void sim_latch_command(unsigned char command)
+{
+    unsigned char *page;
+    unsigned int busy_ns;
+
+    /* only read status and reset are accepted while busy */
+    if( !sim_ready() && command != 0x70 && command != 0xFF )
+        return;
+
+    switch( command )
+    {
+        case 0x90: /* read ID */
+        case 0xEC: /* read parameter page */
+        case 0xED: /* read unique ID */
+        case 0xEF: /* set features */
+        case 0x00: /* page read setup */
+        case 0x60: /* block erase setup */
+            sim.address_count = 0;
+            sim.output = SIM_OUT_NONE;
+            sim.data_input = 0;
+            break;
+
+        case 0x80: /* serial data input */
+            sim.address_count = 0;
+            sim.output = SIM_OUT_NONE;
+            sim.data_input = 1;
+            memset(sim.data_register, 0xFF, sim_page_size_total());
+            break;
+
+        case 0x30: /* page read confirm */
+            if( sim.command != 0x00 || sim.address_count != sim_address_cycles() )
+                break;
+            sim_decode_address();
+            busy_ns = sim.timing.tR_ns;
+            if( !(sim_responder && sim_responder->page_read(sim.row, sim.data_register, sim_page_size_total(), &busy_ns)) )
+            {
+                page = sim_page(sim.row, 0);
+                if( page )
+                    memcpy(sim.data_register, page, sim_page_size_total());
+                else
+                    memset(sim.data_register, 0xFF, sim_page_size_total());
+            }
+            sim_inject_bitflips(sim.data_register, sim_page_size_total());
+            sim_set_busy_operation(busy_ns);
+            sim.output = SIM_OUT_DATA;
+            break;
+
+        case 0x10: /* page program confirm */
+            sim.data_input = 0;
+            if( sim.command != 0x80 || sim.address_count != sim_address_cycles() )
+                break;
+            sim.status &= ~STATUSREG_IO0;
+            if( sim.control & PIN_nWP )
+            {
+                page = sim_page(sim.row, 1);
+                if( page == NULL )
+                    sim.status |= STATUSREG_IO0;
+                else
+                    for(unsigned int k = 0; k < sim_page_size_total(); k++)
+                        page[k] &= sim.data_register[k]; /* programming can only clear bits */
+                if( sim_inject(SIM_FAULT_PROGRAM) )
+                    sim.status |= STATUSREG_IO0;
+                busy_ns = sim.timing.tPROG_ns;
+                sim_apply_responder_status(command, sim.row, &busy_ns);
+                sim_set_busy_operation(busy_ns);
+            }
+            break;
+
+        case 0xD0: /* block erase confirm */
+            if( sim.command != 0x60 || sim.address_count != sim.geometry.row_cycles )
+                break;
+            sim.status &= ~STATUSREG_IO0;
+            if( sim.control & PIN_nWP )
+            {
+                uint32_t row = sim_address_value(sim.address, sim.geometry.row_cycles);
+                unsigned int block = row / sim.geometry.pages_per_block;
+                if( block < sim.geometry.blocks && sim_inject(SIM_FAULT_ERASE) )
+                    sim.status |= STATUSREG_IO0;
+                else if( block < sim.geometry.blocks )
+                {
+                    free(sim.blocks[block]);
+                    sim.blocks[block] = NULL;
+                }
+                else
+                    sim.status |= STATUSREG_IO0;
+                busy_ns = sim.timing.tBERS_ns;
+                sim_apply_responder_status(command, row, &busy_ns);
+                sim_set_busy_operation(busy_ns);
+            }
+            break;
+
+        case 0x70: /* read status */
+            sim.output = SIM_OUT_STATUS;
+            break;
+
+        case 0xFF: /* reset */
+            sim.output = SIM_OUT_NONE;
+            sim.data_input = 0;
+            sim.address_count = 0;
+            sim.status &= ~STATUSREG_IO0;
+            sim_set_busy(sim.timing.tRST_ns);
+            break;
+
+        default:
+            return;
+    }
+
+    sim.command = command;
+}
+
+static void sim_latch_address(unsigned char address)
+{
+    if( sim.address_count < sizeof(sim.address) )
+        sim.address[sim.address_count++] = address;
+
+    if( sim.command == 0x90 )
+    {
+        sim.column = 0;
+        sim.output = SIM_OUT_ID;
+    }
+    else if( sim.command == 0xEC && sim.address_count == 1 )
+    {
+        /* the copies are read from the array and hit by bitflips like page data */
+        memcpy(sim.parameter_output, sim.parameter_page, sizeof(sim.parameter_page));
+        sim_inject_bitflips(sim.parameter_output, sizeof(sim.parameter_output));
+        sim.column = 0;
+        sim.output = SIM_OUT_PARAM;
+        sim_set_busy_operation(sim.timing.tR_ns);
+    }
+    else if( sim.command == 0xED && sim.address_count == 1 )
+    {
+        sim.column = 0;
+        sim.output = SIM_OUT_UNIQUE_ID;
+        sim_set_busy_operation(sim.timing.tR_ns);
+    }
+    else if( sim.command == 0xEF && sim.address_count == 1 )
+    {
+        sim.feature_address = address;
+        sim.column = 0;
+        sim.data_input = 1;
+    }
+    else if( sim.command == 0x80 && sim.address_count == sim_address_cycles() )
+        sim_decode_address();
+}
+
+/* four parameter bytes of set features are complete */
+static void sim_set_feature(void)
+{
+    if( sim.feature_address == FEATURE_ARRAY_OPERATION_MODE )
+        sim.otp_mode = sim.feature_parameters[0] == FEATURE_MODE_OTP;
+    sim.data_input = 0;
+    sim_set_busy(SIM_FEATURE_BUSY_NS);
+}
+
+static void sim_latch_data(unsigned char data)
+{
+    if( !sim.data_input )
+        return;
+    if( sim.command == 0xEF )
+    {
+        sim.feature_parameters[sim.column++] = data;
+        if( sim.column == sizeof(sim.feature_parameters) )
+            sim_set_feature();
+        return;
+    }
+    if( sim.column < sim_page_size_total() )
+        sim.data_register[sim.column] = data;
+    sim.column++;
+}
+
+static unsigned char sim_status(void)
+{
+    unsigned char status = sim.status & STATUSREG_IO0;
+
+    if( sim_ready() )
+        status |= STATUSREG_IO6;
+    if( sim.control & PIN_nWP )
+        status |= STATUSREG_IO7;
+    return status;
+}
+
+/* falling edge of nRE: drive the next output byte onto the I/O bus */
+static void sim_output_byte(void)
+{
+    switch( sim.output )
+    {
+        case SIM_OUT_ID:
+            sim.io_chip = sim.column < sizeof(sim.ID_register) ? sim.ID_register[sim.column] : 0x00;
+            sim.column++;
+            break;
+        case SIM_OUT_DATA:
+            sim.io_chip = sim.column < sim_page_size_total() ? sim.data_register[sim.column] : 0xFF;
+            sim.column++;
+            break;
+        case SIM_OUT_STATUS:
+            sim.io_chip = sim_status();
+            break;
+        case SIM_OUT_PARAM:
+            sim.io_chip = sim.parameter_output[sim.column % sizeof(sim.parameter_output)];
+            sim.column++;
+            break;
+        case SIM_OUT_UNIQUE_ID:
+            /* every copy is the ID followed by its complement */
+            if( sim.column % (2 * UNIQUE_ID_SIZE) < UNIQUE_ID_SIZE )
+                sim.io_chip = sim_unique_id[sim.column % UNIQUE_ID_SIZE];
+            else
+                sim.io_chip = ~sim_unique_id[sim.column % UNIQUE_ID_SIZE];
+            sim.column++;
+            break;
+        default:
+            break;
+    }
+}
+
+static const char *sim_operation_name(void)
+{
+    switch( sim.command )
+    {
+        case 0x00: case 0x30: return "page read";
+        case 0x80: case 0x10: return "page program";
+        case 0x60: case 0xD0: return "block erase";
+        case 0x70: return "read status";
+        case 0x90: return "read ID";
+        case 0xEC: return "read parameter page";
+        case 0xED: return "read unique ID";
+        case 0xEF: return "set features";
+        case 0xFF: return "reset";
+        default: return "idle";
+    }
+}
+
+/* the edge at time t must be at least the parameter's minimum after the edge at time since */
+static void sim_check_timing(sim_timing_param_t param, uint64_t since, uint64_t t)
+{
+    uint64_t distance;
+
+    if( since == SIM_NEVER )
+        return;
+
+    distance = t >= since ? t - since : 0;
+    if( distance >= sim_bus_timing[param].min_ns )
+        return;
+
+    sim_stats.timing_violations++;
+    sim_stats.violations[param]++;
+    if( sim_stats.timing_violations <= sim_timing_report_max )
+        fprintf(stderr, "timing violation: %s is %llu ns (min %u ns) during %s (command %02Xh, row 0x%06X) at %llu ns\n",
+            sim_bus_timing[param].name, (unsigned long long)distance, sim_bus_timing[param].min_ns,
+            sim_operation_name(), sim.command, sim.row, (unsigned long long)t);
+}
+
+static void sim_check_control_edges(unsigned char previous, unsigned char value, uint64_t t)
+{
+    unsigned char rising = ~previous & value;
+    unsigned char falling = previous & ~value;
+
+    if( falling & PIN_nCE )
+        sim.t_nce_fall = t;
+    if( value & PIN_nCE )
+        return;
+
+    if( falling & PIN_CLE )
+        sim_check_timing(T_CLH, sim.t_nwe_rise, t);
+    if( falling & PIN_ALE )
+        sim_check_timing(T_ALH, sim.t_nwe_rise, t);
+
+    if( falling & PIN_nWE )
+    {
+        sim_check_timing(T_WH, sim.t_nwe_rise, t);
+        sim_check_timing(T_WC, sim.t_nwe_fall, t);
+    }
+
+    /* only edges that latch a command, an address or input data have setup requirements */
+    if( (rising & PIN_nWE) &&
+        (((value & PIN_CLE) != 0) != ((value & PIN_ALE) != 0) || (sim.data_input && !(value & (PIN_CLE | PIN_ALE)))) )
+    {
+        sim_check_timing(T_CS, sim.t_nce_fall, t);
+        sim_check_timing(T_WP, sim.t_nwe_fall, t);
+        sim_check_timing(T_DS, sim.t_io_change, t);
+        if( value & PIN_CLE )
+            sim_check_timing(T_CLS, sim.t_cle_rise, t);
+        else if( value & PIN_ALE )
+            sim_check_timing(T_ALS, sim.t_ale_rise, t);
+        else
+            sim_check_timing(T_ADL, sim.t_address_latch, t);
+    }
+
+    if( falling & PIN_nRE )
+    {
+        sim_check_timing(T_WHR, sim.t_nwe_rise, t);
+        sim_check_timing(T_AR, sim.t_ale_fall, t);
+        sim_check_timing(T_CLR, sim.t_cle_fall, t);
+        sim_check_timing(T_REH, sim.t_nre_rise, t);
+        sim_check_timing(T_RC, sim.t_nre_fall, t);
+        if( sim.ready_pending )
+        {
+            sim_check_timing(T_RR, sim.busy_until, t);
+            sim.ready_pending = 0;
+        }
+    }
+    if( rising & PIN_nRE )
+        sim_check_timing(T_RP, sim.t_nre_fall, t);
+}
+
+static void sim_record_control_edges(unsigned char previous, unsigned char value, uint64_t t)
+{
+    unsigned char rising = ~previous & value;
+    unsigned char falling = previous & ~value;
+
+    if( rising & PIN_CLE ) sim.t_cle_rise = t;
+    if( falling & PIN_CLE ) sim.t_cle_fall = t;
+    if( rising & PIN_ALE ) sim.t_ale_rise = t;
+    if( falling & PIN_ALE ) sim.t_ale_fall = t;
+    if( rising & PIN_nWE ) sim.t_nwe_rise = t;
+    if( falling & PIN_nWE ) sim.t_nwe_fall = t;
+    if( rising & PIN_nRE ) sim.t_nre_rise = t;
+    if( falling & PIN_nRE ) sim.t_nre_fall = t;
+}
+
+static int sim_write_controlbus(unsigned char value)
+{
+    unsigned char previous = sim.control;
+    uint64_t busy_until = sim.busy_until;
+
+    if( sim_usb_transfer(1) != 0 )
+        return -1;
+    sim_stats.bytes_out++;
+    sim.control = value;
+
+    sim_check_control_edges(previous, value, sim_stats.time_ns);
+    sim_record_control_edges(previous, value, sim_stats.time_ns);
+
+    if( value & PIN_nCE )
+        return 1;
+
+    /* rising edge of nWE latches command, address or data */
+    if( !(previous & PIN_nWE) && (value & PIN_nWE) )
+    {
+        if( (value & PIN_CLE) && !(value & PIN_ALE) )
+            sim_latch_command(sim.io_host);
+        else if( (value & PIN_ALE) && !(value & PIN_CLE) )
+        {
+            sim_latch_address(sim.io_host);
+            sim.t_address_latch = sim_stats.time_ns;
+        }
+        else if( !(value & (PIN_CLE | PIN_ALE)) )
+            sim_latch_data(sim.io_host);
+
+        if( sim.busy_until != busy_until )
+        {
+            sim.t_busy_start = sim_stats.time_ns;
+            sim.ready_pending = 1;
+        }
+    }
+
+    /* falling edge of nRE */
+    if( (previous & PIN_nRE) && !(value & PIN_nRE) )
+        sim_output_byte();
+
+    return 1;
+}
+
+static int sim_write_iobus(unsigned char value)
+{
+    if( sim_usb_transfer(1) != 0 )
+        return -1;
+    sim_stats.bytes_out++;
+    if( value != sim.io_host )
+    {
+        if( !(sim.control & PIN_nCE) )
+            sim_check_timing(T_DH, sim.t_nwe_rise, sim_stats.time_ns);
+        sim.t_io_change = sim_stats.time_ns;
+    }
+    sim.io_host = value;
+    return 1;
+}
+
+static int sim_set_iobus_direction(iobus_inout_t inout)
+{
+    if( sim_usb_transfer(0) != 0 ) /* control transfer */
+        return -1;
+    if( inout == IOBUS_OUT && sim.io_direction == IOBUS_IN )
+    {
+        /* the chip must have released the bus */
+        if( !(sim.control & PIN_nRE) )
+            sim_check_timing(T_RHZ, sim_stats.time_ns, sim_stats.time_ns);
+        else
+            sim_check_timing(T_RHZ, sim.t_nre_rise, sim_stats.time_ns);
+        sim.t_io_change = sim_stats.time_ns;
+    }
+    sim.io_direction = inout;
+    return 0;
+}
+
+static unsigned char sim_read_controlbus(void)
+{
+    if( sim_usb_transfer(1) != 0 )
+    {
+        nand_errors.bus_errors++;
+        return 0x00;
+    }
+    sim_stats.bytes_in++;
+    sim_check_timing(T_WB, sim.t_busy_start, sim_stats.time_ns);
+    return (sim.control & CONTROLBUS_BITMASK) | (sim_ready() ? PIN_RDY : 0);
+}
+
+static unsigned char sim_read_iobus(void)
+{
+    if( sim_usb_transfer(1) != 0 )
+    {
+        nand_errors.bus_errors++;
+        return 0x00;
+    }
+    sim_stats.bytes_in++;
+    if( !(sim.control & (PIN_nCE | PIN_nRE)) )
+        sim_check_timing(T_REA, sim.t_nre_fall, sim_stats.time_ns);
+    if( sim.io_direction == IOBUS_OUT )
+        return sim.io_host;
+    return sim.io_chip;
+}
+
+static void sim_delay_us(unsigned int usec)
+{
+    sim_stats.time_ns += (uint64_t)usec * 1000;
+}
+
+static uint64_t sim_now_ns(void)
+{
+    return sim_stats.time_ns;
+}
+
+const struct bus_backend sim_backend =
+{
+    "sim",
+    sim_write_controlbus,
+    sim_write_iobus,
+    sim_set_iobus_direction,
+    sim_read_controlbus,
+    sim_read_iobus,
+    sim_delay_us,
+    sim_now_ns
+};
+
+static void sim_put_le(unsigned char *p, uint32_t value, unsigned int bytes)
+{
+    for(unsigned int k = 0; k < bytes; k++)
+        p[k] = (unsigned char)(value >> (8 * k));
+}
+
+/* ONFI parameter page of the simulated geometry, repeated ONFI_PARAM_PAGE_COPIES times */
+static void sim_build_parameter_page(void)
+{
+    unsigned char *page = sim.parameter_page;
+
+    memset(page, 0, ONFI_PARAM_PAGE_SIZE);
+    memcpy(&page[0], "ONFI", 4);
+    sim_put_le(&page[4], 0x0002, 2);              /* revision: ONFI 1.0 */
+    memcpy(&page[32], "HYNIX       ", 12);        /* manufacturer */
+    memcpy(&page[44], "HY27UF084G2B        ", 20); /* model */
+    sim_put_le(&page[8], 0x0024, 2);              /* optional commands: get / set features, read unique ID */
+    page[64] = sim.ID_register[0];                /* JEDEC manufacturer ID */
+    sim_put_le(&page[80], sim.geometry.page_size, 4);
+    sim_put_le(&page[84], sim.geometry.spare_size, 2);
+    sim_put_le(&page[92], sim.geometry.pages_per_block, 4);
+    sim_put_le(&page[96], sim.geometry.blocks, 4);
+    page[100] = 1;                                /* LUNs */
+    page[101] = (unsigned char)(sim.geometry.column_cycles << 4 | sim.geometry.row_cycles); /* address cycles */
+    page[102] = 1;                                /* bits per cell */
+    sim_put_le(&page[ONFI_PARAM_PAGE_SIZE - 2], onfi_crc16(page, ONFI_PARAM_PAGE_SIZE - 2), 2);
+
+    for(unsigned int k = 1; k < ONFI_PARAM_PAGE_COPIES; k++)
+        memcpy(&page[k * ONFI_PARAM_PAGE_SIZE], page, ONFI_PARAM_PAGE_SIZE);
+}
+
+int sim_init(const struct sim_usb_profile *profile, const struct sim_nand_timing *timing,
+    const struct nand_geometry *geometry, const unsigned char *ID_register)
+{
+    sim_free();
+
+    if( !nand_geometry_addressable(geometry) )
+    {
+        fprintf(stderr, "The simulated geometry cannot be addressed.\n");
+        return EXIT_FAILURE;
+    }
+    memset(&sim, 0, sizeof(sim));
+    sim.profile = profile;
+    sim.timing = *timing;
+    sim.geometry = *geometry;
+    sim.geometry.column_cycles = nand_column_cycles(geometry);
+    sim.geometry.row_cycles = nand_row_cycles(geometry);
+    memcpy(sim.ID_register, ID_register, sizeof(sim.ID_register));
+    sim_build_parameter_page();
+    sim.control = PIN_nCE | PIN_nWE | PIN_nRE;
+    sim.io_direction = IOBUS_OUT;
+
+    sim.data_register = malloc(sim_page_size_total());
+    sim.blocks = calloc(geometry->blocks, sizeof(*sim.blocks));
+    sim.otp = malloc((size_t)NAND_OTP_PAGES * sim_page_size_total());
+    if( sim.data_register == NULL || sim.blocks == NULL || sim.otp == NULL )
+    {
+        fprintf(stderr, "Failed to allocate the simulated chip.\n");
+        sim_free();
+        return EXIT_FAILURE;
+    }
+    memset(sim.data_register, 0xFF, sim_page_size_total());
+    memset(sim.otp, 0xFF, (size_t)NAND_OTP_PAGES * sim_page_size_total());
+
+    sim_reset_stats();
+    return 0;
+}
+
+const struct sim_usb_profile *sim_find_profile(const char *name)
+{
+    for(unsigned int k = 0; k < sim_usb_profiles_count; k++)
+        if( strcmp(sim_usb_profiles[k].name, name) == 0 )
+            return &sim_usb_profiles[k];
+    return NULL;
+}
+
+void sim_free(void)
+{
+    if( sim.blocks )
+    {
+        for(unsigned int k = 0; k < sim.geometry.blocks; k++)
+            free(sim.blocks[k]);
+        free(sim.blocks);
+        sim.blocks = NULL;
+    }
+    free(sim.data_register);
+    sim.data_register = NULL;
+    free(sim.otp);
+    sim.otp = NULL;
+}
+
+void sim_reset_stats(void)
+{
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    sim.busy_until = 0;
+
+    sim.t_nce_fall = SIM_NEVER;
+    sim.t_cle_rise = sim.t_cle_fall = SIM_NEVER;
+    sim.t_ale_rise = sim.t_ale_fall = SIM_NEVER;
+    sim.t_nwe_fall = sim.t_nwe_rise = SIM_NEVER;
+    sim.t_nre_fall = sim.t_nre_rise = SIM_NEVER;
+    sim.t_io_change = SIM_NEVER;
+    sim.t_address_latch = SIM_NEVER;
+    sim.t_busy_start = SIM_NEVER;
+    sim.ready_pending = 0;
+
+    sim.random = sim_faults.seed ? sim_faults.seed : 1;
+    sim.disconnected_until = 0;
+}
+
+void sim_print_timing_summary(FILE *fp)
+{
+    for(unsigned int k = 0; k < SIM_TIMING_COUNT; k++)
+        if( sim_stats.violations[k] )
+            fprintf(fp, "  %-5s (min %3u ns): %llu violations\n", sim_bus_timing[k].name,
+                sim_bus_timing[k].min_ns, (unsigned long long)sim_stats.violations[k]);
+}
@@ -0,0 +1,148 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file nand_sim.h
+ * \brief Simulated FT2232H + NAND flash bus backend
+ * Runs on a virtual clock: every USB transfer, chip busy time and delay
+ * advances the clock by a modelled amount, so results are deterministic.
+ * Faults (bitflips, stuck busy line, failed program/erase, dropped USB
+ * transfers, disconnects) can be injected at configurable rates from a seeded
+ * generator, so the recovery paths are deterministic as well.
+ */
+
+#ifndef NAND_SIM_H
+#define NAND_SIM_H
+
+#include <stdint.h>
+#include "nand.h"
+
+/* USB / FT2232H cost model */
+struct sim_usb_profile
+{
+    const char *name;
+    unsigned int frame_ns;    /* (micro)frame period, transfers complete on frame boundaries (0: no framing) */
+    unsigned int transfer_ns; /* host and device overhead per transfer */
+    unsigned int byte_ns;     /* bit-bang clock, time to shift one byte through the FIFO */
+};
+
+/* Chip busy times */
+struct sim_nand_timing
+{
+    unsigned int tR_ns;    /* page read: cell array to data register */
+    unsigned int tPROG_ns; /* page program */
+    unsigned int tBERS_ns; /* block erase */
+    unsigned int tRST_ns;  /* reset */
+};
+
+/* Bus (AC) timing parameters checked on every edge */
+typedef enum
+{
+    T_CS = 0, /* nCE setup to nWE high */
+    T_CLS,    /* CLE setup to nWE high */
+    T_CLH,    /* CLE hold after nWE high */
+    T_ALS,    /* ALE setup to nWE high */
+    T_ALH,    /* ALE hold after nWE high */
+    T_WP,     /* nWE pulse width */
+    T_WH,     /* nWE high hold time */
+    T_WC,     /* write cycle time */
+    T_DS,     /* data setup to nWE high */
+    T_DH,     /* data hold after nWE high */
+    T_ADL,    /* address to data loading */
+    T_WB,     /* nWE high to busy: RDY must not be sampled earlier */
+    T_WHR,    /* nWE high to nRE low */
+    T_AR,     /* ALE low to nRE low */
+    T_CLR,    /* CLE low to nRE low */
+    T_RR,     /* ready to nRE low */
+    T_RP,     /* nRE pulse width */
+    T_REH,    /* nRE high hold time */
+    T_RC,     /* read cycle time */
+    T_REA,    /* nRE low to data valid: data must not be sampled earlier */
+    T_RHZ,    /* nRE high to output high-Z: host must not drive the I/O bus earlier */
+    SIM_TIMING_COUNT
+} sim_timing_param_t;
+
+struct sim_bus_timing
+{
+    const char *name;
+    unsigned int min_ns; /* minimum distance between the two edges */
+};
+
+/* Injected faults */
+typedef enum
+{
+    SIM_FAULT_BITFLIP = 0, /* bit read back inverted (transient, the stored page is intact) */
+    SIM_FAULT_STUCK_BUSY,  /* RDY stays low after an operation until the chip is reset */
+    SIM_FAULT_PROGRAM,     /* page program reports failure (status IO0) */
+    SIM_FAULT_ERASE,       /* block erase reports failure, the block keeps its content */
+    SIM_FAULT_USB_DROP,    /* USB transfer times out */
+    SIM_FAULT_DISCONNECT,  /* device drops off the bus for a while */
+    SIM_FAULT_COUNT
+} sim_fault_t;
+
+/* Fault rates are probabilities per bit read, per busy operation, per program,
+ * per erase and per USB transfer; all zero disables fault injection */
+struct sim_faults
+{
+    double rate[SIM_FAULT_COUNT];
+    unsigned int usb_timeout_ns; /* time a dropped transfer costs */
+    uint64_t disconnect_ns;      /* duration of a disconnect */
+    uint32_t seed;
+};
+
+struct sim_stats
+{
+    uint64_t time_ns;   /* virtual time */
+    uint64_t transfers; /* USB transfers (bulk and control) */
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t busy_ns;   /* accumulated chip busy time */
+    uint64_t timing_violations;
+    uint64_t violations[SIM_TIMING_COUNT];
+    uint64_t faults[SIM_FAULT_COUNT];
+};
+
+/**
+ * Optional source of recorded chip responses (see replay.c).
+ * The callbacks return 0 when nothing was recorded for the operation;
+ * the chip model answers then.
+ */
+struct sim_responder
+{
+    int (*page_read)(uint32_t row, unsigned char *data, unsigned int size, unsigned int *busy_ns);
+    int (*status)(unsigned char command, uint32_t row, unsigned char *status, unsigned int *busy_ns);
+};
+
+extern const struct sim_usb_profile sim_usb_profiles[];
+extern const unsigned int sim_usb_profiles_count;
+extern const struct sim_nand_timing sim_default_timing;
+extern const struct bus_backend sim_backend;
+extern struct sim_stats sim_stats;
+extern const struct sim_responder *sim_responder;
+extern struct sim_bus_timing sim_bus_timing[SIM_TIMING_COUNT];
+extern unsigned int sim_timing_report_max;
+extern struct sim_faults sim_faults;
+extern const char *const sim_fault_names[SIM_FAULT_COUNT];
+extern unsigned char sim_unique_id[UNIQUE_ID_SIZE];
+
+int sim_init(const struct sim_usb_profile *profile, const struct sim_nand_timing *timing,
+    const struct nand_geometry *geometry, const unsigned char *ID_register);
+const struct sim_usb_profile *sim_find_profile(const char *name);
+void sim_free(void);
+void sim_reset_stats(void);
+void sim_print_timing_summary(FILE *fp);
+
+#endif /* NAND_SIM_H */
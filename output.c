@@ -0,0 +1,367 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file output.c
+ * \brief Dump image output with an optional O_DIRECT path (see output.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "arena.h"
+#include "output.h"
+
+int output_flags;
+const char *output_path = "flashdump.bin";
+
+static int output_stdout = -1; /* the real stdout after output_claim_stdout() */
+
+/* keeps stdout for the image: everything else printed to stdout goes to
+ * stderr from now on */
+int output_claim_stdout(void)
+{
+    fflush(stdout);
+    output_stdout = dup(STDOUT_FILENO);
+    if( output_stdout < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 )
+    {
+        fprintf(stderr, "unable to redirect stdout: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+/* leaves O_DIRECT for the rest of the file */
+int output_set_buffered(struct dump_output *out)
+{
+    int flags = fcntl(out->fd, F_GETFL);
+
+    out->direct = 0;
+    if( flags < 0 || fcntl(out->fd, F_SETFL, flags & ~O_DIRECT) != 0 )
+    {
+        fprintf(stderr, "unable to switch off O_DIRECT: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+static int output_write_all(struct dump_output *out, const unsigned char *data, size_t length)
+{
+    while( length > 0 )
+    {
+        ssize_t n = write(out->fd, data, length);
+
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n < 0 && errno == EINVAL && out->direct )
+        {
+            /* the filesystem accepted the flag but not the transfer */
+            fprintf(stderr, "O_DIRECT write refused, falling back to buffered output\n");
+            if( output_set_buffered(out) != 0 )
+                return EXIT_FAILURE;
+            continue;
+        }
+        if( n <= 0 )
+        {
+            fprintf(stderr, "Failed to write to the dump file: %s\n", n < 0 ? strerror(errno) : "no progress");
+            return EXIT_FAILURE;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* hands the pages to the pipe and waits until the data of the previous call
+ * has been read, so the caller may refill that buffer */
+static int output_splice(struct dump_output *out, const unsigned char *data, size_t length)
+{
+    const struct timespec poll_interval = { 0, 50000 };
+    size_t done = 0;
+    int unread;
+
+    while( out->splice && done < length )
+    {
+        struct iovec iov = { (void *)(data + done), length - done };
+        ssize_t n = vmsplice(out->fd, &iov, 1, 0);
+
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS) )
+        {
+            fprintf(stderr, "vmsplice() refused, copying into the pipe\n");
+            out->splice = 0;
+            break;
+        }
+        if( n <= 0 )
+        {
+            fprintf(stderr, "Failed to write to the dump pipe: %s\n", n < 0 ? strerror(errno) : "no progress");
+            return EXIT_FAILURE;
+        }
+        done += n;
+        out->spliced += n;
+    }
+    if( !out->splice && output_write_all(out, data, length) != 0 )
+        return EXIT_FAILURE;
+
+    /* the pipe only holds pages: there is no event for it running empty */
+    while( out->in_pipe > 0 && ioctl(out->fd, FIONREAD, &unread) == 0 && (size_t)unread > length )
+        nanosleep(&poll_interval, NULL);
+    out->in_pipe = out->splice ? length : 0;
+    return 0;
+}
+
+/* after a fallback, whatever was staged goes first */
+static int output_flush_stage(struct dump_output *out)
+{
+    if( out->staged == 0 )
+        return 0;
+    if( output_write_all(out, arena_buffer(out->stage, 0), out->staged) != 0 )
+        return EXIT_FAILURE;
+    out->staged = 0;
+    return 0;
+}
+
+struct dump_output *output_open(const char *path, int flags)
+{
+    struct dump_output *out = calloc(1, sizeof(*out));
+    struct stat st;
+
+    if( out == NULL )
+        return NULL;
+
+    out->fd = -1;
+    out->flags = flags;
+    if( strcmp(path, OUTPUT_STDOUT) == 0 )
+    {
+        out->fd = dup(output_stdout >= 0 ? output_stdout : STDOUT_FILENO);
+        if( out->fd < 0 )
+            fprintf(stderr, "unable to write the image to stdout: %s\n", strerror(errno));
+    }
+    else if( (flags & OUTPUT_DIRECT) && !(flags & OUTPUT_MMAP) )
+    {
+        out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if( out->fd < 0 && errno == EINVAL )
+            fprintf(stderr, "%s does not support O_DIRECT, using buffered output\n", path);
+        else if( out->fd >= 0 )
+        {
+            out->stage = arena_create(OUTPUT_STAGE_SIZE, 1, 0);
+            if( out->stage == NULL )
+            {
+                close(out->fd);
+                free(out);
+                return NULL;
+            }
+            out->direct = 1;
+        }
+    }
+    if( out->fd < 0 && strcmp(path, OUTPUT_STDOUT) != 0 )
+        /* a shared writable mapping needs a descriptor that is open for reading too */
+        out->fd = open(path, ((flags & OUTPUT_MMAP) ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+    if( out->fd < 0 )
+    {
+        fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+        arena_destroy(out->stage);
+        free(out);
+        return NULL;
+    }
+
+    if( fstat(out->fd, &st) == 0 && S_ISFIFO(st.st_mode) )
+    {
+        if( out->direct )
+            output_set_buffered(out);
+        out->pipe = 1;
+        out->splice = 1;
+        /* best effort: a deeper pipe lets the reader fall behind further */
+        fcntl(out->fd, F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+    }
+    return out;
+}
+
+/* preallocates size bytes of the image and, with OUTPUT_MMAP, maps them.
+ * Only regular files are reserved; a pipe or /dev/null keeps the write path */
+int output_reserve(struct dump_output *out, uint64_t size)
+{
+    struct stat st;
+    void *map;
+    int ret;
+
+    if( size == 0 || out->reserved > 0 || fstat(out->fd, &st) != 0 || !S_ISREG(st.st_mode) )
+        return 0;
+
+    /* allocated blocks: a full disk fails here and not with SIGBUS on the mapping */
+    ret = fallocate(out->fd, 0, 0, (off_t)size);
+    if( ret != 0 && (errno == EOPNOTSUPP || errno == ENOSYS) )
+        ret = ftruncate(out->fd, (off_t)size);
+    if( ret != 0 )
+    {
+        fprintf(stderr, "unable to reserve %llu bytes for the dump file: %s\n",
+            (unsigned long long)size, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    out->reserved = size;
+    if( !(out->flags & OUTPUT_MMAP) )
+        return 0;
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+    if( map == MAP_FAILED )
+    {
+        fprintf(stderr, "unable to map the dump file (%s), using write()\n", strerror(errno));
+        return 0;
+    }
+    out->map = map;
+    return 0;
+}
+
+/* where the bytes at offset live in the mapped image; NULL if the image is not
+ * mapped or the range is outside of the reservation */
+unsigned char *output_window(struct dump_output *out, uint64_t offset, size_t length)
+{
+    if( out->map == NULL || offset > out->reserved || length > out->reserved - offset )
+        return NULL;
+    return out->map + offset;
+}
+
+/* writes at any offset of the image. Data that already is at its place in the
+ * mapping (see output_window()) is only accounted for */
+int output_write_at(struct dump_output *out, uint64_t offset, const unsigned char *data, size_t length)
+{
+    unsigned char *window = output_window(out, offset, length);
+
+    if( offset == out->end && out->map == NULL )
+        return output_write(out, data, length);
+
+    if( window )
+    {
+        if( window != data )
+            memcpy(window, data, length);
+    }
+    else
+    {
+        /* out of order, or outside of the mapping: pwrite() on the buffered file */
+        if( out->direct && output_set_buffered(out) != 0 )
+            return EXIT_FAILURE;
+        if( output_flush_stage(out) != 0 )
+            return EXIT_FAILURE;
+        for(size_t done = 0; done < length; )
+        {
+            ssize_t n = pwrite(out->fd, data + done, length - done, (off_t)(offset + done));
+
+            if( n < 0 && errno == EINTR )
+                continue;
+            if( n <= 0 )
+            {
+                fprintf(stderr, "Failed to write to the dump file: %s\n", n < 0 ? strerror(errno) : "no progress");
+                return EXIT_FAILURE;
+            }
+            done += n;
+        }
+    }
+    out->written += length;
+    if( offset + length > out->end )
+        out->end = offset + length;
+    return 0;
+}
+
+/* aligned whole blocks bypass the staging buffer while nothing is staged */
+int output_write(struct dump_output *out, const unsigned char *data, size_t length)
+{
+    if( out->map )
+        return output_write_at(out, out->end, data, length);
+
+    out->written += length;
+    out->end += length;
+    if( out->pipe )
+        return output_splice(out, data, length);
+    if( !out->direct )
+    {
+        if( output_flush_stage(out) != 0 )
+            return EXIT_FAILURE;
+        return output_write_all(out, data, length);
+    }
+
+    if( out->staged == 0 && (uintptr_t)data % ARENA_ALIGN == 0 && length % ARENA_ALIGN == 0 )
+        return output_write_all(out, data, length);
+
+    out->staged_bytes += length;
+    while( length > 0 )
+    {
+        size_t n = OUTPUT_STAGE_SIZE - out->staged;
+
+        if( n > length )
+            n = length;
+        memcpy(arena_buffer(out->stage, 0) + out->staged, data, n);
+        out->staged += n;
+        data += n;
+        length -= n;
+
+        if( out->staged == OUTPUT_STAGE_SIZE )
+        {
+            if( output_write_all(out, arena_buffer(out->stage, 0), OUTPUT_STAGE_SIZE) != 0 )
+                return EXIT_FAILURE;
+            out->staged = 0;
+        }
+    }
+    return 0;
+}
+
+/* writes the staged tail, cuts the reservation back to the data written and
+ * closes the image */
+int output_close(struct dump_output *out)
+{
+    int ret = 0;
+
+    if( out->map && munmap(out->map, out->reserved) != 0 )
+    {
+        fprintf(stderr, "Failed to unmap the dump file: %s\n", strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+
+    if( out->staged > 0 )
+    {
+        size_t aligned = out->staged / ARENA_ALIGN * ARENA_ALIGN;
+        unsigned char *stage = arena_buffer(out->stage, 0);
+
+        if( aligned > 0 )
+            ret = output_write_all(out, stage, aligned);
+        if( ret == 0 && out->direct )
+            ret = output_set_buffered(out);
+        if( ret == 0 )
+            ret = output_write_all(out, stage + aligned, out->staged - aligned);
+    }
+    if( out->reserved > out->end && ftruncate(out->fd, (off_t)out->end) != 0 )
+    {
+        fprintf(stderr, "Failed to truncate the dump file: %s\n", strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+    if( close(out->fd) != 0 )
+    {
+        fprintf(stderr, "Failed to close the dump file: %s\n", strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+    arena_destroy(out->stage);
+    free(out);
+    return ret;
+}
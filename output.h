@@ -0,0 +1,85 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file output.h
+ * \brief Dump image output with an optional O_DIRECT path
+ * With OUTPUT_DIRECT the image is opened with O_DIRECT: aligned buffers whose
+ * length is a multiple of ARENA_ALIGN (e.g. 64 pages of 2112 bytes from the
+ * page arena) go to the disk without passing through the page cache; anything
+ * else is collected in an aligned staging buffer first. The unaligned tail is
+ * written after O_DIRECT is switched off. If the filesystem refuses O_DIRECT
+ * the output falls back to plain buffered writes.
+ * Once the size of the image is known, output_reserve() preallocates it with
+ * fallocate(). With OUTPUT_MMAP the image is also mapped shared: pages are
+ * read straight into their place in the file (output_window()), and writes
+ * at any offset need no seek or system call. The image is cut back to the
+ * end of the data written when it is closed.
+ * The image may also go to a pipe: "-" is stdout (see output_claim_stdout()),
+ * and a FIFO is recognized when it is opened. Pipes get the data with
+ * vmsplice(), so the pipe takes the caller's pages without a copy. In exchange
+ * the buffer of the latest output_write() stays in use until the next call
+ * returns: every call waits until the data of the previous one has left the
+ * pipe, so writers have to alternate between (at least) two buffers.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OUTPUT_DIRECT     0x01
+#define OUTPUT_ASYNC      0x02 /* written by the asynchronous writer (writer.h) where possible */
+#define OUTPUT_MMAP       0x04 /* shared mapping of the reserved image; takes precedence over OUTPUT_DIRECT */
+#define OUTPUT_STAGE_SIZE (1024 * 1024)
+#define OUTPUT_PIPE_SIZE  (1024 * 1024) /* requested capacity of an image pipe */
+#define OUTPUT_STDOUT     "-"
+
+struct page_arena;
+
+struct dump_output
+{
+    int fd;
+    int flags;
+    int direct;                /* O_DIRECT is active */
+    struct page_arena *stage;  /* staging buffer of the direct path */
+    size_t staged;
+    uint64_t written;          /* bytes accepted so far */
+    uint64_t staged_bytes;     /* bytes that had to be copied into the staging buffer */
+    uint64_t end;              /* end of the data written; output_write() appends here */
+    uint64_t reserved;         /* bytes preallocated by output_reserve() */
+    unsigned char *map;        /* OUTPUT_MMAP: the reserved image, NULL if not mapped */
+    int pipe;                  /* stdout or a FIFO */
+    int splice;                /* the pipe is written with vmsplice() */
+    size_t in_pipe;            /* bytes of the latest vmsplice() that may still be in the pipe */
+    uint64_t spliced;          /* bytes handed to the pipe without a copy */
+};
+
+extern int output_flags; /* flags for the image of the dump paths */
+extern const char *output_path; /* image of the dump paths, OUTPUT_STDOUT for stdout */
+
+int output_claim_stdout(void);
+
+struct dump_output *output_open(const char *path, int flags);
+int output_reserve(struct dump_output *out, uint64_t size);
+unsigned char *output_window(struct dump_output *out, uint64_t offset, size_t length);
+int output_write(struct dump_output *out, const unsigned char *data, size_t length);
+int output_write_at(struct dump_output *out, uint64_t offset, const unsigned char *data, size_t length);
+int output_set_buffered(struct dump_output *out);
+int output_close(struct dump_output *out);
+
+#endif /* OUTPUT_H */
@@ -0,0 +1,440 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file plan.c
+ * \brief Dump runtime estimation and job planning (see plan.h)
+ * Cache read and erased-page skipping are not implemented by the reader yet;
+ * the planner models their bus sequences to show what they would save.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "nand.h"
+#include "plan.h"
+
+#define PLAN_CALIBRATION_ID_READS   4
+#define PLAN_CALIBRATION_PAGE_READS 2
+#define PLAN_DEFAULT_TRANSFER_NS    125000.0 /* one USB 2.0 microframe */
+#define PLAN_DEFAULT_TR_NS          25000.0
+#define PLAN_CACHE_BUSY_NS          3000.0   /* tDCBSYR: data register to cache register */
+#define PLAN_MIN_REFINE_WEIGHT      0.2
+
+/* bus sequence cost in USB transfers and REALWORLD_DELAY waits */
+struct plan_cost
+{
+    double transfers;
+    double delays;
+};
+
+static struct
+{
+    const struct bus_backend *inner;
+    struct plan_sample sample;
+    uint64_t start_ns;
+} meter;
+
+void plan_default_model(struct plan_model *model, const char *backend)
+{
+    memset(model, 0, sizeof(*model));
+    snprintf(model->backend, sizeof(model->backend), "%s", backend);
+    model->transfer_ns = PLAN_DEFAULT_TRANSFER_NS;
+    model->delay_factor = 1.0;
+    model->tR_ns = PLAN_DEFAULT_TR_NS;
+}
+
+/* model file: one line per backend, "name transfer_ns delay_factor tR_ns runs";
+ * returns 0 if the backend was found */
+int plan_load_model(const char *path, const char *backend, struct plan_model *model)
+{
+    FILE *fp = fopen(path, "r");
+    struct plan_model entry;
+
+    if( fp == NULL )
+        return 1;
+    while( fscanf(fp, "%31s %lf %lf %lf %u", entry.backend, &entry.transfer_ns,
+        &entry.delay_factor, &entry.tR_ns, &entry.runs) == 5 )
+    {
+        if( strcmp(entry.backend, backend) == 0 )
+        {
+            *model = entry;
+            fclose(fp);
+            return 0;
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* replaces the line of the model's backend, keeps all others */
+int plan_save_model(const char *path, const struct plan_model *model)
+{
+    struct plan_model *entries = NULL, entry;
+    unsigned int count = 0;
+    FILE *fp = fopen(path, "r");
+
+    if( fp )
+    {
+        while( fscanf(fp, "%31s %lf %lf %lf %u", entry.backend, &entry.transfer_ns,
+            &entry.delay_factor, &entry.tR_ns, &entry.runs) == 5 )
+        {
+            struct plan_model *grown;
+
+            if( strcmp(entry.backend, model->backend) == 0 )
+                continue;
+            grown = realloc(entries, (count + 1) * sizeof(*entries));
+            if( grown == NULL )
+                break;
+            entries = grown;
+            entries[count++] = entry;
+        }
+        fclose(fp);
+    }
+
+    fp = fopen(path, "w");
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to write cost model %s\n", path);
+        free(entries);
+        return EXIT_FAILURE;
+    }
+    for(unsigned int k = 0; k < count; k++)
+        fprintf(fp, "%s %.1f %.4f %.1f %u\n", entries[k].backend, entries[k].transfer_ns,
+            entries[k].delay_factor, entries[k].tR_ns, entries[k].runs);
+    fprintf(fp, "%s %.1f %.4f %.1f %u\n", model->backend, model->transfer_ns,
+        model->delay_factor, model->tR_ns, model->runs);
+    fclose(fp);
+    free(entries);
+    return 0;
+}
+
+static int meter_write_controlbus(unsigned char value)
+{
+    meter.sample.transfers++;
+    return meter.inner->write_controlbus(value);
+}
+
+static int meter_write_iobus(unsigned char value)
+{
+    meter.sample.transfers++;
+    return meter.inner->write_iobus(value);
+}
+
+static int meter_set_iobus_direction(iobus_inout_t inout)
+{
+    meter.sample.transfers++;
+    return meter.inner->set_iobus_direction(inout);
+}
+
+static unsigned char meter_read_controlbus(void)
+{
+    meter.sample.transfers++;
+    return meter.inner->read_controlbus();
+}
+
+static unsigned char meter_read_iobus(void)
+{
+    meter.sample.transfers++;
+    return meter.inner->read_iobus();
+}
+
+static void meter_delay_us(unsigned int usec)
+{
+    meter.sample.delays++;
+    meter.sample.delay_ns += (uint64_t)usec * 1000;
+    meter.inner->delay_us(usec);
+}
+
+static uint64_t meter_now_ns(void)
+{
+    return meter.inner->now_ns();
+}
+
+static const struct bus_backend meter_backend =
+{
+    "meter",
+    meter_write_controlbus,
+    meter_write_iobus,
+    meter_set_iobus_direction,
+    meter_read_controlbus,
+    meter_read_iobus,
+    meter_delay_us,
+    meter_now_ns
+};
+
+/* counts the transfers and waits of everything run until plan_meter_stop() */
+const struct bus_backend *plan_meter_start(const struct bus_backend *inner)
+{
+    memset(&meter, 0, sizeof(meter));
+    meter.inner = inner;
+    meter.start_ns = inner->now_ns();
+    return &meter_backend;
+}
+
+void plan_meter_stop(struct plan_sample *sample)
+{
+    meter.sample.elapsed_ns = meter.inner->now_ns() - meter.start_ns;
+    *sample = meter.sample;
+}
+
+/* Times ID reads and page reads on the current bus and fits transfer_ns and
+ * delay_factor: the two kinds have different ratios of transfers to waits */
+int plan_calibrate(struct plan_model *model, unsigned int nPageId)
+{
+    const struct bus_backend *inner = bus;
+    struct plan_sample id, page;
+    unsigned char ID_register[5];
+    unsigned char *data = malloc(nand_page_size_total());
+    double det, a, b;
+
+    if( data == NULL )
+    {
+        fprintf(stderr, "Failed to allocate page buffer.\n");
+        return EXIT_FAILURE;
+    }
+
+    bus = plan_meter_start(inner);
+    for(unsigned int k = 0; k < PLAN_CALIBRATION_ID_READS; k++)
+        read_ID_register(ID_register);
+    plan_meter_stop(&id);
+
+    bus = plan_meter_start(inner);
+    for(unsigned int k = 0; k < PLAN_CALIBRATION_PAGE_READS; k++)
+        read_page(nPageId, data);
+    plan_meter_stop(&page);
+
+    bus = inner;
+    free(data);
+
+    /* elapsed = a * transfers + b * requested wait time, solved for both samples */
+    det = (double)id.transfers * (double)page.delay_ns - (double)page.transfers * (double)id.delay_ns;
+    a = b = -1.0;
+    if( fabs(det) > 0.0 )
+    {
+        a = ((double)id.elapsed_ns * (double)page.delay_ns - (double)page.elapsed_ns * (double)id.delay_ns) / det;
+        b = ((double)id.transfers * (double)page.elapsed_ns - (double)page.transfers * (double)id.elapsed_ns) / det;
+    }
+    if( a <= 0.0 || b < 0.0 )
+    {
+        /* waits are hidden in the transfer time (e.g. behind frame waits) */
+        b = 0.0;
+        a = (double)(id.elapsed_ns + page.elapsed_ns) / (double)(id.transfers + page.transfers);
+    }
+
+    model->transfer_ns = a;
+    model->delay_factor = b;
+    return 0;
+}
+
+static void cost_command(struct plan_cost *cost)
+{
+    cost->transfers += 5; /* CLE, nWE low, I/O, nWE high, CLE */
+}
+
+static void cost_address(struct plan_cost *cost, unsigned int cycles)
+{
+    cost->transfers += 2 + 3 * cycles; /* ALE, (nWE low, I/O, nWE high) per cycle, ALE */
+    cost->delays += 3 * cycles;
+}
+
+static void cost_data_out(struct plan_cost *cost, unsigned int bytes)
+{
+    cost->transfers += 2 + 3 * bytes; /* direction, (nRE low, read, nRE high) per byte, direction */
+    cost->delays += 2 * bytes;
+}
+
+/* the busy line is polled at the transfer rate, at least once */
+static void cost_busy(struct plan_cost *cost, const struct plan_model *model, double busy_ns)
+{
+    double polls = ceil(busy_ns / model->transfer_ns);
+
+    cost->transfers += polls < 1.0 ? 1.0 : polls;
+}
+
+static double cost_ns(const struct plan_model *model, const struct plan_cost *cost)
+{
+    return cost->transfers * model->transfer_ns +
+        cost->delays * REALWORLD_DELAY * 1000.0 * model->delay_factor;
+}
+
+/* time of one page; erased selects the short path of skip_erased */
+static double page_ns(const struct plan_model *model, const struct plan_job *job, int erased)
+{
+    struct plan_cost cost = { 0, 0 };
+    double data_ns;
+
+    if( job->skip_erased )
+    {
+        /* spare area first (00h, 5 address cycles, 30h), then the data of a
+         * programmed page via random data output (05h, 2 cycles, E0h);
+         * random data output does not combine with cache read */
+        cost_command(&cost);
+        cost_address(&cost, 5);
+        cost_command(&cost);
+        cost_busy(&cost, model, model->tR_ns);
+        cost_data_out(&cost, nand_geometry.spare_size);
+        if( !erased )
+        {
+            cost_command(&cost);
+            cost_address(&cost, 2);
+            cost_command(&cost);
+            cost_data_out(&cost, nand_geometry.page_size);
+        }
+    }
+    else if( job->cache_read )
+    {
+        /* 31h only; the array read of the next page runs while this one is shifted out */
+        struct plan_cost data = { 0, 0 };
+
+        cost_data_out(&data, nand_page_size_total());
+        data_ns = cost_ns(model, &data);
+
+        cost_command(&cost);
+        cost_busy(&cost, model, model->tR_ns > data_ns ? model->tR_ns - data_ns : PLAN_CACHE_BUSY_NS);
+        cost.transfers += data.transfers;
+        cost.delays += data.delays;
+    }
+    else
+    {
+        cost_command(&cost);
+        cost_address(&cost, 5);
+        cost_command(&cost);
+        cost_busy(&cost, model, model->tR_ns);
+        cost_data_out(&cost, nand_page_size_total());
+    }
+
+    return cost_ns(model, &cost) * (job->verify ? 2.0 : 1.0);
+}
+
+/* estimated job time in seconds */
+double plan_estimate(const struct plan_model *model, const struct plan_job *job)
+{
+    double erased = job->skip_erased ? job->erased_fraction : 0.0;
+    double ns;
+
+    ns = (double)job->pages * ((1.0 - erased) * page_ns(model, job, 0) + erased * page_ns(model, job, 1));
+    return ns / 1e9;
+}
+
+static void format_duration(char *buf, size_t size, double seconds)
+{
+    unsigned long long s = (unsigned long long)(seconds + 0.5);
+
+    if( seconds < 60.0 )
+        snprintf(buf, size, "%.1f s", seconds);
+    else if( s < 3600 )
+        snprintf(buf, size, "%llum %02llus", s / 60, s % 60);
+    else
+        snprintf(buf, size, "%lluh %02llum %02llus", s / 3600, s / 60 % 60, s % 60);
+}
+
+void plan_print(FILE *fp, const struct plan_model *model, const struct plan_job *job)
+{
+    static const char *const option_names[] = { "cache-read", "erased-skip", "verify" };
+    double base = plan_estimate(model, job), best = base;
+    double bytes = (double)job->pages * nand_page_size_total();
+    int best_option = -1, best_enabled = 0;
+    char duration[32];
+
+    fprintf(fp, "plan: pages %u..%u (%u pages, %.2f MB) on %s%s%s%s\n", job->first_page,
+        job->first_page + job->pages - 1, job->pages, bytes / 1e6, model->backend,
+        job->cache_read ? ", cache read" : "", job->skip_erased ? ", erased-skip" : "",
+        job->verify ? ", verify" : "");
+    fprintf(fp, "model: %.3f us/transfer, delay factor %.2f, tR %.0f us (%u measured runs)\n",
+        model->transfer_ns / 1000.0, model->delay_factor, model->tR_ns / 1000.0, model->runs);
+    format_duration(duration, sizeof(duration), base);
+    fprintf(fp, "estimate: %s (%.6f MB/s)\n", duration, base > 0.0 ? bytes / base / 1e6 : 0.0);
+
+    fprintf(fp, "%-14s %14s %9s\n", "option", "time", "change");
+    for(int k = 0; k < 3; k++)
+    {
+        struct plan_job alternative = *job;
+        int enabled = k == 0 ? job->cache_read : k == 1 ? job->skip_erased : job->verify;
+        char name[32];
+        double estimate;
+
+        switch( k )
+        {
+            case 0: alternative.cache_read = !job->cache_read; break;
+            case 1: alternative.skip_erased = !job->skip_erased; break;
+            default: alternative.verify = !job->verify; break;
+        }
+        estimate = plan_estimate(model, &alternative);
+        format_duration(duration, sizeof(duration), estimate);
+        snprintf(name, sizeof(name), "%s%s", enabled ? "no " : "", option_names[k]);
+        fprintf(fp, "%-14s %14s %+8.1f%%", name, duration, base > 0.0 ? (estimate / base - 1.0) * 100.0 : 0.0);
+
+        if( k == 1 && alternative.skip_erased )
+        {
+            /* erased-skip pays a spare read on programmed pages and saves the data of erased ones */
+            struct plan_job none = alternative, all = alternative;
+            double t0, t1, plain = plan_estimate(model, job);
+
+            none.erased_fraction = 0.0;
+            all.erased_fraction = 1.0;
+            t0 = plan_estimate(model, &none);
+            t1 = plan_estimate(model, &all);
+            fprintf(fp, "  (at %.0f%% erased", alternative.erased_fraction * 100.0);
+            if( t0 > plain && t1 < plain )
+                fprintf(fp, ", breaks even at %.1f%%", (t0 - plain) / (t0 - t1) * 100.0);
+            fprintf(fp, ")");
+        }
+        fprintf(fp, "\n");
+
+        if( estimate < best )
+        {
+            best = estimate;
+            best_option = k;
+            best_enabled = enabled;
+        }
+    }
+
+    if( best_option < 0 )
+        fprintf(fp, "no option change would save time\n");
+    else
+    {
+        format_duration(duration, sizeof(duration), base - best);
+        fprintf(fp, "most time saved: %s %s (%s)%s\n",
+            best_enabled ? "dropping" : "adding", option_names[best_option], duration,
+            best_option < 2 && !best_enabled ? ", not yet supported by the reader" : "");
+    }
+}
+
+/* Compares a measured plain run with its estimate and moves transfer_ns
+ * towards the measured value; early runs weigh more than later ones */
+void plan_refine(struct plan_model *model, const struct plan_sample *sample, double estimate_s)
+{
+    double measured_s = (double)sample->elapsed_ns / 1e9;
+    double weight = 1.0 / (model->runs + 2);
+    double transfer_ns;
+
+    if( sample->transfers == 0 )
+        return;
+
+    printf("measured %.3f s, estimated %.3f s (%+.1f%%)\n", measured_s, estimate_s,
+        measured_s > 0.0 ? (estimate_s / measured_s - 1.0) * 100.0 : 0.0);
+
+    transfer_ns = ((double)sample->elapsed_ns - (double)sample->delay_ns * model->delay_factor) /
+        (double)sample->transfers;
+    if( transfer_ns <= 0.0 )
+        return;
+    if( weight < PLAN_MIN_REFINE_WEIGHT )
+        weight = PLAN_MIN_REFINE_WEIGHT;
+    model->transfer_ns += weight * (transfer_ns - model->transfer_ns);
+    model->runs++;
+}
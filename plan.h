@@ -0,0 +1,74 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file plan.h
+ * \brief Dump runtime estimation and job planning
+ * The time of a job is modelled as
+ *   transfers * transfer_ns + delays * delay_factor + chip busy time,
+ * where the number of USB transfers and REALWORLD_DELAY waits follows from the
+ * bus sequences in nand.c and the two coefficients are calibrated per backend:
+ * a few ID and page reads are timed through a metering backend and fitted.
+ * After a run the measured time refines the stored model.
+ */
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+#include "nand.h"
+
+struct plan_model
+{
+    char backend[32];
+    double transfer_ns;  /* average time of one USB transfer, incl. frame waits */
+    double delay_factor; /* actual / requested time of a REALWORLD_DELAY wait */
+    double tR_ns;        /* page read busy time */
+    unsigned int runs;   /* measured runs the model has been refined with */
+};
+
+struct plan_job
+{
+    unsigned int first_page;
+    unsigned int pages;
+    int cache_read;         /* sequential cache read (31h / 3Fh) */
+    int skip_erased;        /* read the spare area first, skip the data of erased pages */
+    int verify;             /* read every page twice and compare */
+    double erased_fraction; /* expected share of erased pages (for skip_erased) */
+};
+
+/* transfers, waits and time counted by the metering backend */
+struct plan_sample
+{
+    uint64_t transfers;
+    uint64_t delays;     /* number of REALWORLD_DELAY waits */
+    uint64_t delay_ns;   /* requested wait time */
+    uint64_t elapsed_ns;
+};
+
+void plan_default_model(struct plan_model *model, const char *backend);
+int plan_load_model(const char *path, const char *backend, struct plan_model *model);
+int plan_save_model(const char *path, const struct plan_model *model);
+
+const struct bus_backend *plan_meter_start(const struct bus_backend *inner);
+void plan_meter_stop(struct plan_sample *sample);
+
+int plan_calibrate(struct plan_model *model, unsigned int nPageId);
+double plan_estimate(const struct plan_model *model, const struct plan_job *job);
+void plan_print(FILE *fp, const struct plan_model *model, const struct plan_job *job);
+void plan_refine(struct plan_model *model, const struct plan_sample *sample, double estimate_s);
+
+#endif /* PLAN_H */
@@ -0,0 +1,154 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file plan_tool.c
+ * \brief Job planning against the simulated reader (see plan.h)
+ * Plans a dump for one of the simulated USB profiles without hardware;
+ * with -r the dump is run on the simulated reader as well and the measured
+ * time is compared with the estimate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nand.h"
+#include "nand_sim.h"
+#include "plan.h"
+#include "profile.h"
+
+static const unsigned char default_ID_register[5] = { 0xAD, 0xDC, 0x10, 0x95, 0x54 };
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p profile] [-f first] [-n pages] [-C] [-S] [-V] [-E percent] [-m model] [-c profiles] [-r]\n"
+        "  -p NAME    simulated USB profile (default ft2232h-hs)\n"
+        "  -f PAGE    first page (default 0)\n"
+        "  -n PAGES   number of pages (default: up to the end of the chip)\n"
+        "  -C, -S, -V plan with cache read, erased-page skipping, verify\n"
+        "  -E PERCENT expected share of erased pages for -S\n"
+        "  -m FILE    cost model store: used instead of a calibration, refined by -r\n"
+        "  -c FILE    chip profile cache: cached model and geometry instead of a calibration\n"
+        "  -r         run the dump on the simulated reader and compare\n",
+        name);
+}
+
+int main(int argc, char **argv)
+{
+    const struct sim_usb_profile *profile = &sim_usb_profiles[0];
+    const char *model_path = NULL, *profile_path = NULL;
+    struct chip_profile chip;
+    struct plan_job job = { 0, 0, 0, 0, 0, 0.0 };
+    struct plan_model model;
+    int opt, run = 0;
+
+    while( (opt = getopt(argc, argv, "p:f:n:CSVE:m:c:rh")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'p':
+                profile = sim_find_profile(optarg);
+                if( profile == NULL )
+                {
+                    fprintf(stderr, "unknown profile %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f': job.first_page = strtoul(optarg, NULL, 0); break;
+            case 'n': job.pages = strtoul(optarg, NULL, 0); break;
+            case 'C': job.cache_read = 1; break;
+            case 'S': job.skip_erased = 1; break;
+            case 'V': job.verify = 1; break;
+            case 'E': job.erased_fraction = atof(optarg) / 100.0; break;
+            case 'm': model_path = optarg; break;
+            case 'c': profile_path = optarg; break;
+            case 'r': run = 1; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    verbose = 0;
+    sim_timing_report_max = 0;
+    bus = &sim_backend;
+    if( sim_init(profile, &sim_default_timing, &nand_geometry, default_ID_register) != 0 )
+        return EXIT_FAILURE;
+    controlbus_reset_value();
+    iobus_reset_value();
+    iobus_set_direction(IOBUS_OUT);
+    nand_select_chip();
+
+    if( profile_path )
+    {
+        if( profile_find(profile_path, default_ID_register, &chip) == 0 )
+            nand_geometry = chip.geometry;
+        else
+        {
+            if( profile_identify(&chip, default_ID_register) != 0 )
+            {
+                sim_free();
+                return EXIT_FAILURE;
+            }
+        }
+        profile_print(stdout, &chip);
+    }
+
+    if( job.first_page >= nand_pages_total() )
+    {
+        fprintf(stderr, "first page beyond the end of the chip\n");
+        sim_free();
+        return EXIT_FAILURE;
+    }
+    if( job.pages == 0 || job.pages > nand_pages_total() - job.first_page )
+        job.pages = nand_pages_total() - job.first_page;
+
+    plan_default_model(&model, profile->name);
+    if( profile_path && chip.has_model && strcmp(chip.model.backend, profile->name) == 0 )
+        model = chip.model;
+    else if( model_path == NULL || plan_load_model(model_path, profile->name, &model) != 0 )
+        plan_calibrate(&model, job.first_page);
+    plan_print(stdout, &model, &job);
+
+    if( run )
+    {
+        struct plan_job plain = job;
+        struct plan_sample sample;
+        FILE *fp = fopen("/dev/null", "w");
+
+        if( fp == NULL )
+        {
+            sim_free();
+            return EXIT_FAILURE;
+        }
+        plain.cache_read = plain.skip_erased = plain.verify = 0;
+
+        bus = plan_meter_start(&sim_backend);
+        dump_memory_range(fp, job.first_page, job.pages);
+        plan_meter_stop(&sample);
+        bus = &sim_backend;
+        fclose(fp);
+
+        plan_refine(&model, &sample, plan_estimate(&model, &plain));
+        if( model_path )
+            plan_save_model(model_path, &model);
+    }
+
+    if( profile_path )
+        profile_store(profile_path, &chip, &model);
+
+    sim_free();
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file pool.c
+ * \brief Work-stealing thread pool (see pool.h)
+ * The pool counts queued tasks as tickets: a worker sleeps until it can take a
+ * ticket and then searches the deques until it finds the task the ticket
+ * stands for. Owners take the oldest task of their deque so work leaves the
+ * pool roughly in submission order; thieves take the newest one from the
+ * other end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "rt.h"
+#include "pool.h"
+
+struct pool_deque
+{
+    pthread_mutex_t lock;
+    struct pool_task **tasks; /* ring of capacity entries */
+    unsigned int capacity, head, count;
+    uint64_t executed, stolen;
+};
+
+struct pool_worker
+{
+    struct pool *pool;
+    pthread_t thread;
+    unsigned int index;
+    struct pool_deque deque;
+};
+
+struct pool
+{
+    unsigned int workers_count;
+    struct pool_worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    unsigned int tickets; /* queued tasks not yet claimed by a worker */
+    unsigned int next;    /* deque for the next submission */
+    int stopping;
+};
+
+/* the owner takes the oldest task, a thief the newest one */
+static struct pool_task *pool_deque_take(struct pool_deque *deque, int steal)
+{
+    struct pool_task *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if( deque->count > 0 )
+    {
+        if( steal )
+        {
+            task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+            deque->stolen++;
+        }
+        else
+        {
+            task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        }
+        deque->count--;
+        deque->executed++;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static void *pool_worker_thread(void *arg)
+{
+    struct pool_worker *worker = arg;
+    struct pool *pool = worker->pool;
+    struct pool_task *task;
+
+    rt_apply_role(RT_ROLE_WORKER, worker->index);
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while( pool->tickets == 0 && !pool->stopping )
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if( pool->tickets == 0 )
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pool->tickets--;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* the ticket guarantees a task that no other worker will take */
+        task = pool_deque_take(&worker->deque, 0);
+        for(unsigned int k = 1; task == NULL; k++)
+            task = pool_deque_take(&pool->workers[(worker->index + k) % pool->workers_count].deque, 1);
+        task->run(task);
+    }
+}
+
+/* one worker per online core */
+unsigned int pool_default_workers(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cores > 0 ? (unsigned int)cores : 1;
+}
+
+/* starts the workers (0: one per online core); every deque can hold max_tasks,
+ * so a submission never has to wait as long as at most max_tasks are queued */
+struct pool *pool_create(unsigned int workers, unsigned int max_tasks)
+{
+    struct pool *pool = calloc(1, sizeof(*pool));
+
+    if( pool == NULL )
+        return NULL;
+    if( workers == 0 )
+        workers = pool_default_workers();
+
+    pool->workers = calloc(workers, sizeof(*pool->workers));
+    if( pool->workers == NULL )
+    {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+
+    for(unsigned int k = 0; k < workers; k++)
+    {
+        struct pool_worker *worker = &pool->workers[k];
+
+        worker->pool = pool;
+        worker->index = k;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->deque.capacity = max_tasks;
+        worker->deque.tasks = malloc(max_tasks * sizeof(*worker->deque.tasks));
+        if( worker->deque.tasks == NULL
+            || pthread_create(&worker->thread, NULL, pool_worker_thread, worker) != 0 )
+        {
+            fprintf(stderr, "unable to start worker %u of the thread pool\n", k);
+            free(worker->deque.tasks);
+            pool->workers_count = k;
+            pool_destroy(pool);
+            return NULL;
+        }
+        pool->workers_count = k + 1;
+    }
+    return pool;
+}
+
+/* queues the task on the next deque that has room; returns EXIT_FAILURE if
+ * more than max_tasks tasks are queued */
+int pool_submit(struct pool *pool, struct pool_task *task)
+{
+    for(unsigned int k = 0; k < pool->workers_count; k++)
+    {
+        struct pool_deque *deque = &pool->workers[pool->next].deque;
+        int queued = 0;
+
+        pool->next = (pool->next + 1) % pool->workers_count;
+        pthread_mutex_lock(&deque->lock);
+        if( deque->count < deque->capacity )
+        {
+            deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+            deque->count++;
+            queued = 1;
+        }
+        pthread_mutex_unlock(&deque->lock);
+
+        if( queued )
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->tickets++;
+            pthread_cond_signal(&pool->work);
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+void pool_get_stats(struct pool *pool, struct pool_stats *stats)
+{
+    stats->workers = pool->workers_count;
+    stats->executed = 0;
+    stats->stolen = 0;
+    for(unsigned int k = 0; k < pool->workers_count; k++)
+    {
+        struct pool_deque *deque = &pool->workers[k].deque;
+
+        pthread_mutex_lock(&deque->lock);
+        stats->executed += deque->executed;
+        stats->stolen += deque->stolen;
+        pthread_mutex_unlock(&deque->lock);
+    }
+}
+
+/* runs the queued tasks to completion and stops the workers */
+void pool_destroy(struct pool *pool)
+{
+    if( pool == NULL )
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(unsigned int k = 0; k < pool->workers_count; k++)
+    {
+        pthread_join(pool->workers[k].thread, NULL);
+        free(pool->workers[k].deque.tasks);
+    }
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file pool.h
+ * \brief Work-stealing thread pool
+ * Every worker owns a deque of tasks. Submitted tasks are spread over the
+ * deques; a worker takes tasks from its own deque and steals from the others
+ * when it runs dry, so uneven tasks still keep all cores busy. Submitting
+ * never waits for a worker.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+/* embed as the first member of the caller's work item */
+struct pool_task
+{
+    void (*run)(struct pool_task *task);
+};
+
+struct pool_stats
+{
+    unsigned int workers;
+    uint64_t executed;
+    uint64_t stolen; /* tasks run by another worker than the one they were queued on */
+};
+
+struct pool;
+
+unsigned int pool_default_workers(void);
+struct pool *pool_create(unsigned int workers, unsigned int max_tasks);
+int pool_submit(struct pool *pool, struct pool_task *task);
+void pool_get_stats(struct pool *pool, struct pool_stats *stats);
+void pool_destroy(struct pool *pool);
+
+#endif /* POOL_H */
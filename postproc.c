@@ -0,0 +1,705 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file postproc.c
+ * \brief Post-processing of dumped pages on a worker pool (see postproc.h)
+ * Batch n lives in slot n % slots. A slot is refilled only after its batch
+ * went to the sinks, so the slots form the reorder buffer and bound the
+ * memory in flight. Whichever worker completes the oldest outstanding batch
+ * becomes the writer and drains all consecutive completed batches; the
+ * others just mark theirs done.
+ * The stages are fused per page: CRC-32, erased check and byte histogram share
+ * one loop over the bytes, and the ECC check and the compressor take the page
+ * right after it, so a page comes from memory once whatever is enabled. The
+ * delta encoder is the last of them; batches are encoded on their own, so a
+ * run of unchanged pages is cut at every batch boundary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "nand.h"
+#include "pool.h"
+#include "arena.h"
+#include "output.h"
+#include "writer.h"
+#include "delta.h"
+#include "postproc.h"
+
+enum { SLOT_FREE = 0, SLOT_QUEUED, SLOT_DONE, SLOT_WRITING };
+
+int postproc_stages = POSTPROC_HASH;
+
+static const struct
+{
+    const char *name;
+    int stage;
+} postproc_stage_names[] =
+{
+    { "hash",     POSTPROC_HASH },
+    { "ecc",      POSTPROC_ECC },
+    { "entropy",  POSTPROC_ENTROPY },
+    { "compress", POSTPROC_COMPRESS },
+};
+
+struct postproc_batch
+{
+    struct pool_task task; /* first member: the pool hands it back to us */
+    struct postproc *pp;
+    int state;
+    unsigned int first_page, pages;
+    uint64_t offset;       /* in the image */
+    unsigned char *buffer; /* arena buffer of the slot */
+    unsigned char *data;   /* the buffer, or the batch's place in a mapped image */
+    uint32_t crc[POSTPROC_BATCH_PAGES];
+    unsigned char erased[POSTPROC_BATCH_PAGES];
+    signed char ecc[POSTPROC_BATCH_PAGES];  /* corrected bitflips, -1: uncorrectable */
+    float entropy[POSTPROC_BATCH_PAGES];    /* bits per byte */
+    z_stream zs;                            /* POSTPROC_COMPRESS: one gzip member per batch */
+    unsigned char *packed;
+    size_t packed_size, packed_length;
+    struct delta_encoder delta;             /* POSTPROC_DELTA */
+    unsigned char *delta_out;
+};
+
+struct postproc
+{
+    struct pool *pool;
+    struct dump_output *image;
+    struct dump_writer *writer; /* asynchronous image writes, NULL: synchronous */
+    struct postproc_batch *piped; /* last batch spliced into an image pipe */
+    FILE *digest;
+    FILE *packed;       /* compressed image */
+    FILE *delta;        /* delta against the base */
+    const struct delta_base *base;
+    int stages;
+    unsigned int page_size;
+    unsigned int slots;
+    struct postproc_batch *batches;
+    struct page_arena *arena; /* page data of the batches */
+    uint64_t fill_seq;  /* next batch the bus thread fills */
+    uint64_t write_seq; /* next batch for the sinks */
+    uint64_t fill_offset; /* image offset of the next batch */
+    int writing;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+    struct postproc_stats stats;
+};
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+    for(uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t c = n;
+
+        for(unsigned int bit = 0; bit < 8; bit++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc32_table[n] = c;
+    }
+}
+
+/* CRC-32 as used by zlib and most hashing tools */
+uint32_t postproc_crc32(const unsigned char *data, unsigned int length)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+
+    pthread_once(&crc32_once, crc32_init);
+    for(unsigned int k = 0; k < length; k++)
+        crc = crc32_table[(crc ^ data[k]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/* comma separated stage names; -1 for an unknown name */
+int postproc_parse_stages(const char *list)
+{
+    int stages = 0;
+
+    while( *list )
+    {
+        size_t length = strcspn(list, ",");
+        unsigned int k;
+
+        for(k = 0; k < sizeof(postproc_stage_names) / sizeof(postproc_stage_names[0]); k++)
+            if( strlen(postproc_stage_names[k].name) == length
+                && strncmp(list, postproc_stage_names[k].name, length) == 0 )
+                break;
+        if( k == sizeof(postproc_stage_names) / sizeof(postproc_stage_names[0]) )
+        {
+            fprintf(stderr, "unknown post-processing stage '%.*s'\n", (int)length, list);
+            return -1;
+        }
+        stages |= postproc_stage_names[k].stage;
+        list += length;
+        if( *list == ',' )
+            list++;
+    }
+    return stages;
+}
+
+/* checks the data of a page against the Hamming ECC in the last bytes of its
+ * spare area (Linux large page layout and byte order, see nand_ecc_hamming());
+ * bitflips that the ECC would correct, -1 if a step is uncorrectable */
+static int postproc_ecc_check(const unsigned char *page)
+{
+    unsigned int steps = nand_geometry.page_size / NAND_ECC_STEP;
+    const unsigned char *stored = page + nand_geometry.page_size + nand_geometry.spare_size - 3 * steps;
+    int corrected = 0;
+
+    if( 3 * steps > nand_geometry.spare_size )
+        return 0;
+    for(unsigned int k = 0; k < steps; k++)
+    {
+        unsigned char code[3], d0, d1, d2;
+
+        nand_ecc_hamming(page + k * NAND_ECC_STEP, code);
+        d0 = code[0] ^ stored[3 * k];
+        d1 = code[1] ^ stored[3 * k + 1];
+        d2 = code[2] ^ stored[3 * k + 2];
+        if( (d0 | d1 | d2) == 0 )
+            continue;
+        /* a single data bitflip flips exactly one bit of every parity pair */
+        if( ((d0 ^ (d0 >> 1)) & 0x55) == 0x55 && ((d1 ^ (d1 >> 1)) & 0x55) == 0x55
+            && ((d2 ^ (d2 >> 1)) & 0x54) == 0x54 )
+            corrected++;
+        else if( __builtin_popcount(d0) + __builtin_popcount(d1) + __builtin_popcount(d2) == 1 )
+            corrected++; /* the flip is in the ECC itself */
+        else
+            return -1;
+    }
+    return corrected;
+}
+
+/* Shannon entropy of the byte distribution, in bits per byte */
+static float postproc_entropy(const unsigned int histogram[256], unsigned int length)
+{
+    double sum = 0;
+
+    for(unsigned int k = 0; k < 256; k++)
+        if( histogram[k] )
+            sum += histogram[k] * log2(histogram[k]);
+    return (float)(log2(length) - sum / length);
+}
+
+/* all enabled stages on one page, while it is in the cache */
+static void postproc_page(struct postproc *pp, struct postproc_batch *batch, unsigned int k)
+{
+    const unsigned char *page = batch->data + (size_t)k * pp->page_size;
+    unsigned int histogram[256];
+    uint32_t crc = 0xFFFFFFFFu;
+    unsigned char all = 0xFF;
+
+    if( pp->stages & POSTPROC_ENTROPY )
+    {
+        memset(histogram, 0, sizeof(histogram));
+        for(unsigned int n = 0; n < pp->page_size; n++)
+        {
+            crc = crc32_table[(crc ^ page[n]) & 0xFF] ^ (crc >> 8);
+            all &= page[n];
+            histogram[page[n]]++;
+        }
+        batch->entropy[k] = postproc_entropy(histogram, pp->page_size);
+    }
+    else
+    {
+        for(unsigned int n = 0; n < pp->page_size; n++)
+        {
+            crc = crc32_table[(crc ^ page[n]) & 0xFF] ^ (crc >> 8);
+            all &= page[n];
+        }
+    }
+    batch->crc[k] = crc ^ 0xFFFFFFFFu;
+    batch->erased[k] = all == 0xFF;
+
+    if( pp->stages & POSTPROC_ECC )
+        batch->ecc[k] = batch->erased[k] ? 0 : postproc_ecc_check(page);
+
+    if( pp->stages & POSTPROC_COMPRESS )
+    {
+        batch->zs.next_in = (unsigned char *)page;
+        batch->zs.avail_in = pp->page_size;
+        deflate(&batch->zs, k + 1 == batch->pages ? Z_FINISH : Z_NO_FLUSH);
+    }
+
+    if( pp->stages & POSTPROC_DELTA )
+        delta_encode_page(&batch->delta, batch->offset / pp->page_size + k, page, batch->erased[k]);
+}
+
+static uint64_t postproc_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* the asynchronous writer is done with the batch */
+static void postproc_written(void *context, int result)
+{
+    struct postproc_batch *batch = context;
+    struct postproc *pp = batch->pp;
+
+    pthread_mutex_lock(&pp->lock);
+    if( result != 0 )
+        pp->failed = 1;
+    batch->state = SLOT_FREE;
+    pthread_cond_broadcast(&pp->slot_free);
+    pthread_mutex_unlock(&pp->lock);
+}
+
+/* sinks of one batch; called by one worker at a time, in page order.
+ * *pending is set if the image write completes later (postproc_written()) */
+static int postproc_write(struct postproc *pp, struct postproc_batch *batch, int *pending)
+{
+    size_t length = (size_t)batch->pages * pp->page_size;
+
+    *pending = 0;
+    if( pp->writer )
+    {
+        if( writer_submit(pp->writer, batch->data, length, postproc_written, batch) != 0 )
+            return EXIT_FAILURE;
+        *pending = 1;
+    }
+    else if( pp->image && output_write_at(pp->image, batch->offset, batch->data, length) != 0 )
+    {
+        fprintf(stderr, "Failed to write pages %u..%u to the dump file.\n",
+            batch->first_page, batch->first_page + batch->pages - 1);
+        return EXIT_FAILURE;
+    }
+    if( pp->packed && fwrite(batch->packed, 1, batch->packed_length, pp->packed) != batch->packed_length )
+    {
+        fprintf(stderr, "Failed to write the compressed image.\n");
+        return EXIT_FAILURE;
+    }
+    if( pp->delta && fwrite(batch->delta.out, 1, batch->delta.length, pp->delta) != batch->delta.length )
+    {
+        fprintf(stderr, "Failed to write the delta image.\n");
+        return EXIT_FAILURE;
+    }
+    for(unsigned int k = 0; pp->digest && k < batch->pages; k++)
+    {
+        fprintf(pp->digest, "%u %08x %u", batch->first_page + k, batch->crc[k], batch->erased[k]);
+        if( pp->stages & POSTPROC_ECC )
+            fprintf(pp->digest, " %d", batch->ecc[k]);
+        if( pp->stages & POSTPROC_ENTROPY )
+            fprintf(pp->digest, " %.3f", batch->entropy[k]);
+        fputc('\n', pp->digest);
+    }
+    return 0;
+}
+
+static void postproc_run(struct pool_task *task)
+{
+    struct postproc_batch *batch = (struct postproc_batch *)task;
+    struct postproc *pp = batch->pp;
+    unsigned int erased = 0, ecc_corrected = 0, ecc_failed = 0;
+
+    if( pp->stages & POSTPROC_COMPRESS )
+    {
+        deflateReset(&batch->zs);
+        batch->zs.next_out = batch->packed;
+        batch->zs.avail_out = batch->packed_size;
+    }
+    if( pp->stages & POSTPROC_DELTA )
+    {
+        delta_encoder_reset(&batch->delta, pp->base, batch->delta_out);
+        memset(&batch->delta.stats, 0, sizeof(batch->delta.stats));
+    }
+    for(unsigned int k = 0; k < batch->pages; k++)
+    {
+        postproc_page(pp, batch, k);
+        erased += batch->erased[k];
+        if( (pp->stages & POSTPROC_ECC) && batch->ecc[k] < 0 )
+            ecc_failed++;
+        else if( pp->stages & POSTPROC_ECC )
+            ecc_corrected += batch->ecc[k];
+    }
+    batch->packed_length = batch->packed_size - batch->zs.avail_out;
+
+    pthread_mutex_lock(&pp->lock);
+    batch->state = SLOT_DONE;
+    pp->stats.erased_pages += erased;
+    pp->stats.ecc_corrected += ecc_corrected;
+    pp->stats.ecc_failed += ecc_failed;
+    pp->stats.packed_bytes += batch->packed_length;
+    pp->stats.delta.copied += batch->delta.stats.copied;
+    pp->stats.delta.erased += batch->delta.stats.erased;
+    pp->stats.delta.patched += batch->delta.stats.patched;
+    pp->stats.delta.literal += batch->delta.stats.literal;
+    pp->stats.delta.patch_bytes += batch->delta.stats.patch_bytes;
+    pp->stats.delta.bytes += batch->delta.length;
+    if( pp->writing )
+    {
+        pthread_mutex_unlock(&pp->lock);
+        return;
+    }
+
+    /* drain the reorder buffer: every consecutive completed batch from the oldest on */
+    pp->writing = 1;
+    while( pp->write_seq < pp->fill_seq && pp->batches[pp->write_seq % pp->slots].state == SLOT_DONE )
+    {
+        struct postproc_batch *head = &pp->batches[pp->write_seq % pp->slots];
+        int failed = 0, pending = 0, skip = pp->failed;
+
+        /* before the write: its completion may come before we get the lock back */
+        head->state = SLOT_WRITING;
+        pthread_mutex_unlock(&pp->lock);
+        if( !skip )
+            failed = postproc_write(pp, head, &pending);
+        pthread_mutex_lock(&pp->lock);
+
+        if( failed )
+            pp->failed = 1;
+        /* a pipe holds the pages of the latest batch until the next write */
+        if( pp->piped )
+        {
+            pp->piped->state = SLOT_FREE;
+            pp->piped = NULL;
+        }
+        if( pp->image && pp->image->splice && !skip && !failed )
+            pp->piped = head;
+        else if( !pending )
+            head->state = SLOT_FREE;
+        pp->write_seq++;
+        pthread_cond_broadcast(&pp->slot_free);
+    }
+    pp->writing = 0;
+    pthread_mutex_unlock(&pp->lock);
+}
+
+static void postproc_free(struct postproc *pp)
+{
+    for(unsigned int k = 0; pp->batches && k < pp->slots; k++)
+        if( pp->batches[k].packed )
+        {
+            deflateEnd(&pp->batches[k].zs);
+            free(pp->batches[k].packed);
+        }
+    for(unsigned int k = 0; pp->batches && k < pp->slots; k++)
+        free(pp->batches[k].delta_out);
+    arena_destroy(pp->arena);
+    free(pp->batches);
+    free(pp);
+}
+
+/* workers: 0 for one per core; stages: POSTPROC_* besides the hash, which
+ * always runs; image, digest and packed (the compressed image) may be NULL */
+struct postproc *postproc_create(unsigned int workers, int stages, struct dump_output *image, FILE *digest,
+    FILE *packed)
+{
+    struct postproc *pp = calloc(1, sizeof(*pp));
+    int async, failed = 0;
+
+    if( pp == NULL )
+        return NULL;
+    pp->image = image;
+    pp->digest = digest;
+    pp->packed = packed;
+    pp->stages = (packed ? stages : stages & ~POSTPROC_COMPRESS) | POSTPROC_HASH;
+    pp->page_size = nand_page_size_total();
+    pthread_once(&crc32_once, crc32_init);
+    pthread_mutex_init(&pp->lock, NULL);
+    pthread_cond_init(&pp->slot_free, NULL);
+
+    if( workers == 0 )
+        workers = pool_default_workers();
+    pp->slots = workers * POSTPROC_SLOTS_PER_WORKER;
+    pp->batches = calloc(pp->slots, sizeof(*pp->batches));
+    pp->arena = arena_create((size_t)POSTPROC_BATCH_PAGES * pp->page_size, pp->slots, arena_flags);
+    for(unsigned int k = 0; pp->batches && (pp->stages & POSTPROC_COMPRESS) && !failed && k < pp->slots; k++)
+    {
+        struct postproc_batch *batch = &pp->batches[k];
+
+        /* gzip members can simply be concatenated: every batch is one */
+        if( deflateInit2(&batch->zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+            failed = 1;
+        else
+        {
+            batch->packed_size = deflateBound(&batch->zs, (uLong)POSTPROC_BATCH_PAGES * pp->page_size);
+            batch->packed = malloc(batch->packed_size);
+            if( batch->packed == NULL )
+            {
+                deflateEnd(&batch->zs);
+                failed = 1;
+            }
+        }
+    }
+    if( !failed )
+        pp->pool = pool_create(workers, pp->slots);
+    /* a mapped image is filled by the reads themselves, a pipe has no offsets */
+    async = image && (image->flags & OUTPUT_ASYNC) && image->map == NULL && !image->pipe;
+    if( pp->pool && pp->arena && async )
+        pp->writer = writer_create(image, pp->arena);
+    if( pp->pool == NULL || pp->batches == NULL || pp->arena == NULL || (async && pp->writer == NULL) )
+    {
+        if( pp->writer )
+            writer_finish(pp->writer, NULL);
+        pool_destroy(pp->pool);
+        postproc_free(pp);
+        return NULL;
+    }
+    for(unsigned int k = 0; k < pp->slots; k++)
+    {
+        pp->batches[k].task.run = postproc_run;
+        pp->batches[k].pp = pp;
+        pp->batches[k].buffer = arena_buffer(pp->arena, k);
+    }
+    return pp;
+}
+
+/* encodes the pages as a delta against base into delta as well (delta.h);
+ * before postproc_dump_range(). The caller writes the header and the end */
+int postproc_add_delta(struct postproc *pp, const struct delta_base *base, FILE *delta)
+{
+    for(unsigned int k = 0; k < pp->slots; k++)
+    {
+        pp->batches[k].delta_out = malloc(delta_bound(POSTPROC_BATCH_PAGES, pp->page_size));
+        if( pp->batches[k].delta_out == NULL )
+            return EXIT_FAILURE;
+    }
+    pp->base = base;
+    pp->delta = delta;
+    pp->stages |= POSTPROC_DELTA;
+    return 0;
+}
+
+/* the slot for the next batch, once the sinks are done with its previous
+ * content; NULL after a sink failed */
+static struct postproc_batch *postproc_acquire(struct postproc *pp)
+{
+    struct postproc_batch *batch = &pp->batches[pp->fill_seq % pp->slots];
+    uint64_t start;
+
+    pthread_mutex_lock(&pp->lock);
+    if( batch->state != SLOT_FREE )
+    {
+        pp->stats.stalls++;
+        start = postproc_now_ns();
+        while( batch->state != SLOT_FREE )
+            pthread_cond_wait(&pp->slot_free, &pp->lock);
+        pp->stats.stall_ns += postproc_now_ns() - start;
+    }
+    if( pp->failed )
+        batch = NULL;
+    pthread_mutex_unlock(&pp->lock);
+    return batch;
+}
+
+static int postproc_submit(struct postproc *pp, struct postproc_batch *batch)
+{
+    pthread_mutex_lock(&pp->lock);
+    batch->state = SLOT_QUEUED;
+    pp->fill_seq++;
+    pp->stats.batches++;
+    pp->stats.pages += batch->pages;
+    pthread_mutex_unlock(&pp->lock);
+    return pool_submit(pp->pool, &batch->task);
+}
+
+/* reads the pages on the calling (bus) thread and queues them batch by batch;
+ * an unreadable page is still passed on, so the dump keeps its layout */
+int postproc_dump_range(struct postproc *pp, unsigned int nFirstPageId, unsigned int nPages)
+{
+    unsigned int failed = 0;
+
+    for(unsigned int page = 0; page < nPages; )
+    {
+        struct postproc_batch *batch = postproc_acquire(pp);
+
+        if( batch == NULL )
+            return EXIT_FAILURE;
+
+        batch->first_page = nFirstPageId + page;
+        batch->pages = nPages - page < POSTPROC_BATCH_PAGES ? nPages - page : POSTPROC_BATCH_PAGES;
+        batch->offset = pp->fill_offset;
+        batch->data = NULL;
+        if( pp->image )
+            batch->data = output_window(pp->image, batch->offset, (size_t)batch->pages * pp->page_size);
+        if( batch->data == NULL )
+            batch->data = batch->buffer;
+        pp->fill_offset += (size_t)batch->pages * pp->page_size;
+        dbg_printf("Reading pages %u..%u / %u\n", batch->first_page,
+            batch->first_page + batch->pages - 1, nFirstPageId + nPages);
+        for(unsigned int k = 0; k < batch->pages; k++)
+            if( read_page(batch->first_page + k, batch->data + (size_t)k * pp->page_size) != 0 )
+                failed++;
+        page += batch->pages;
+
+        if( postproc_submit(pp, batch) != 0 )
+            return EXIT_FAILURE;
+    }
+
+    if( failed )
+    {
+        fprintf(stderr, "%u pages could not be read.\n", failed);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+/* waits for the queued batches to reach the sinks and releases the pipeline;
+ * returns EXIT_FAILURE if a sink failed */
+int postproc_finish(struct postproc *pp, struct postproc_stats *stats)
+{
+    struct pool_stats pool_stats;
+    int ret;
+
+    pthread_mutex_lock(&pp->lock);
+    while( pp->write_seq < pp->fill_seq )
+        pthread_cond_wait(&pp->slot_free, &pp->lock);
+    pthread_mutex_unlock(&pp->lock);
+
+    pool_get_stats(pp->pool, &pool_stats);
+    pool_destroy(pp->pool);
+    if( pp->writer && writer_finish(pp->writer, &pp->stats.writer) != 0 )
+        pp->failed = 1;
+
+    ret = pp->failed ? EXIT_FAILURE : 0;
+    if( stats )
+    {
+        *stats = pp->stats;
+        stats->stolen = pool_stats.stolen;
+    }
+    postproc_free(pp);
+    return ret;
+}
+
+/* dump_memory() through the worker pool: the image (output_path) in page order
+ * plus the page digests in digest_path and the gzip compressed image in
+ * packed_path (if given), with the stages in postproc_stages. With delta_path
+ * the dump is stored as a delta against the image in base_path instead of
+ * the image */
+int dump_memory_pipelined(unsigned int nFirstPageId, unsigned int nPages, unsigned int workers,
+    const char *digest_path, const char *packed_path, const char *base_path, const char *delta_path)
+{
+    struct dump_output *image = NULL;
+    struct delta_base *base = NULL;
+    FILE *digest = NULL, *packed = NULL, *delta = NULL;
+    struct postproc *pp = NULL;
+    struct postproc_stats stats;
+    int ret = 1;
+
+    if( delta_path && base_path == NULL )
+    {
+        fprintf(stderr, "a delta needs a base image\n");
+        return 1;
+    }
+    if( delta_path == NULL )
+    {
+        image = output_open(output_path, output_flags);
+        if( image == NULL )
+        {
+            printf("  Error when opening the file...\n");
+            return 1;
+        }
+        if( output_reserve(image, (uint64_t)nPages * nand_page_size_total()) != 0 )
+            goto done;
+    }
+    else
+    {
+        base = delta_base_open(base_path, nand_page_size_total());
+        if( base == NULL )
+            return 1;
+        if( (delta = fopen(delta_path, "wb")) == NULL )
+        {
+            fprintf(stderr, "unable to open %s\n", delta_path);
+            goto done;
+        }
+        if( delta_write_header(delta, base, nPages) != 0 )
+        {
+            fprintf(stderr, "Failed to write the delta image.\n");
+            goto done;
+        }
+    }
+    if( digest_path && (digest = fopen(digest_path, "w")) == NULL )
+    {
+        fprintf(stderr, "unable to open %s\n", digest_path);
+        goto done;
+    }
+    if( packed_path && (packed = fopen(packed_path, "wb")) == NULL )
+    {
+        fprintf(stderr, "unable to open %s\n", packed_path);
+        goto done;
+    }
+
+    pp = postproc_create(workers, postproc_stages | (packed ? POSTPROC_COMPRESS : 0), image, digest, packed);
+    if( pp == NULL || (delta && postproc_add_delta(pp, base, delta) != 0) )
+    {
+        fprintf(stderr, "unable to start the post-processing workers\n");
+        if( pp )
+            postproc_finish(pp, NULL);
+        goto done;
+    }
+
+    ret = postproc_dump_range(pp, nFirstPageId, nPages);
+    if( postproc_finish(pp, &stats) != 0 )
+        ret = 1;
+    printf("post-processing: %llu pages (%llu erased) in %llu batches, %llu stolen,"
+        " reader waited %llu times (%.3f s)\n",
+        (unsigned long long)stats.pages, (unsigned long long)stats.erased_pages,
+        (unsigned long long)stats.batches, (unsigned long long)stats.stolen,
+        (unsigned long long)stats.stalls, stats.stall_ns / 1e9);
+    if( postproc_stages & POSTPROC_ECC )
+        printf("ECC: %llu bitflips corrected, %llu pages uncorrectable\n",
+            (unsigned long long)stats.ecc_corrected, (unsigned long long)stats.ecc_failed);
+    if( packed )
+        printf("compressed image: %llu bytes (%.1f %%)\n", (unsigned long long)stats.packed_bytes,
+            stats.pages ? 100.0 * stats.packed_bytes / ((double)stats.pages * nand_page_size_total()) : 0.0);
+    if( delta )
+        printf("delta: %llu pages unchanged, %llu erased, %llu patched (%llu bytes), %llu literal;"
+            " %llu bytes (%.1f %%)\n",
+            (unsigned long long)stats.delta.copied, (unsigned long long)stats.delta.erased,
+            (unsigned long long)stats.delta.patched, (unsigned long long)stats.delta.patch_bytes,
+            (unsigned long long)stats.delta.literal, (unsigned long long)stats.delta.bytes,
+            stats.pages ? 100.0 * stats.delta.bytes / ((double)stats.pages * nand_page_size_total()) : 0.0);
+    if( image && image->pipe )
+        printf("image pipe: %llu of %llu bytes spliced\n",
+            (unsigned long long)image->spliced, (unsigned long long)image->written);
+    else if( image && (image->flags & OUTPUT_ASYNC) && image->map == NULL )
+        printf("image writer: %s%s, %llu writes (%llu resubmitted), %llu syncs, up to %u in flight\n",
+            stats.writer.uring ? "io_uring" : "thread",
+            stats.writer.registered ? " (registered buffers)" : "",
+            (unsigned long long)stats.writer.writes, (unsigned long long)stats.writer.resubmits,
+            (unsigned long long)stats.writer.syncs, stats.writer.max_in_flight);
+    /* without the end record the delta reads as cut short */
+    if( delta && ret == 0 && delta_write_end(delta) != 0 )
+        ret = 1;
+
+done:
+    if( digest )
+        fclose(digest);
+    if( packed && fclose(packed) != 0 )
+    {
+        fprintf(stderr, "Failed to write the compressed image.\n");
+        ret = 1;
+    }
+    if( delta && fclose(delta) != 0 )
+    {
+        fprintf(stderr, "Failed to write the delta image.\n");
+        ret = 1;
+    }
+    delta_base_close(base);
+    if( image && output_close(image) != 0 )
+        ret = 1;
+    return ret;
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file postproc.h
+ * \brief Post-processing of dumped pages on a worker pool
+ * The bus thread reads pages into batches and hands every full batch to the
+ * work-stealing pool (pool.h), where the page digests (CRC-32, erased flag)
+ * are computed. A reorder buffer passes the batches to the sinks (image and
+ * digest list) strictly in page order. The batches are buffers of the page
+ * arena, so a full batch goes to an O_DIRECT image without a copy; with a
+ * mapped image (OUTPUT_MMAP) the pages are read straight into their place in
+ * the file instead. The bus thread only blocks when all
+ * batch slots are still being processed or written (backpressure); it never
+ * computes or writes anything itself.
+ * Besides the hash the workers can run more stages on every page: a check of
+ * the Hamming ECC in the spare area, the byte entropy, and gzip compression
+ * into a sink of its own. The stages take each page in turn while it is in
+ * the cache, so enabling more of them adds computation but no memory traffic.
+ * With a base image (postproc_add_delta()) the pages are also encoded as a
+ * delta against it (delta.h), which can replace the image altogether.
+ */
+
+#ifndef POSTPROC_H
+#define POSTPROC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "writer.h"
+#include "delta.h"
+
+#define POSTPROC_BATCH_PAGES     64
+#define POSTPROC_SLOTS_PER_WORKER 4
+
+/* stages; the hash (CRC-32 and erased flag) always runs */
+#define POSTPROC_HASH     0x01
+#define POSTPROC_ECC      0x02 /* Hamming ECC in the spare area (Linux software ECC layout) */
+#define POSTPROC_ENTROPY  0x04 /* byte entropy of the page */
+#define POSTPROC_COMPRESS 0x08 /* gzip, one member per batch */
+#define POSTPROC_DELTA    0x10 /* delta against a base image, see postproc_add_delta() */
+
+struct postproc_stats
+{
+    uint64_t batches;
+    uint64_t pages;
+    uint64_t erased_pages;
+    uint64_t stolen;       /* batches processed by another worker than they were queued on */
+    uint64_t stalls;       /* times the bus thread waited for a free slot */
+    uint64_t stall_ns;
+    uint64_t ecc_corrected; /* bitflips the ECC would correct */
+    uint64_t ecc_failed;    /* pages with an uncorrectable ECC step */
+    uint64_t packed_bytes;  /* size of the compressed image */
+    struct delta_stats delta;   /* POSTPROC_DELTA */
+    struct writer_stats writer; /* if the image went through the asynchronous writer */
+};
+
+struct postproc;
+struct dump_output;
+
+extern int postproc_stages; /* stages of the pipelined dump */
+
+uint32_t postproc_crc32(const unsigned char *data, unsigned int length);
+int postproc_parse_stages(const char *list);
+
+struct postproc *postproc_create(unsigned int workers, int stages, struct dump_output *image, FILE *digest,
+    FILE *packed);
+int postproc_add_delta(struct postproc *pp, const struct delta_base *base, FILE *delta);
+int postproc_dump_range(struct postproc *pp, unsigned int nFirstPageId, unsigned int nPages);
+int postproc_finish(struct postproc *pp, struct postproc_stats *stats);
+int dump_memory_pipelined(unsigned int nFirstPageId, unsigned int nPages, unsigned int workers,
+    const char *digest_path, const char *packed_path, const char *base_path, const char *delta_path);
+
+#endif /* POSTPROC_H */
@@ -0,0 +1,397 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file profile.c
+ * \brief Persistent chip profile cache (see profile.h)
+ * The store is a text file with one entry per chip:
+ *   profile <ID bytes> <unique ID or ->
+ *   parameter_page <CRC>
+ *   geometry <page size> <spare size> <pages per block> <blocks>
+ *   address_cycles <column cycles> <row cycles>
+ *   features <NAND_FEATURE_* mask>
+ *   model <backend> <transfer_ns> <delay_factor> <tR_ns> <runs>
+ *   bad_blocks <count> <block> ...
+ *   end
+ * parameter_page and model are left out if the chip has no parameter page or
+ * no model was calibrated yet, address_cycles if they are derived from the
+ * geometry.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nand.h"
+#include "bbt.h"
+#include "plan.h"
+#include "profile.h"
+
+static void profile_hex(const unsigned char *bytes, unsigned int length, char *hex)
+{
+    for(unsigned int k = 0; k < length; k++)
+        sprintf(&hex[2 * k], "%02X", bytes[k]);
+}
+
+static int profile_parse_hex(const char *hex, unsigned char *bytes, unsigned int length)
+{
+    unsigned int value;
+
+    if( strlen(hex) != 2 * length )
+        return 1;
+    for(unsigned int k = 0; k < length; k++)
+    {
+        if( sscanf(&hex[2 * k], "%2x", &value) != 1 )
+            return 1;
+        bytes[k] = (unsigned char)value;
+    }
+    return 0;
+}
+
+/* reads the rest of an entry after its "profile" keyword; returns 0 on success */
+static int profile_read_entry(FILE *fp, struct chip_profile *profile)
+{
+    char word[40];
+    unsigned int value;
+
+    memset(profile, 0, sizeof(*profile));
+    if( fscanf(fp, "%39s", word) != 1 || profile_parse_hex(word, profile->ID_register, sizeof(profile->ID_register)) != 0 )
+        return 1;
+    if( fscanf(fp, "%39s", word) != 1 )
+        return 1;
+    if( strcmp(word, "-") != 0 )
+    {
+        if( profile_parse_hex(word, profile->unique_id, sizeof(profile->unique_id)) != 0 )
+            return 1;
+        profile->has_unique_id = 1;
+    }
+
+    while( fscanf(fp, "%39s", word) == 1 )
+    {
+        if( strcmp(word, "end") == 0 )
+        {
+            if( !nand_geometry_addressable(&profile->geometry) )
+                break;
+            return 0;
+        }
+        else if( strcmp(word, "parameter_page") == 0 )
+        {
+            if( fscanf(fp, "%x", &value) != 1 )
+                break;
+            profile->has_parameter_page = 1;
+            profile->parameter_page_crc = (uint16_t)value;
+        }
+        else if( strcmp(word, "geometry") == 0 )
+        {
+            if( fscanf(fp, "%u %u %u %u", &profile->geometry.page_size, &profile->geometry.spare_size,
+                &profile->geometry.pages_per_block, &profile->geometry.blocks) != 4 )
+                break;
+        }
+        else if( strcmp(word, "address_cycles") == 0 )
+        {
+            if( fscanf(fp, "%u %u", &profile->geometry.column_cycles, &profile->geometry.row_cycles) != 2 )
+                break;
+        }
+        else if( strcmp(word, "features") == 0 )
+        {
+            if( fscanf(fp, "%x", &profile->features) != 1 )
+                break;
+        }
+        else if( strcmp(word, "model") == 0 )
+        {
+            if( fscanf(fp, "%31s %lf %lf %lf %u", profile->model.backend, &profile->model.transfer_ns,
+                &profile->model.delay_factor, &profile->model.tR_ns, &profile->model.runs) != 5 )
+                break;
+            profile->has_model = 1;
+        }
+        else if( strcmp(word, "bad_blocks") == 0 )
+        {
+            if( fscanf(fp, "%u", &value) != 1 || profile->bad_blocks != NULL )
+                break;
+            profile->bad_blocks = calloc(value ? value : 1, sizeof(*profile->bad_blocks));
+            if( profile->bad_blocks == NULL )
+                break;
+            for(profile->bad_blocks_count = 0; profile->bad_blocks_count < value; profile->bad_blocks_count++)
+                if( fscanf(fp, "%u", &profile->bad_blocks[profile->bad_blocks_count]) != 1 )
+                    break;
+            if( profile->bad_blocks_count != value )
+                break;
+        }
+        else
+            break;
+    }
+
+    profile_free(profile);
+    return 1;
+}
+
+static void profile_write_entry(FILE *fp, const struct chip_profile *profile)
+{
+    char hex[2 * sizeof(profile->unique_id) + 1];
+
+    profile_hex(profile->ID_register, sizeof(profile->ID_register), hex);
+    fprintf(fp, "profile %s", hex);
+    if( profile->has_unique_id )
+        profile_hex(profile->unique_id, sizeof(profile->unique_id), hex);
+    else
+        strcpy(hex, "-");
+    fprintf(fp, " %s\n", hex);
+
+    if( profile->has_parameter_page )
+        fprintf(fp, "parameter_page %04X\n", profile->parameter_page_crc);
+    fprintf(fp, "geometry %u %u %u %u\n", profile->geometry.page_size, profile->geometry.spare_size,
+        profile->geometry.pages_per_block, profile->geometry.blocks);
+    if( profile->geometry.column_cycles || profile->geometry.row_cycles )
+        fprintf(fp, "address_cycles %u %u\n", profile->geometry.column_cycles, profile->geometry.row_cycles);
+    fprintf(fp, "features %X\n", profile->features);
+    if( profile->has_model )
+        fprintf(fp, "model %s %.1f %.4f %.1f %u\n", profile->model.backend, profile->model.transfer_ns,
+            profile->model.delay_factor, profile->model.tR_ns, profile->model.runs);
+    fprintf(fp, "bad_blocks %u", profile->bad_blocks_count);
+    for(unsigned int k = 0; k < profile->bad_blocks_count; k++)
+        fprintf(fp, " %u", profile->bad_blocks[k]);
+    fprintf(fp, "\nend\n");
+}
+
+static int profile_matches(const struct chip_profile *entry, const unsigned char *ID_register,
+    const unsigned char *unique_id)
+{
+    if( memcmp(entry->ID_register, ID_register, sizeof(entry->ID_register)) != 0 )
+        return 0;
+    if( unique_id == NULL )
+        return 1;
+    return entry->has_unique_id && memcmp(entry->unique_id, unique_id, sizeof(entry->unique_id)) == 0;
+}
+
+/* looks the chip up by its ID bytes and, if given, its unique ID;
+ * returns 0 if an entry was found */
+int profile_load(const char *path, const unsigned char *ID_register, const unsigned char *unique_id,
+    struct chip_profile *profile)
+{
+    FILE *fp = fopen(path, "r");
+    char word[40];
+
+    memset(profile, 0, sizeof(*profile));
+    if( fp == NULL )
+        return 1;
+    while( fscanf(fp, "%39s", word) == 1 )
+    {
+        if( strcmp(word, "profile") != 0 || profile_read_entry(fp, profile) != 0 )
+            break;
+        if( profile_matches(profile, ID_register, unique_id) )
+        {
+            fclose(fp);
+            return 0;
+        }
+        profile_free(profile);
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* replaces the entry of the chip, keeps all others */
+int profile_save(const char *path, const struct chip_profile *profile)
+{
+    struct chip_profile *entries = NULL, entry;
+    unsigned int count = 0;
+    FILE *fp = fopen(path, "r");
+    char word[40];
+
+    if( fp )
+    {
+        while( fscanf(fp, "%39s", word) == 1 )
+        {
+            struct chip_profile *grown;
+
+            if( strcmp(word, "profile") != 0 || profile_read_entry(fp, &entry) != 0 )
+                break;
+            if( profile_matches(&entry, profile->ID_register, profile->has_unique_id ? profile->unique_id : NULL) )
+            {
+                profile_free(&entry);
+                continue;
+            }
+            grown = realloc(entries, (count + 1) * sizeof(*entries));
+            if( grown == NULL )
+            {
+                profile_free(&entry);
+                break;
+            }
+            entries = grown;
+            entries[count++] = entry;
+        }
+        fclose(fp);
+    }
+
+    fp = fopen(path, "w");
+    if( fp != NULL )
+    {
+        for(unsigned int k = 0; k < count; k++)
+            profile_write_entry(fp, &entries[k]);
+        profile_write_entry(fp, profile);
+        fclose(fp);
+    }
+    else
+        fprintf(stderr, "unable to write chip profile %s\n", path);
+
+    for(unsigned int k = 0; k < count; k++)
+        profile_free(&entries[k]);
+    free(entries);
+    return fp != NULL ? 0 : EXIT_FAILURE;
+}
+
+/* saves the entry at the end of a job and releases it. model is the cost model
+ * the job calibrated, loaded or refined; NULL if the job did not plan (e.g. a
+ * programming job), then the model of the entry stays as it was loaded */
+int profile_store(const char *path, struct chip_profile *profile, const struct plan_model *model)
+{
+    int ret;
+
+    if( model )
+    {
+        profile->model = *model;
+        profile->has_model = 1;
+    }
+    ret = profile_save(path, profile);
+    profile_free(profile);
+    return ret;
+}
+
+/* looks the chip in the socket up: by its ID bytes first and, if chips of this
+ * type carry a unique ID, by the unique ID read from the chip; the entry is then
+ * validated; returns 0 if a valid profile was found */
+int profile_find(const char *path, const unsigned char *ID_register, struct chip_profile *profile)
+{
+    unsigned char unique_id[UNIQUE_ID_SIZE];
+
+    if( profile_load(path, ID_register, NULL, profile) != 0 )
+        return 1;
+    if( profile->has_unique_id )
+    {
+        profile_free(profile);
+        if( read_unique_id(unique_id) != 0 || profile_load(path, ID_register, unique_id, profile) != 0 )
+            return 1;
+    }
+    if( profile_validate(profile, ID_register) != 0 )
+    {
+        profile_free(profile);
+        return 1;
+    }
+    return 0;
+}
+
+/* cheap check that the cached profile belongs to the chip in the socket:
+ * the ID bytes and, if the chip has one, the CRC of the parameter page;
+ * returns 0 if the profile is valid */
+int profile_validate(const struct chip_profile *profile, const unsigned char *ID_register)
+{
+    unsigned char page[ONFI_PARAM_PAGE_SIZE];
+
+    if( memcmp(profile->ID_register, ID_register, sizeof(profile->ID_register)) != 0 )
+        return 1;
+    if( !profile->has_parameter_page )
+        return 0;
+
+    if( read_valid_parameter_page(page) != 0 ||
+        onfi_crc16(page, ONFI_PARAM_PAGE_SIZE - 2) != profile->parameter_page_crc )
+        return 1;
+    return 0;
+}
+
+/* determines the profile the slow way: geometry, features and unique ID from the
+ * parameter page (or the geometry from the ID bytes if the chip has none) and the
+ * bad blocks from the on-flash table, or a scan of all blocks for the factory
+ * bad block marker if there is none; the geometry is applied to nand_geometry */
+int profile_identify(struct chip_profile *profile, const unsigned char *ID_register)
+{
+    unsigned char page[ONFI_PARAM_PAGE_SIZE];
+    struct bad_block_table bbt;
+    unsigned int *grown;
+
+    memset(profile, 0, sizeof(*profile));
+    memcpy(profile->ID_register, ID_register, sizeof(profile->ID_register));
+
+    if( read_valid_parameter_page(page) == 0 &&
+        parse_parameter_page(page, &profile->geometry, &profile->features) == 0 )
+    {
+        profile->has_parameter_page = 1;
+        profile->parameter_page_crc = onfi_crc16(page, ONFI_PARAM_PAGE_SIZE - 2);
+        if( (profile->features & NAND_FEATURE_UNIQUE_ID) && read_unique_id(profile->unique_id) == 0 )
+            profile->has_unique_id = 1;
+    }
+    else if( decode_ID_geometry(ID_register, &profile->geometry) != 0 )
+    {
+        fprintf(stderr, "Unable to determine the chip geometry, keeping the default.\n");
+        profile->geometry = nand_geometry;
+    }
+    nand_geometry = profile->geometry;
+
+    /* the on-flash table spares the marker scan; blocks reserved for it are not bad */
+    if( bbt_load(&bbt) != 0 )
+    {
+        profile_free(profile);
+        return EXIT_FAILURE;
+    }
+    for(unsigned int nBlockId = 0; nBlockId < bbt.blocks; nBlockId++)
+    {
+        if( bbt.state[nBlockId] != BBT_BLOCK_FACTORY_BAD && bbt.state[nBlockId] != BBT_BLOCK_WORN )
+            continue;
+        grown = realloc(profile->bad_blocks, (profile->bad_blocks_count + 1) * sizeof(*profile->bad_blocks));
+        if( grown == NULL )
+        {
+            bbt_free(&bbt);
+            profile_free(profile);
+            return EXIT_FAILURE;
+        }
+        profile->bad_blocks = grown;
+        profile->bad_blocks[profile->bad_blocks_count++] = nBlockId;
+    }
+    bbt_free(&bbt);
+    return 0;
+}
+
+void profile_print(FILE *fp, const struct chip_profile *profile)
+{
+    fprintf(fp, "chip: ID %02X %02X %02X %02X %02X, %s\n",
+        profile->ID_register[0], profile->ID_register[1], profile->ID_register[2],
+        profile->ID_register[3], profile->ID_register[4],
+        profile->has_parameter_page ? "ONFI parameter page" : "geometry from ID bytes");
+    if( profile->has_unique_id )
+    {
+        fprintf(fp, "unique ID:");
+        for(unsigned int k = 0; k < sizeof(profile->unique_id); k++)
+            fprintf(fp, " %02X", profile->unique_id[k]);
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "geometry: %u + %u bytes per page, %u pages per block, %u blocks, %u + %u address cycles\n",
+        profile->geometry.page_size, profile->geometry.spare_size,
+        profile->geometry.pages_per_block, profile->geometry.blocks,
+        nand_column_cycles(&profile->geometry), nand_row_cycles(&profile->geometry));
+    fprintf(fp, "features:%s%s%s%s\n",
+        (profile->features & NAND_FEATURE_CACHE_READ) ? " cache-read" : "",
+        (profile->features & NAND_FEATURE_UNIQUE_ID) ? " unique-id" : "",
+        (profile->features & NAND_FEATURE_SET_FEATURES) ? " set-features" : "",
+        (profile->features & ~NAND_FEATURE_ONFI) ? "" : " none");
+    fprintf(fp, "bad blocks: %u", profile->bad_blocks_count);
+    for(unsigned int k = 0; k < profile->bad_blocks_count; k++)
+        fprintf(fp, " %u", profile->bad_blocks[k]);
+    fprintf(fp, "\n");
+}
+
+void profile_free(struct chip_profile *profile)
+{
+    free(profile->bad_blocks);
+    profile->bad_blocks = NULL;
+    profile->bad_blocks_count = 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file profile.h
+ * \brief Persistent chip profile cache
+ * Everything the reader learns about a chip the slow way (geometry and features
+ * from the parameter page or the ID bytes, the calibrated cost model of the
+ * bus and the factory bad blocks) is kept in a local store keyed by the ID
+ * bytes and, where the chip has one, its unique ID, so two chips of the same
+ * type get separate entries. On the next run the entry is validated cheaply
+ * against the chip (ID and parameter page CRC) instead of being determined again.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "nand.h"
+#include "plan.h"
+
+struct chip_profile
+{
+    unsigned char ID_register[5];
+    int has_unique_id;
+    unsigned char unique_id[16];
+    int has_parameter_page;
+    uint16_t parameter_page_crc;
+    struct nand_geometry geometry;
+    unsigned int features;         /* NAND_FEATURE_* */
+    int has_model;
+    struct plan_model model;
+    unsigned int *bad_blocks;      /* factory marked or worn out (bbt.h), ascending */
+    unsigned int bad_blocks_count;
+};
+
+int profile_load(const char *path, const unsigned char *ID_register, const unsigned char *unique_id,
+    struct chip_profile *profile);
+int profile_save(const char *path, const struct chip_profile *profile);
+int profile_store(const char *path, struct chip_profile *profile, const struct plan_model *model);
+int profile_find(const char *path, const unsigned char *ID_register, struct chip_profile *profile);
+int profile_validate(const struct chip_profile *profile, const unsigned char *ID_register);
+int profile_identify(struct chip_profile *profile, const unsigned char *ID_register);
+void profile_print(FILE *fp, const struct chip_profile *profile);
+void profile_free(struct chip_profile *profile);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,555 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file replay.c
+ * \brief Recording and offline replay of reader sessions
+ * For the chip replay the recorded stream is decoded with the same edge
+ * rules the chip uses (latch on rising nWE, output on falling nRE). Repeated
+ * reads of one page are served in recorded order, so bitflips that showed up
+ * on the real chip show up again; busy times are taken from the first
+ * sample of RDY high after the confirm command.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nand.h"
+#include "nand_sim.h"
+#include "replay.h"
+
+#define STRICT_REPORT_MAX 10 /* divergences reported in detail */
+
+/*
+ * Recording
+ */
+
+static const struct bus_backend *record_inner;
+static FILE *record_fp;
+
+static void record_entry(rec_op_t op, unsigned char value, uint32_t arg)
+{
+    struct rec_entry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.op = op;
+    entry.value = value;
+    entry.arg = arg;
+    entry.time_ns = record_inner->now_ns();
+    fwrite(&entry, sizeof(entry), 1, record_fp);
+}
+
+static int record_write_controlbus(unsigned char value)
+{
+    int ret = record_inner->write_controlbus(value);
+    record_entry(REC_WRITE_CONTROLBUS, value, 0);
+    return ret;
+}
+
+static int record_write_iobus(unsigned char value)
+{
+    int ret = record_inner->write_iobus(value);
+    record_entry(REC_WRITE_IOBUS, value, 0);
+    return ret;
+}
+
+static int record_set_iobus_direction(iobus_inout_t inout)
+{
+    int ret = record_inner->set_iobus_direction(inout);
+    record_entry(REC_IOBUS_DIRECTION, inout, 0);
+    return ret;
+}
+
+static unsigned char record_read_controlbus(void)
+{
+    unsigned char value = record_inner->read_controlbus();
+    record_entry(REC_READ_CONTROLBUS, value, 0);
+    return value;
+}
+
+static unsigned char record_read_iobus(void)
+{
+    unsigned char value = record_inner->read_iobus();
+    record_entry(REC_READ_IOBUS, value, 0);
+    return value;
+}
+
+static void record_delay_us(unsigned int usec)
+{
+    record_inner->delay_us(usec);
+    record_entry(REC_DELAY, 0, usec);
+}
+
+static uint64_t record_now_ns(void)
+{
+    return record_inner->now_ns();
+}
+
+static const struct bus_backend record_backend =
+{
+    "record",
+    record_write_controlbus,
+    record_write_iobus,
+    record_set_iobus_direction,
+    record_read_controlbus,
+    record_read_iobus,
+    record_delay_us,
+    record_now_ns
+};
+
+const struct bus_backend *replay_record_start(const struct bus_backend *inner, const char *path)
+{
+    record_fp = fopen(path, "wb");
+    if( record_fp == NULL )
+    {
+        fprintf(stderr, "unable to open recording %s\n", path);
+        return NULL;
+    }
+    fwrite(REC_MAGIC, 1, strlen(REC_MAGIC), record_fp);
+    record_inner = inner;
+    return &record_backend;
+}
+
+void replay_record_finish(void)
+{
+    if( record_fp )
+        fclose(record_fp);
+    record_fp = NULL;
+}
+
+static struct rec_entry *replay_load(const char *path, uint64_t *count)
+{
+    FILE *fp = fopen(path, "rb");
+    char magic[8];
+    struct rec_entry *entries = NULL;
+    long size;
+
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to open recording %s\n", path);
+        return NULL;
+    }
+    if( fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, REC_MAGIC, sizeof(magic)) != 0 )
+    {
+        fprintf(stderr, "%s is not a recording\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp) - (long)sizeof(magic);
+    fseek(fp, sizeof(magic), SEEK_SET);
+
+    *count = size / sizeof(struct rec_entry);
+    entries = malloc(*count * sizeof(struct rec_entry) + 1);
+    if( entries == NULL || fread(entries, sizeof(struct rec_entry), *count, fp) != *count )
+    {
+        fprintf(stderr, "unable to read recording %s\n", path);
+        free(entries);
+        entries = NULL;
+    }
+    fclose(fp);
+    return entries;
+}
+
+/*
+ * Strict replay
+ */
+
+static struct
+{
+    struct rec_entry *entries;
+    uint64_t count;
+    uint64_t pos;
+    uint64_t divergences;
+    uint64_t time_ns;
+} strict;
+
+static const struct rec_entry *strict_next(rec_op_t op, unsigned char value, uint32_t arg)
+{
+    const struct rec_entry *entry;
+    int is_read = (op == REC_READ_CONTROLBUS || op == REC_READ_IOBUS);
+
+    if( strict.pos >= strict.count )
+    {
+        if( strict.divergences++ < STRICT_REPORT_MAX )
+            fprintf(stderr, "replay: call %llu beyond the end of the recording\n",
+                (unsigned long long)strict.pos);
+        strict.pos++;
+        return NULL;
+    }
+
+    entry = &strict.entries[strict.pos];
+    if( entry->op != op || entry->arg != arg || (!is_read && entry->value != value) )
+    {
+        if( strict.divergences++ < STRICT_REPORT_MAX )
+            fprintf(stderr, "replay: call %llu diverges: op %d value 0x%02X arg %u, recorded op %d value 0x%02X arg %u\n",
+                (unsigned long long)strict.pos, op, value, arg, entry->op, entry->value, entry->arg);
+    }
+    strict.pos++;
+    strict.time_ns = entry->time_ns;
+    return entry->op == op ? entry : NULL;
+}
+
+static int strict_write_controlbus(unsigned char value)
+{
+    strict_next(REC_WRITE_CONTROLBUS, value, 0);
+    return 1;
+}
+
+static int strict_write_iobus(unsigned char value)
+{
+    strict_next(REC_WRITE_IOBUS, value, 0);
+    return 1;
+}
+
+static int strict_set_iobus_direction(iobus_inout_t inout)
+{
+    strict_next(REC_IOBUS_DIRECTION, inout, 0);
+    return 0;
+}
+
+static unsigned char strict_read_controlbus(void)
+{
+    const struct rec_entry *entry = strict_next(REC_READ_CONTROLBUS, 0, 0);
+    return entry ? entry->value : PIN_RDY;
+}
+
+static unsigned char strict_read_iobus(void)
+{
+    const struct rec_entry *entry = strict_next(REC_READ_IOBUS, 0, 0);
+    return entry ? entry->value : 0xFF;
+}
+
+static void strict_delay_us(unsigned int usec)
+{
+    strict_next(REC_DELAY, 0, usec);
+}
+
+static uint64_t strict_now_ns(void)
+{
+    return strict.time_ns;
+}
+
+static const struct bus_backend strict_backend =
+{
+    "replay",
+    strict_write_controlbus,
+    strict_write_iobus,
+    strict_set_iobus_direction,
+    strict_read_controlbus,
+    strict_read_iobus,
+    strict_delay_us,
+    strict_now_ns
+};
+
+const struct bus_backend *replay_strict_open(const char *path)
+{
+    memset(&strict, 0, sizeof(strict));
+    strict.entries = replay_load(path, &strict.count);
+    if( strict.entries == NULL )
+        return NULL;
+    if( strict.count )
+        strict.time_ns = strict.entries[0].time_ns;
+    return &strict_backend;
+}
+
+uint64_t replay_strict_close(void)
+{
+    uint64_t divergences = strict.divergences;
+
+    if( strict.pos < strict.count )
+    {
+        fprintf(stderr, "replay: %llu recorded calls were not replayed\n",
+            (unsigned long long)(strict.count - strict.pos));
+        divergences++;
+    }
+    free(strict.entries);
+    memset(&strict, 0, sizeof(strict));
+    return divergences;
+}
+
+/*
+ * Chip replay
+ */
+
+struct chip_read
+{
+    uint32_t row;
+    unsigned int busy_ns; /* 0: not measured */
+    unsigned int length;
+    unsigned int uses;
+    unsigned char *data;
+};
+
+struct chip_status
+{
+    unsigned char command; /* 10h (program) or D0h (erase) */
+    uint32_t row;
+    unsigned int busy_ns;
+    unsigned char status;
+    int valid;
+    unsigned int uses;
+};
+
+static struct
+{
+    struct chip_read *reads;
+    unsigned int reads_count;
+    struct chip_status *statuses;
+    unsigned int statuses_count;
+    unsigned int page_size;
+} chip;
+
+typedef enum { COLLECT_NONE=0, COLLECT_ID, COLLECT_PAGE, COLLECT_STATUS } collect_t;
+
+static uint32_t decode_row(const unsigned char *address)
+{
+    return address[0] | ((uint32_t)address[1] << 8) | ((uint32_t)(address[2] & 0x03) << 16);
+}
+
+static int chip_decode(const struct rec_entry *entries, uint64_t count, unsigned char *ID_register)
+{
+    unsigned char control = 0, io = 0, command = 0;
+    unsigned char address[5];
+    unsigned int address_count = 0, id_count = 0;
+    collect_t collect = COLLECT_NONE;
+    int nre_fell = 0, waiting_ready = 0;
+    uint64_t confirm_time = 0;
+    struct chip_read *read = NULL;
+    struct chip_status *status = NULL;
+
+    for(uint64_t n = 0; n < count; n++)
+    {
+        const struct rec_entry *entry = &entries[n];
+        unsigned char previous = control;
+
+        switch( entry->op )
+        {
+            case REC_WRITE_IOBUS:
+                io = entry->value;
+                break;
+
+            case REC_READ_CONTROLBUS:
+                if( waiting_ready && (entry->value & PIN_RDY) )
+                {
+                    unsigned int busy_ns = (unsigned int)(entry->time_ns - confirm_time);
+                    if( collect == COLLECT_PAGE && read )
+                        read->busy_ns = busy_ns;
+                    else if( status )
+                        status->busy_ns = busy_ns;
+                    waiting_ready = 0;
+                }
+                break;
+
+            case REC_READ_IOBUS:
+                if( !nre_fell )
+                    break;
+                nre_fell = 0;
+                if( collect == COLLECT_ID && id_count < 5 )
+                    ID_register[id_count++] = entry->value;
+                else if( collect == COLLECT_PAGE && read && read->length < chip.page_size )
+                    read->data[read->length++] = entry->value;
+                else if( collect == COLLECT_STATUS && status && !status->valid )
+                {
+                    status->status = entry->value;
+                    status->valid = 1;
+                }
+                break;
+
+            case REC_WRITE_CONTROLBUS:
+                control = entry->value;
+                if( control & PIN_nCE )
+                    break;
+
+                if( (previous & PIN_nRE) && !(control & PIN_nRE) )
+                    nre_fell = 1;
+
+                if( (previous & PIN_nWE) || !(control & PIN_nWE) )
+                    break;
+
+                /* rising edge of nWE */
+                if( (control & PIN_ALE) && !(control & PIN_CLE) )
+                {
+                    if( address_count < sizeof(address) )
+                        address[address_count++] = io;
+                    if( command == 0x90 )
+                    {
+                        collect = COLLECT_ID;
+                        id_count = 0;
+                    }
+                }
+                else if( (control & PIN_CLE) && !(control & PIN_ALE) )
+                {
+                    switch( io )
+                    {
+                        case 0x00:
+                        case 0x60:
+                        case 0x80:
+                        case 0x90:
+                            command = io;
+                            address_count = 0;
+                            collect = COLLECT_NONE;
+                            break;
+                        case 0x30:
+                            if( command != 0x00 || address_count != 5 )
+                                break;
+                            read = realloc(chip.reads, (chip.reads_count + 1) * sizeof(*chip.reads));
+                            if( read == NULL )
+                                return EXIT_FAILURE;
+                            chip.reads = read;
+                            read = &chip.reads[chip.reads_count++];
+                            memset(read, 0, sizeof(*read));
+                            read->row = decode_row(&address[2]);
+                            read->data = malloc(chip.page_size);
+                            if( read->data == NULL )
+                                return EXIT_FAILURE;
+                            collect = COLLECT_PAGE;
+                            confirm_time = entry->time_ns;
+                            waiting_ready = 1;
+                            break;
+                        case 0x10:
+                        case 0xD0:
+                            if( !(io == 0x10 && command == 0x80 && address_count == 5) &&
+                                !(io == 0xD0 && command == 0x60 && address_count == 3) )
+                                break;
+                            status = realloc(chip.statuses, (chip.statuses_count + 1) * sizeof(*chip.statuses));
+                            if( status == NULL )
+                                return EXIT_FAILURE;
+                            chip.statuses = status;
+                            status = &chip.statuses[chip.statuses_count++];
+                            memset(status, 0, sizeof(*status));
+                            status->command = io;
+                            status->row = decode_row(io == 0x10 ? &address[2] : &address[0]);
+                            collect = COLLECT_NONE;
+                            confirm_time = entry->time_ns;
+                            waiting_ready = 1;
+                            break;
+                        case 0x70:
+                            collect = COLLECT_STATUS;
+                            break;
+                        default:
+                            collect = COLLECT_NONE;
+                            break;
+                    }
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/* least used recording of the row, earliest first */
+static int chip_page_read(uint32_t row, unsigned char *data, unsigned int size, unsigned int *busy_ns)
+{
+    struct chip_read *best = NULL;
+
+    for(unsigned int k = 0; k < chip.reads_count; k++)
+        if( chip.reads[k].row == row && (best == NULL || chip.reads[k].uses < best->uses) )
+            best = &chip.reads[k];
+    if( best == NULL )
+        return 0;
+
+    best->uses++;
+    memset(data, 0xFF, size);
+    memcpy(data, best->data, best->length < size ? best->length : size);
+    if( best->busy_ns )
+        *busy_ns = best->busy_ns;
+    return 1;
+}
+
+static int chip_status(unsigned char command, uint32_t row, unsigned char *status, unsigned int *busy_ns)
+{
+    struct chip_status *best = NULL;
+
+    for(unsigned int k = 0; k < chip.statuses_count; k++)
+        if( chip.statuses[k].command == command && chip.statuses[k].row == row && chip.statuses[k].valid &&
+            (best == NULL || chip.statuses[k].uses < best->uses) )
+            best = &chip.statuses[k];
+    if( best == NULL )
+        return 0;
+
+    best->uses++;
+    *status = best->status;
+    if( best->busy_ns )
+        *busy_ns = best->busy_ns;
+    return 1;
+}
+
+static const struct sim_responder chip_responder =
+{
+    chip_page_read,
+    chip_status
+};
+
+int replay_chip_open(const char *path, unsigned char *ID_register)
+{
+    struct rec_entry *entries;
+    uint64_t count;
+    int ret;
+
+    replay_chip_close();
+    chip.page_size = nand_page_size_total();
+
+    entries = replay_load(path, &count);
+    if( entries == NULL )
+        return EXIT_FAILURE;
+    ret = chip_decode(entries, count, ID_register);
+    free(entries);
+    if( ret != 0 )
+    {
+        fprintf(stderr, "Failed to decode recording %s\n", path);
+        replay_chip_close();
+        return ret;
+    }
+
+    sim_responder = &chip_responder;
+    return 0;
+}
+
+/* range of pages read during the recorded session */
+int replay_chip_page_range(uint32_t *first, unsigned int *count)
+{
+    uint32_t last = 0;
+
+    if( chip.reads_count == 0 )
+        return EXIT_FAILURE;
+
+    *first = UINT32_MAX;
+    for(unsigned int k = 0; k < chip.reads_count; k++)
+    {
+        if( chip.reads[k].row < *first )
+            *first = chip.reads[k].row;
+        if( chip.reads[k].row > last )
+            last = chip.reads[k].row;
+    }
+    *count = last - *first + 1;
+    return 0;
+}
+
+void replay_chip_close(void)
+{
+    for(unsigned int k = 0; k < chip.reads_count; k++)
+        free(chip.reads[k].data);
+    free(chip.reads);
+    free(chip.statuses);
+    memset(&chip, 0, sizeof(chip));
+    sim_responder = NULL;
+}
@@ -0,0 +1,68 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file replay.h
+ * \brief Recording and offline replay of reader sessions
+ * A recording holds every bus backend call of a session (bytes written to
+ * both channels, direction changes, delays) together with the sampled input
+ * and a timestamp. It can be replayed in two ways:
+ *  - strict: the replay backend stands in for the device and checks that the
+ *    code produces exactly the recorded byte stream (protocol regression test)
+ *  - chip: the recorded chip responses (page data incl. bitflips, busy times,
+ *    program/erase status, ID) are fed into the simulated reader, so read
+ *    paths with a different transfer pattern can be tested and benchmarked
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include "nand.h"
+
+typedef enum
+{
+    REC_WRITE_CONTROLBUS = 1,
+    REC_WRITE_IOBUS,
+    REC_IOBUS_DIRECTION,
+    REC_READ_CONTROLBUS,
+    REC_READ_IOBUS,
+    REC_DELAY
+} rec_op_t;
+
+/* on-disk record, host byte order */
+struct rec_entry
+{
+    uint8_t op;
+    uint8_t value;
+    uint16_t reserved;
+    uint32_t arg;     /* delay in usec */
+    uint64_t time_ns; /* backend clock after the call */
+};
+
+#define REC_MAGIC "NANDREC1"
+
+const struct bus_backend *replay_record_start(const struct bus_backend *inner, const char *path);
+void replay_record_finish(void);
+
+const struct bus_backend *replay_strict_open(const char *path);
+uint64_t replay_strict_close(void); /* returns the number of diverging calls */
+
+int replay_chip_open(const char *path, unsigned char *ID_register);
+int replay_chip_page_range(uint32_t *first, unsigned int *count);
+void replay_chip_close(void);
+
+#endif /* REPLAY_H */
@@ -0,0 +1,203 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file replay_tool.c
+ * \brief Offline replay of recorded reader sessions (see replay.h)
+ * A session is the part of a reader run that `program -r` records: chip
+ * select, ID read and the dump of a page range.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nand.h"
+#include "nand_sim.h"
+#include "replay.h"
+
+static const unsigned char default_ID_register[5] = { 0xAD, 0xDC, 0x10, 0x95, 0x54 };
+
+static int run_session(const char *image_path, unsigned int first, unsigned int pages)
+{
+    unsigned char ID_register[5];
+    FILE *fp;
+    int ret;
+
+    fp = fopen(image_path, "wb");
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to open %s\n", image_path);
+        return EXIT_FAILURE;
+    }
+
+    nand_select_chip();
+    read_ID_register(ID_register);
+    ret = dump_memory_range(fp, first, pages);
+    fclose(fp);
+    return ret;
+}
+
+/* same bus state as the reader has when it starts recording */
+static void prepare_bus(void)
+{
+    controlbus_reset_value();
+    controlbus_update_output();
+    iobus_set_direction(IOBUS_OUT);
+    iobus_reset_value();
+    iobus_update_output();
+}
+
+static void report(const char *mode, unsigned int pages, uint64_t time_ns, uint64_t transfers)
+{
+    double bytes = (double)pages * nand_page_size_total();
+
+    printf("%-8s %8u pages %12.3f s %12.6f MB/s", mode, pages, (double)time_ns / 1e9,
+        time_ns ? bytes / (double)time_ns * 1e9 / 1e6 : 0.0);
+    if( transfers )
+        printf(" %10.1f transfers/page", (double)transfers / pages);
+    printf("\n");
+}
+
+/* records a session on the simulated reader with some programmed pages */
+static int generate(const char *path, const struct sim_usb_profile *profile,
+    const char *image_path, unsigned int first, unsigned int pages)
+{
+    unsigned char *data = malloc(nand_page_size_total());
+    int ret;
+
+    if( data == NULL || sim_init(profile, &sim_default_timing, &nand_geometry, default_ID_register) != 0 )
+    {
+        free(data);
+        return EXIT_FAILURE;
+    }
+    bus = &sim_backend;
+    prepare_bus();
+    nand_select_chip();
+    for(unsigned int k = 0; k < pages; k += 2)
+    {
+        for(unsigned int m = 0; m < nand_page_size_total(); m++)
+            data[m] = (unsigned char)(m * 7 + k);
+        program_page(first + k, data);
+    }
+    free(data);
+
+    sim_reset_stats();
+    bus = replay_record_start(&sim_backend, path);
+    if( bus == NULL )
+        return EXIT_FAILURE;
+    ret = run_session(image_path, first, pages);
+    replay_record_finish();
+    report("record", pages, sim_stats.time_ns, sim_stats.transfers);
+    sim_free();
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s] [-p profile] [-o image] [-f first_page] [-n pages] recording\n"
+        "       %s -g recording [-p profile] [-o image] [-f first_page] [-n pages]\n"
+        "  -s  strict replay: check the byte stream against the recording\n"
+        "      (default: feed the recorded chip responses into the simulated reader)\n"
+        "  -g  record a session on the simulated reader\n", name, name);
+}
+
+int main(int argc, char **argv)
+{
+    const struct sim_usb_profile *profile = &sim_usb_profiles[0];
+    const char *image_path = "/dev/null";
+    const char *generate_path = NULL;
+    unsigned char ID_register[5];
+    uint32_t first = 0;
+    unsigned int pages = 0;
+    int strict = 0, opt, ret;
+
+    while( (opt = getopt(argc, argv, "sg:p:o:f:n:h")) != -1 )
+    {
+        switch( opt )
+        {
+            case 's': strict = 1; break;
+            case 'g': generate_path = optarg; break;
+            case 'p':
+                profile = sim_find_profile(optarg);
+                if( profile == NULL )
+                {
+                    fprintf(stderr, "unknown profile %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o': image_path = optarg; break;
+            case 'f': first = strtoul(optarg, NULL, 0); break;
+            case 'n': pages = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    verbose = 0;
+
+    if( generate_path )
+        return generate(generate_path, profile, image_path, first, pages ? pages : 16);
+
+    if( optind >= argc )
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    memcpy(ID_register, default_ID_register, sizeof(ID_register));
+    if( replay_chip_open(argv[optind], ID_register) != 0 )
+        return EXIT_FAILURE;
+    if( pages == 0 && replay_chip_page_range(&first, &pages) != 0 )
+    {
+        fprintf(stderr, "no page reads in %s\n", argv[optind]);
+        replay_chip_close();
+        return EXIT_FAILURE;
+    }
+
+    if( strict )
+    {
+        uint64_t start, divergences;
+
+        replay_chip_close();
+        bus = replay_strict_open(argv[optind]);
+        if( bus == NULL )
+            return EXIT_FAILURE;
+        start = bus->now_ns();
+        ret = run_session(image_path, first, pages);
+        report("strict", pages, bus->now_ns() - start, 0);
+        divergences = replay_strict_close();
+        if( divergences )
+        {
+            fprintf(stderr, "FAIL: %llu calls diverge from the recording\n", (unsigned long long)divergences);
+            return EXIT_FAILURE;
+        }
+        return ret;
+    }
+
+    if( sim_init(profile, &sim_default_timing, &nand_geometry, ID_register) != 0 )
+    {
+        replay_chip_close();
+        return EXIT_FAILURE;
+    }
+    bus = &sim_backend;
+    prepare_bus();
+    sim_reset_stats();
+    ret = run_session(image_path, first, pages);
+    report(profile->name, pages, sim_stats.time_ns, sim_stats.transfers);
+    sim_free();
+    replay_chip_close();
+    return ret;
+}
@@ -0,0 +1,273 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file rt.c
+ * \brief Real-time scheduling, memory locking and CPU pinning (see rt.h)
+ * All settings apply to the calling thread (memory locking to the process),
+ * so threads that want other cores call rt_apply() with their own options.
+ *
+ * rt_wait_us() sleeps on an absolute CLOCK_MONOTONIC deadline. Short waits
+ * stop sleeping early by the calibrated wake-up overshoot of clock_nanosleep()
+ * and spin for the rest, so a 10 us bus delay takes 10 us instead of whatever
+ * the timer slack and the scheduler add to usleep().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "rt.h"
+
+#define RT_SPIN_LIMIT_US        100    /* waits below this get a spin tail */
+#define RT_SPIN_MAX_NS          100000
+#define RT_CALIBRATION_SAMPLES  200
+#define RT_CALIBRATION_SLEEP_NS 50000
+
+struct rt_options rt_options = { 0, 0, -1 };
+struct rt_role rt_roles[RT_ROLE_COUNT] = { { "worker", 0, 0, { 0 } }, { "writer", 0, 0, { 0 } } };
+
+static uint64_t rt_spin_ns = RT_SPIN_MAX_NS; /* until calibrated: spin through all short waits */
+
+static uint64_t rt_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int rt_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t rt_percentile(const uint64_t *sorted, unsigned int count, double fraction)
+{
+    unsigned int k = (unsigned int)(fraction * count);
+    return sorted[k < count ? k : count - 1];
+}
+
+static void rt_sleep_until_ns(uint64_t deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline_ns / 1000000000ull;
+    ts.tv_nsec = deadline_ns % 1000000000ull;
+    while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+        ;
+}
+
+/* Wait primitive for all real delays: long waits sleep on an absolute deadline,
+ * waits below RT_SPIN_LIMIT_US sleep until the expected wake-up overshoot before
+ * the deadline and spin for the remainder */
+void rt_wait_us(unsigned int usec)
+{
+    uint64_t deadline = rt_now_ns() + (uint64_t)usec * 1000;
+
+    if( usec >= RT_SPIN_LIMIT_US )
+    {
+        rt_sleep_until_ns(deadline);
+        return;
+    }
+    if( (uint64_t)usec * 1000 > rt_spin_ns )
+        rt_sleep_until_ns(deadline - rt_spin_ns);
+    while( rt_now_ns() < deadline )
+        ;
+}
+
+/* measures how late clock_nanosleep() wakes up on this system (with the current
+ * scheduling options) and uses the 99th percentile as spin tail; returns it in ns */
+uint64_t rt_calibrate_wait(void)
+{
+    uint64_t samples[RT_CALIBRATION_SAMPLES], deadline, now;
+
+    for(unsigned int k = 0; k < RT_CALIBRATION_SAMPLES; k++)
+    {
+        deadline = rt_now_ns() + RT_CALIBRATION_SLEEP_NS;
+        rt_sleep_until_ns(deadline);
+        now = rt_now_ns();
+        samples[k] = now > deadline ? now - deadline : 0;
+    }
+    qsort(samples, RT_CALIBRATION_SAMPLES, sizeof(samples[0]), rt_compare);
+
+    rt_spin_ns = rt_percentile(samples, RT_CALIBRATION_SAMPLES, 0.99);
+    if( rt_spin_ns > RT_SPIN_MAX_NS )
+        rt_spin_ns = RT_SPIN_MAX_NS;
+    return rt_spin_ns;
+}
+
+/* core number from the command line; returns -1 if it is not a valid core */
+int rt_parse_cpu(const char *arg)
+{
+    char *end;
+    long cpu = strtol(arg, &end, 0);
+
+    if( *arg == '\0' || *end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE )
+    {
+        fprintf(stderr, "invalid CPU %s\n", arg);
+        return -1;
+    }
+    return (int)cpu;
+}
+
+/* ROLE:CPUS[:PRIO] from the command line, CPUS a list of cores and ranges
+ * such as 2-5,7; returns EXIT_FAILURE for an unknown role or a bad list */
+int rt_parse_role(const char *arg)
+{
+    const char *colon = strchr(arg, ':');
+    struct rt_role *role = NULL;
+    char *end;
+
+    for(int k = 0; colon && k < RT_ROLE_COUNT; k++)
+        if( strlen(rt_roles[k].name) == (size_t)(colon - arg) && strncmp(arg, rt_roles[k].name, colon - arg) == 0 )
+            role = &rt_roles[k];
+    if( role == NULL )
+    {
+        fprintf(stderr, "invalid thread role in %s\n", arg);
+        return EXIT_FAILURE;
+    }
+
+    role->cpus_count = 0;
+    for(const char *p = colon + 1; *p != '\0' && *p != ':'; p = *end == ',' ? end + 1 : end)
+    {
+        long first = strtol(p, &end, 0), last = first;
+
+        if( end != p && *end == '-' )
+            last = strtol(end + 1, &end, 0);
+        if( end == p || (*end != ',' && *end != ':' && *end != '\0') || first < 0 || last < first
+            || last >= CPU_SETSIZE )
+        {
+            fprintf(stderr, "invalid CPU list in %s\n", arg);
+            return EXIT_FAILURE;
+        }
+        for(long cpu = first; cpu <= last && role->cpus_count < RT_ROLE_MAX_CPUS; cpu++)
+            role->cpus[role->cpus_count++] = (int)cpu;
+    }
+
+    colon = strchr(colon + 1, ':');
+    role->priority = colon ? atoi(colon + 1) : 0;
+    return 0;
+}
+
+/* returns 0 if all requested settings took effect; settings that are not
+ * permitted (no CAP_SYS_NICE, RLIMIT_MEMLOCK) are reported and skipped */
+int rt_apply(const struct rt_options *options)
+{
+    int ret = 0;
+
+    if( options->lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0 )
+    {
+        fprintf(stderr, "mlockall failed: %s\n", strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+
+    if( options->cpu >= 0 )
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(options->cpu, &set);
+        if( sched_setaffinity(0, sizeof(set), &set) != 0 )
+        {
+            fprintf(stderr, "pinning to CPU %d failed: %s\n", options->cpu, strerror(errno));
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if( options->priority > 0 )
+    {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = options->priority;
+        if( sched_setscheduler(0, SCHED_FIFO, &param) != 0 )
+        {
+            fprintf(stderr, "SCHED_FIFO priority %d failed: %s\n", options->priority, strerror(errno));
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    return ret;
+}
+
+/* settings of the index-th thread of a role, from the thread itself */
+int rt_apply_role(int role, unsigned int index)
+{
+    const struct rt_role *r = &rt_roles[role];
+    struct rt_options options = { r->priority, 0, -1 };
+
+    if( r->cpus_count > 0 )
+        options.cpu = r->cpus[index % r->cpus_count];
+    if( options.priority == 0 && options.cpu < 0 )
+        return 0;
+    return rt_apply(&options);
+}
+
+/* times count calls of the transaction; with an expected duration the
+ * distribution is that of the overshoot beyond it */
+int rt_measure(void (*transaction)(void), unsigned int count, uint64_t expected_ns, struct rt_latency *latency)
+{
+    uint64_t *samples = malloc(count * sizeof(*samples));
+    uint64_t start, total = 0;
+
+    memset(latency, 0, sizeof(*latency));
+    if( samples == NULL || count == 0 )
+    {
+        free(samples);
+        return EXIT_FAILURE;
+    }
+
+    for(unsigned int k = 0; k < count; k++)
+    {
+        start = rt_now_ns();
+        transaction();
+        samples[k] = rt_now_ns() - start;
+        samples[k] = samples[k] > expected_ns ? samples[k] - expected_ns : 0;
+        total += samples[k];
+    }
+    qsort(samples, count, sizeof(*samples), rt_compare);
+
+    latency->count = count;
+    latency->min_ns = samples[0];
+    latency->p50_ns = rt_percentile(samples, count, 0.50);
+    latency->p90_ns = rt_percentile(samples, count, 0.90);
+    latency->p99_ns = rt_percentile(samples, count, 0.99);
+    latency->p999_ns = rt_percentile(samples, count, 0.999);
+    latency->max_ns = samples[count - 1];
+    latency->mean_ns = (double)total / count;
+
+    free(samples);
+    return 0;
+}
+
+void rt_print_latency_header(FILE *fp, const char *title)
+{
+    fprintf(fp, "%-16s %8s %9s %9s %9s %9s %9s %9s %9s\n", title, "count",
+        "min", "p50", "p90", "p99", "p99.9", "max", "mean");
+}
+
+void rt_print_latency(FILE *fp, const char *label, const struct rt_latency *latency)
+{
+    fprintf(fp, "%-16s %8u %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", label, latency->count,
+        latency->min_ns / 1000.0, latency->p50_ns / 1000.0, latency->p90_ns / 1000.0,
+        latency->p99_ns / 1000.0, latency->p999_ns / 1000.0, latency->max_ns / 1000.0,
+        latency->mean_ns / 1000.0);
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file rt.h
+ * \brief Real-time scheduling, memory locking and CPU pinning
+ * Every bus transaction waits for the USB round trip and every REALWORLD_DELAY
+ * is a sleep, so scheduler jitter stretches the whole dump. The options put
+ * the calling thread into SCHED_FIFO, lock all memory of the process and pin
+ * the thread to a core; a latency probe measures the distribution of a
+ * transaction's duration with and without them. Real delays use a wait
+ * primitive with a high-resolution deadline and a calibrated spin tail.
+ * The helper threads of a role (post-processing workers, image writer) get
+ * cores and a priority of their own; a role's threads are spread over its
+ * cores one per core, round-robin.
+ */
+
+#ifndef RT_H
+#define RT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct rt_options
+{
+    int priority;    /* SCHED_FIFO priority, 0: normal scheduling */
+    int lock_memory; /* mlockall() current and future pages */
+    int cpu;         /* core to pin the thread to, -1: no pinning */
+};
+
+#define RT_ROLE_MAX_CPUS 64
+
+/* roles of helper threads with their own cores and priority */
+enum { RT_ROLE_WORKER = 0, RT_ROLE_WRITER, RT_ROLE_COUNT };
+
+struct rt_role
+{
+    const char *name;
+    int priority;            /* SCHED_FIFO priority, 0: normal scheduling */
+    unsigned int cpus_count; /* 0: no pinning */
+    int cpus[RT_ROLE_MAX_CPUS];
+};
+
+/* percentiles of a latency sample */
+struct rt_latency
+{
+    unsigned int count;
+    uint64_t min_ns, p50_ns, p90_ns, p99_ns, p999_ns, max_ns;
+    double mean_ns;
+};
+
+extern struct rt_options rt_options;
+extern struct rt_role rt_roles[RT_ROLE_COUNT];
+
+int rt_parse_cpu(const char *arg);
+int rt_parse_role(const char *arg);
+int rt_apply(const struct rt_options *options);
+int rt_apply_role(int role, unsigned int index);
+void rt_wait_us(unsigned int usec);
+uint64_t rt_calibrate_wait(void);
+int rt_measure(void (*transaction)(void), unsigned int count, uint64_t expected_ns, struct rt_latency *latency);
+void rt_print_latency_header(FILE *fp, const char *title);
+void rt_print_latency(FILE *fp, const char *label, const struct rt_latency *latency);
+
+#endif /* RT_H */
@@ -0,0 +1,594 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file selftest.c
+ * \brief Known-answer checks of the on-chip data formats
+ * The fuzzer (fuzz.c) checks that bytes get to the chip and back unchanged;
+ * these checks cover what the reader itself computes and lays out on the
+ * chip, where only a known answer tells right from wrong: the software
+ * Hamming ECC against the code Linux computes, and the ECC stage of the
+ * pipelined dump against pages with that code, and the bad block table
+ * against the Linux layout: a table written and read back, with its mirror,
+ * versions and 2-bit entries, also across the wrap of the version byte.
+ * Programming an image is checked with failures injected through a responder
+ * of the simulated chip: the failing blocks have to be retired and the image
+ * has to go on in the next good block. A job that does not plan, such as
+ * programming, has to leave the cost model in the chip profile store alone.
+ * Pages larger than 4 KiB with their spare area have to be addressed in full.
+ * Every check runs against a fresh simulated chip and reports its first
+ * mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nand.h"
+#include "nand_sim.h"
+#include "postproc.h"
+#include "bbt.h"
+#include "input.h"
+#include "profile.h"
+
+static const unsigned char selftest_ID_register[5] = { 0xAD, 0xDC, 0x10, 0x95, 0x54 };
+
+static char selftest_error[256];
+static FILE *report; /* stdout of the checks; the bus code prints to /dev/null unless -v */
+
+static const char *selftest_fail(const char *what, unsigned int index)
+{
+    snprintf(selftest_error, sizeof(selftest_error), "%s %u", what, index);
+    return selftest_error;
+}
+
+/* a blank simulated chip of the given number of blocks on the reader */
+static int selftest_chip(unsigned int blocks)
+{
+    struct nand_geometry geometry = nand_geometry;
+
+    geometry.blocks = blocks;
+    nand_geometry = geometry;
+    memset(&sim_faults, 0, sizeof(sim_faults));
+    bus = &sim_backend;
+    controlbus_reset_value();
+    iobus_reset_value();
+    if( sim_init(&sim_usb_profiles[0], &sim_default_timing, &geometry, selftest_ID_register) != 0 )
+        return EXIT_FAILURE;
+    iobus_set_direction(IOBUS_OUT);
+    nand_select_chip();
+    return 0;
+}
+
+/* one byte 01h in an otherwise zero ECC step, and the code that
+ * ecc_sw_hamming_calculate() in Linux computes for it without sm_order */
+static const struct
+{
+    unsigned int index;
+    unsigned char code[3];
+} ecc_vectors[] =
+{
+    { 0x00, { 0xAA, 0xAA, 0xAB } },
+    { 0x0F, { 0xAA, 0x55, 0xAB } },
+    { 0xF0, { 0x55, 0xAA, 0xAB } },
+    { 0x35, { 0xA5, 0x99, 0xAB } },
+};
+
+static const char *check_ecc_vectors(void)
+{
+    unsigned char data[NAND_ECC_STEP], code[3];
+
+    memset(data, 0xFF, sizeof(data));
+    nand_ecc_hamming(data, code);
+    if( code[0] != 0xFF || code[1] != 0xFF || code[2] != 0xFF )
+        return "an erased step does not have an erased ECC";
+    for(unsigned int k = 0; k < sizeof(ecc_vectors) / sizeof(ecc_vectors[0]); k++)
+    {
+        memset(data, 0, sizeof(data));
+        data[ecc_vectors[k].index] = 0x01;
+        nand_ecc_hamming(data, code);
+        if( memcmp(code, ecc_vectors[k].code, 3) != 0 )
+            return selftest_fail("ECC differs from the Linux code, 01h at byte", ecc_vectors[k].index);
+    }
+    return NULL;
+}
+
+/* a page as Linux writes it: every ECC step one of the vectors, and its code
+ * from the table in the last bytes of the spare area */
+static void ecc_vector_page(unsigned char *page)
+{
+    unsigned int steps = nand_geometry.page_size / NAND_ECC_STEP;
+    unsigned char *code = page + nand_geometry.page_size + nand_geometry.spare_size - 3 * steps;
+
+    memset(page, 0, nand_geometry.page_size);
+    memset(page + nand_geometry.page_size, 0xFF, nand_geometry.spare_size);
+    for(unsigned int k = 0; k < steps; k++)
+    {
+        unsigned int v = k % (sizeof(ecc_vectors) / sizeof(ecc_vectors[0]));
+
+        page[k * NAND_ECC_STEP + ecc_vectors[v].index] = 0x01;
+        memcpy(code + 3 * k, ecc_vectors[v].code, 3);
+    }
+}
+
+/* the ECC stage of the pipelined dump on a clean page with the Linux code, one
+ * with a data bitflip, one with two bitflips in a step, one with a flip in the
+ * ECC itself and a page filled by nand_ecc_page() */
+static const char *check_ecc_stage(void)
+{
+    unsigned char *page = malloc(nand_page_size_total());
+    struct postproc_stats stats;
+    struct postproc *pp;
+    int ret = 0;
+
+    if( page == NULL )
+        return "out of memory";
+    for(unsigned int k = 0; k < 5; k++)
+    {
+        ecc_vector_page(page);
+        if( k == 1 || k == 2 )
+            page[3 * NAND_ECC_STEP + 17] ^= 0x20;
+        if( k == 2 )
+            page[3 * NAND_ECC_STEP + 200] ^= 0x01;
+        if( k == 3 )
+            page[nand_geometry.page_size + nand_geometry.spare_size - 1] ^= 0x80;
+        if( k == 4 )
+        {
+            for(unsigned int i = 0; i < nand_geometry.page_size; i++)
+                page[i] = (unsigned char)(i * 31 + (i >> 8));
+            nand_ecc_page(page);
+        }
+        ret |= program_page(k, page);
+    }
+    free(page);
+    if( ret != 0 )
+        return "pages could not be programmed";
+
+    pp = postproc_create(1, POSTPROC_ECC, NULL, NULL, NULL);
+    if( pp == NULL )
+        return "pipeline could not be created";
+    ret = postproc_dump_range(pp, 0, 5);
+    if( postproc_finish(pp, &stats) != 0 || ret != 0 )
+        return "pipelined dump failed";
+    if( stats.ecc_failed != 1 )
+        return selftest_fail("uncorrectable pages, expected 1:", (unsigned int)stats.ecc_failed);
+    if( stats.ecc_corrected != 2 )
+        return selftest_fail("corrected bitflips, expected 2:", (unsigned int)stats.ecc_corrected);
+    return NULL;
+}
+
+/* the 2-bit entry of block in the table of the copy in table_block */
+static int bbt_entry(unsigned int table_block, unsigned int block)
+{
+    unsigned char *page = malloc(nand_page_size_total());
+    int code = -1;
+
+    if( page && read_page(table_block * nand_geometry.pages_per_block, page) == 0 )
+        code = (page[block / 4] >> (2 * (block % 4))) & 0x03;
+    free(page);
+    return code;
+}
+
+/* signature and version of the copy in block: 0 table, 1 mirror, -1 neither */
+static int bbt_copy(unsigned int block, unsigned char *version)
+{
+    unsigned char *page = malloc(nand_page_size_total());
+    int which = -1;
+
+    if( page && read_page(block * nand_geometry.pages_per_block, page) == 0 )
+    {
+        const unsigned char *spare = page + nand_geometry.page_size;
+
+        if( memcmp(spare + BBT_PATTERN_OFFSET, "Bbt0", 4) == 0 )
+            which = 0;
+        else if( memcmp(spare + BBT_PATTERN_OFFSET, "1tbB", 4) == 0 )
+            which = 1;
+        *version = spare[BBT_VERSION_OFFSET];
+    }
+    free(page);
+    return which;
+}
+
+/* a marker scan of a chip with a factory bad block, a table written with a
+ * worn out block and read back, a second version into the same blocks and
+ * the mirror taking over when the table is gone */
+static const char *check_bbt_table(void)
+{
+    unsigned int last = nand_geometry.blocks - 1;
+    unsigned char *page = malloc(nand_page_size_total());
+    struct bad_block_table bbt, read;
+    unsigned char version;
+    const char *error = NULL;
+
+    if( page == NULL )
+        return "out of memory";
+    memset(page, 0xFF, nand_page_size_total());
+    page[nand_geometry.page_size] = 0x00;
+    program_page(3 * nand_geometry.pages_per_block, page);
+    free(page);
+
+    if( bbt_load(&bbt) != 0 )
+        return "marker scan failed";
+    if( bbt.from_flash || bbt.state[3] != BBT_BLOCK_FACTORY_BAD || bbt.state[2] != BBT_BLOCK_GOOD )
+        error = "marker scan missed the factory bad block";
+    for(unsigned int k = 0; error == NULL && k < BBT_SEARCH_BLOCKS; k++)
+        if( bbt.state[last - k] != BBT_BLOCK_RESERVED )
+            error = selftest_fail("search area not reserved after the scan, block", last - k);
+    bbt_mark(&bbt, 5, BBT_BLOCK_WORN);
+    if( error == NULL && bbt_write(&bbt) != 0 )
+        error = "table could not be written";
+    if( error )
+    {
+        bbt_free(&bbt);
+        return error;
+    }
+
+    if( bbt.block[0] < 0 || bbt.block[1] < 0 || bbt.block[0] == bbt.block[1] )
+        error = "table and mirror not in two blocks";
+    else if( bbt_copy(bbt.block[0], &version) != 0 || version != 1 )
+        error = "table signature or version 1 missing";
+    else if( bbt_copy(bbt.block[1], &version) != 1 || version != 1 )
+        error = "mirror signature or version 1 missing";
+    else if( bbt_entry(bbt.block[0], 3) != 0x00 || bbt_entry(bbt.block[0], 5) != 0x02
+        || bbt_entry(bbt.block[0], 4) != 0x03 || bbt_entry(bbt.block[1], 5) != 0x02
+        || bbt_entry(bbt.block[0], last) != 0x00 )
+        error = "2-bit entries differ from the Linux layout";
+    else if( bbt_read(&read) != 0 )
+        error = "table could not be read back";
+    else
+    {
+        if( !read.from_flash || read.version != 1 || read.state[3] != BBT_BLOCK_FACTORY_BAD
+            || read.state[5] != BBT_BLOCK_WORN || read.state[4] != BBT_BLOCK_GOOD
+            || read.state[last] != BBT_BLOCK_RESERVED )
+            error = "table read back differs";
+        else if( bbt_write(&read) != 0 || read.block[0] != bbt.block[0] || read.block[1] != bbt.block[1]
+            || bbt_copy(bbt.block[0], &version) != 0 || version != 2 )
+            error = "version 2 not written over version 1";
+        bbt_free(&read);
+    }
+    if( error == NULL && erase_block(bbt.block[0]) != 0 )
+        error = "table block could not be erased";
+    if( error == NULL && (bbt_read(&read) != 0 || read.version != 2 || read.state[5] != BBT_BLOCK_WORN) )
+        error = "mirror did not take over";
+    else if( error == NULL )
+        bbt_free(&read);
+    bbt_free(&bbt);
+    return error;
+}
+
+/* copies of version 255 and a table of version 0 next to the mirror of
+ * version 255: the table is the newer one, it lists block 6 as worn out */
+static const char *check_bbt_version_wrap(void)
+{
+    unsigned char *page = malloc(nand_page_size_total());
+    struct bad_block_table bbt, read;
+    const char *error = NULL;
+    unsigned int first;
+
+    if( page == NULL )
+        return "out of memory";
+    if( bbt_load(&bbt) != 0 )
+    {
+        free(page);
+        return "marker scan failed";
+    }
+    bbt.version = 254;
+    if( bbt_write(&bbt) != 0 || bbt.version != 255 )
+        error = "version 255 not written";
+    else
+    {
+        first = (unsigned int)bbt.block[0] * nand_geometry.pages_per_block;
+        if( read_page(first, page) != 0 || erase_block(bbt.block[0]) != 0 )
+            error = "table could not be rewritten";
+        page[6 / 4] &= ~(0x01 << (2 * (6 % 4)));
+        page[nand_geometry.page_size + BBT_VERSION_OFFSET] = 0;
+        nand_ecc_page(page);
+        if( error == NULL && program_page(first, page) != 0 )
+            error = "table could not be rewritten";
+    }
+    if( error == NULL && bbt_read(&read) != 0 )
+        error = "table could not be read back";
+    else if( error == NULL )
+    {
+        if( read.version != 0 || read.state[6] != BBT_BLOCK_WORN )
+            error = selftest_fail("version 255 taken over version 0, read version", read.version);
+        bbt_free(&read);
+    }
+    bbt_free(&bbt);
+    free(page);
+    return error;
+}
+
+/* the erase of one block and the program of one page report a failure */
+static struct
+{
+    unsigned int erase_block;
+    unsigned int program_page;
+} failing;
+
+static int failing_page_read(uint32_t row, unsigned char *data, unsigned int size, unsigned int *busy_ns)
+{
+    (void)row; (void)data; (void)size; (void)busy_ns;
+    return 0;
+}
+
+static int failing_status(unsigned char command, uint32_t row, unsigned char *status, unsigned int *busy_ns)
+{
+    (void)busy_ns;
+    *status = STATUSREG_IO0;
+    return (command == 0xD0 && row / nand_geometry.pages_per_block == failing.erase_block)
+        || (command == 0x10 && row == failing.program_page);
+}
+
+static const struct sim_responder failing_responder = { failing_page_read, failing_status };
+
+/* the first spare byte is FFh, as in any image of good blocks */
+static unsigned char image_byte(unsigned int page, unsigned int k)
+{
+    return k == nand_geometry.page_size ? 0xFF : (unsigned char)(page * 13 + k * 7 + (k >> 8));
+}
+
+/* an image of four blocks programmed with a table: the erase of block 1 and a
+ * program in block 2 fail. Both blocks are retired (worn out, 10 in the table,
+ * marker in the spare area), block 3 still gets its part of the image, and
+ * the marker only clears the first spare byte of the pages written before */
+static const char *check_program_retire(void)
+{
+    unsigned int pages_per_block = nand_geometry.pages_per_block, size = nand_page_size_total();
+    char path[] = "/tmp/nand_selftest_XXXXXX";
+    unsigned char *page = malloc(size);
+    struct bad_block_table bbt;
+    const char *error = NULL;
+    int fd = mkstemp(path);
+    FILE *image = fd >= 0 ? fdopen(fd, "w") : NULL;
+    int ret;
+
+    if( page == NULL || image == NULL )
+    {
+        free(page);
+        if( fd >= 0 )
+            unlink(path);
+        return "image could not be created";
+    }
+    for(unsigned int p = 0; p < 4 * pages_per_block; p++)
+    {
+        for(unsigned int k = 0; k < size; k++)
+            page[k] = image_byte(p, k);
+        fwrite(page, 1, size, image);
+    }
+    fclose(image);
+
+    failing.erase_block = 1;
+    failing.program_page = 2 * pages_per_block + 5;
+    if( bbt_load(&bbt) != 0 )
+        error = "marker scan failed";
+    else
+    {
+        sim_responder = &failing_responder;
+        ret = program_image(path, 0, &bbt);
+        sim_responder = NULL;
+        if( ret == 0 )
+            error = "failures not reported";
+        else if( bbt.state[0] != BBT_BLOCK_GOOD || bbt.state[1] != BBT_BLOCK_WORN
+            || bbt.state[2] != BBT_BLOCK_WORN || bbt.state[3] != BBT_BLOCK_GOOD )
+            error = "failed blocks not retired in the table";
+        else if( is_factory_bad_block(0) || !is_factory_bad_block(1) || !is_factory_bad_block(2)
+            || is_factory_bad_block(3) )
+            error = "bad block markers not written";
+        else if( bbt_write(&bbt) != 0 || bbt_entry(bbt.block[0], 1) != 0x02 || bbt_entry(bbt.block[0], 2) != 0x02
+            || bbt_entry(bbt.block[0], 3) != 0x03 )
+            error = "retired blocks not 10 in the written table";
+        bbt_free(&bbt);
+    }
+    unlink(path);
+
+    for(unsigned int p = 0; error == NULL && p < 4 * pages_per_block; p++)
+    {
+        unsigned int block = p / pages_per_block, offset = p % pages_per_block;
+
+        if( block == 1 || (block == 2 && offset > 5) )
+            continue;
+        if( read_page(p, page) != 0 )
+            error = selftest_fail("page could not be read:", p);
+        for(unsigned int k = 0; error == NULL && k < size; k++)
+        {
+            unsigned char expected = image_byte(p, k);
+
+            if( block == 2 && offset < 2 && k == nand_geometry.page_size )
+                expected = 0x00;
+            if( page[k] != expected )
+                error = selftest_fail("image differs on the chip in page", p);
+        }
+    }
+    for(unsigned int p = 2 * pages_per_block + 6; error == NULL && p < 3 * pages_per_block; p++)
+    {
+        if( read_page(p, page) != 0 )
+            error = selftest_fail("page could not be read:", p);
+        for(unsigned int k = 0; error == NULL && k < size; k++)
+            if( page[k] != 0xFF )
+                error = selftest_fail("page of a retired block programmed:", p);
+    }
+    free(page);
+    return error;
+}
+
+/* the model line of the store, empty if there is none */
+static void profile_model_line(const char *path, char *line, size_t size)
+{
+    FILE *fp = fopen(path, "r");
+    char buffer[256];
+
+    line[0] = '\0';
+    while( fp && fgets(buffer, sizeof(buffer), fp) )
+        if( strncmp(buffer, "model ", 6) == 0 )
+            snprintf(line, size, "%s", buffer);
+    if( fp )
+        fclose(fp);
+}
+
+/* a chip identified and stored with its model, then found again by a
+ * programming job (-w -c), which stores the entry without a model of its own */
+static const char *check_profile_keep_model(void)
+{
+    char path[] = "/tmp/nand_selftest_XXXXXX";
+    char before[256], after[256];
+    struct chip_profile profile;
+    const char *error = NULL;
+    int fd = mkstemp(path);
+
+    if( fd < 0 )
+        return "profile store could not be created";
+    close(fd);
+
+    if( profile_identify(&profile, selftest_ID_register) != 0 )
+        error = "chip could not be identified";
+    else
+    {
+        plan_default_model(&profile.model, "selftest");
+        profile.model.transfer_ns = 12345.6;
+        profile.model.runs = 7;
+        if( profile_store(path, &profile, &profile.model) != 0 )
+            error = "profile could not be stored";
+    }
+    profile_model_line(path, before, sizeof(before));
+    if( error == NULL && strstr(before, "selftest 12345.6") == NULL )
+        error = "model line not stored";
+    if( error == NULL && profile_find(path, selftest_ID_register, &profile) != 0 )
+        error = "stored profile not found";
+    else if( error == NULL )
+    {
+        if( profile_store(path, &profile, NULL) != 0 )
+            error = "profile could not be stored again";
+        profile_model_line(path, after, sizeof(after));
+        if( error == NULL && strcmp(before, after) != 0 )
+            error = "a job without a model changed the stored model";
+    }
+    unlink(path);
+    return error;
+}
+
+/* a chip with 4096 + 224 byte pages: the spare area starts at column 4096,
+ * which needs a 13th column address bit, and the parameter page has to give
+ * the address cycles of the geometry and be rejected with more row cycles
+ * than the bus sequences latch */
+static const char *check_address_cycles(void)
+{
+    struct nand_geometry saved = nand_geometry, parsed;
+    unsigned char parameter_page[ONFI_PARAM_PAGE_SIZE];
+    unsigned char marker = 0x5A;
+    unsigned char *page = malloc(4096 + 224);
+    unsigned int features;
+    uint16_t crc;
+    const char *error = NULL;
+
+    nand_geometry.page_size = 4096;
+    nand_geometry.spare_size = 224;
+    nand_geometry.column_cycles = 0;
+    nand_geometry.row_cycles = 0;
+    if( page == NULL || selftest_chip(16) != 0 )
+        error = "simulated chip not available";
+    else if( program_page_part(5, 4096, &marker, 1) != 0 || read_page(5, page) != 0 )
+        error = "spare area could not be programmed";
+    else if( page[0] != 0xFF || page[4096] != marker )
+        error = "spare area byte not at column 4096";
+    else if( read_valid_parameter_page(parameter_page) != 0 ||
+        parse_parameter_page(parameter_page, &parsed, &features) != 0 )
+        error = "parameter page of the geometry rejected";
+    else if( parsed.column_cycles != 2 || parsed.row_cycles != nand_row_cycles(&nand_geometry) )
+        error = "address cycles of the parameter page";
+    else
+    {
+        parameter_page[101] = 0x2F;
+        crc = onfi_crc16(parameter_page, ONFI_PARAM_PAGE_SIZE - 2);
+        parameter_page[ONFI_PARAM_PAGE_SIZE - 2] = (unsigned char)crc;
+        parameter_page[ONFI_PARAM_PAGE_SIZE - 1] = (unsigned char)(crc >> 8);
+        if( parse_parameter_page(parameter_page, &parsed, &features) == 0 )
+            error = "parameter page with 15 row cycles adopted";
+    }
+    free(page);
+    nand_geometry = saved;
+    return error;
+}
+
+static const struct
+{
+    const char *name;
+    unsigned int blocks; /* of the simulated chip */
+    const char *(*run)(void);
+} checks[] =
+{
+    { "ecc-vectors",          4, check_ecc_vectors },
+    { "ecc-stage",            4, check_ecc_stage },
+    { "bbt-table",           16, check_bbt_table },
+    { "bbt-version-wrap",    16, check_bbt_version_wrap },
+    { "program-retire",      16, check_program_retire },
+    { "profile-keep-model",  16, check_profile_keep_model },
+    { "address-cycles",      16, check_address_cycles },
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [CHECK...]\n"
+        "  -v         keep the messages of the bus code\n"
+        "  CHECK      run only the named checks\n",
+        name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int count = sizeof(checks) / sizeof(checks[0]), run = 0, failures = 0;
+    int opt, details = 0;
+
+    while( (opt = getopt(argc, argv, "vh")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'v': details = 1; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    verbose = details;
+    sim_timing_report_max = 0;
+    /* the bus code and the table code report on stdout and stderr as well */
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if( report == NULL )
+        return EXIT_FAILURE;
+    if( !details && (freopen("/dev/null", "w", stderr) == NULL || freopen("/dev/null", "w", stdout) == NULL) )
+        return EXIT_FAILURE;
+
+    for(unsigned int k = 0; k < count; k++)
+    {
+        const char *error;
+        int selected = optind == argc;
+
+        for(int a = optind; a < argc; a++)
+            selected |= strcmp(argv[a], checks[k].name) == 0;
+        if( !selected )
+            continue;
+        run++;
+        error = selftest_chip(checks[k].blocks) != 0 ? "simulated chip not available" : checks[k].run();
+        sim_free();
+        if( error )
+            failures++;
+        fflush(stdout);
+        fprintf(report, "%s %s%s%s\n", error ? "FAIL" : "ok  ", checks[k].name, error ? ": " : "", error ? error : "");
+    }
+
+    fprintf(report, "%u of %u checks failed\n", failures, run);
+    fclose(report);
+    return failures ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file trace.c
+ * \brief Protocol trace recorder with VCD export
+ * Timestamps come from the bus backend clock (virtual time for the simulated
+ * reader). In TRACE_ON_ERROR mode the ring keeps running until an error is
+ * triggered; half a ring later the window around the error is written to
+ * <path>-NNN.vcd and recording continues.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nand.h"
+#include "trace.h"
+
+#define TRACE_DEFAULT_ENTRIES_LOG2 20 /* 1 Mi entries, 16 MiB */
+
+trace_mode_t trace_mode = TRACE_OFF;
+
+static struct
+{
+    struct trace_entry *entries;
+    uint64_t mask;
+    uint64_t count;       /* number of entries recorded so far */
+    const char *path;
+    int trigger_pending;
+    uint64_t trigger_end; /* count at which the window after an error is complete */
+    unsigned int dumps;
+} trace;
+
+/* VCD identifiers of the traced signals */
+static const struct
+{
+    unsigned char pin;
+    const char *name;
+    char id;
+} controlbus_signals[] =
+{
+    { PIN_CLE, "CLE", '!' },
+    { PIN_ALE, "ALE", '"' },
+    { PIN_nCE, "nCE", '#' },
+    { PIN_nWE, "nWE", '$' },
+    { PIN_nRE, "nRE", '%' },
+    { PIN_nWP, "nWP", '&' },
+    { PIN_LED, "LED", '\'' },
+};
+#define VCD_ID_RDY     '('
+#define VCD_ID_IO_OUT  ')'
+#define VCD_ID_IO_IN   '*'
+#define VCD_ID_IO_DIR  '+'
+#define VCD_ID_ERROR   '-'
+
+int trace_init(trace_mode_t mode, const char *path, unsigned int entries_log2)
+{
+    if( entries_log2 == 0 )
+        entries_log2 = TRACE_DEFAULT_ENTRIES_LOG2;
+
+    memset(&trace, 0, sizeof(trace));
+    trace.entries = malloc(sizeof(struct trace_entry) << entries_log2);
+    if( trace.entries == NULL )
+    {
+        fprintf(stderr, "Failed to allocate the trace buffer.\n");
+        trace_mode = TRACE_OFF;
+        return EXIT_FAILURE;
+    }
+    trace.mask = ((uint64_t)1 << entries_log2) - 1;
+    trace.path = path;
+    trace_mode = mode;
+    return 0;
+}
+
+static void trace_write_window(void)
+{
+    char path[4096];
+
+    trace.dumps++;
+    snprintf(path, sizeof(path), "%s-%03u.vcd", trace.path, trace.dumps);
+    if( trace_write_vcd(path) == 0 )
+        fprintf(stderr, "trace around error written to %s\n", path);
+    trace.trigger_pending = 0;
+}
+
+void trace_record_entry(trace_event_t event, unsigned char value)
+{
+    struct trace_entry *entry = &trace.entries[trace.count & trace.mask];
+
+    entry->time_ns = bus->now_ns();
+    entry->event = event;
+    entry->value = value;
+    trace.count++;
+
+    if( trace.trigger_pending && trace.count >= trace.trigger_end )
+        trace_write_window();
+}
+
+void trace_trigger(void)
+{
+    if( trace_mode == TRACE_OFF )
+        return;
+
+    trace_record_entry(TRACE_ERROR, 1);
+    if( trace_mode == TRACE_ON_ERROR && !trace.trigger_pending )
+    {
+        trace.trigger_pending = 1;
+        trace.trigger_end = trace.count + (trace.mask + 1) / 2;
+    }
+}
+
+static void vcd_write_byte(FILE *fp, unsigned char value, char id)
+{
+    char bits[9];
+
+    for(int k = 0; k < 8; k++)
+        bits[k] = (value & (0x80 >> k)) ? '1' : '0';
+    bits[8] = '\0';
+    fprintf(fp, "b%s %c\n", bits, id);
+}
+
+int trace_write_vcd(const char *path)
+{
+    FILE *fp;
+    uint64_t first, time_base, time_last = 0;
+    int controlbus_known = 0, rdy_known = 0;
+    unsigned char controlbus = 0, rdy = 0;
+
+    if( trace.entries == NULL || trace.count == 0 )
+        return EXIT_FAILURE;
+
+    fp = fopen(path, "w");
+    if( fp == NULL )
+    {
+        fprintf(stderr, "unable to open trace file %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(fp, "$version ftdi-nand-flash-reader protocol trace $end\n");
+    fprintf(fp, "$timescale 1ns $end\n");
+    fprintf(fp, "$scope module nand $end\n");
+    for(unsigned int k = 0; k < sizeof(controlbus_signals) / sizeof(controlbus_signals[0]); k++)
+        fprintf(fp, "$var wire 1 %c %s $end\n", controlbus_signals[k].id, controlbus_signals[k].name);
+    fprintf(fp, "$var wire 1 %c RDY $end\n", VCD_ID_RDY);
+    fprintf(fp, "$var wire 8 %c IO_out $end\n", VCD_ID_IO_OUT);
+    fprintf(fp, "$var wire 8 %c IO_in $end\n", VCD_ID_IO_IN);
+    fprintf(fp, "$var wire 1 %c IO_dir_out $end\n", VCD_ID_IO_DIR);
+    fprintf(fp, "$var event 1 %c error $end\n", VCD_ID_ERROR);
+    fprintf(fp, "$upscope $end\n$enddefinitions $end\n");
+
+    first = trace.count > trace.mask + 1 ? trace.count - (trace.mask + 1) : 0;
+    time_base = trace.entries[first & trace.mask].time_ns;
+
+    fprintf(fp, "#0\n$dumpvars\n");
+    for(unsigned int k = 0; k < sizeof(controlbus_signals) / sizeof(controlbus_signals[0]); k++)
+        fprintf(fp, "x%c\n", controlbus_signals[k].id);
+    fprintf(fp, "x%c\nbxxxxxxxx %c\nbxxxxxxxx %c\nx%c\n$end\n",
+        VCD_ID_RDY, VCD_ID_IO_OUT, VCD_ID_IO_IN, VCD_ID_IO_DIR);
+
+    for(uint64_t n = first; n < trace.count; n++)
+    {
+        const struct trace_entry *entry = &trace.entries[n & trace.mask];
+        uint64_t t = entry->time_ns - time_base;
+
+        if( t != time_last )
+        {
+            fprintf(fp, "#%llu\n", (unsigned long long)t);
+            time_last = t;
+        }
+
+        switch( entry->event )
+        {
+            case TRACE_CONTROLBUS_OUT:
+                for(unsigned int k = 0; k < sizeof(controlbus_signals) / sizeof(controlbus_signals[0]); k++)
+                {
+                    unsigned char pin = controlbus_signals[k].pin;
+                    if( !controlbus_known || ((controlbus ^ entry->value) & pin) )
+                        fprintf(fp, "%c%c\n", (entry->value & pin) ? '1' : '0', controlbus_signals[k].id);
+                }
+                controlbus = entry->value;
+                controlbus_known = 1;
+                break;
+            case TRACE_CONTROLBUS_IN:
+                if( !rdy_known || ((rdy ^ entry->value) & PIN_RDY) )
+                    fprintf(fp, "%c%c\n", (entry->value & PIN_RDY) ? '1' : '0', VCD_ID_RDY);
+                rdy = entry->value;
+                rdy_known = 1;
+                break;
+            case TRACE_IOBUS_OUT:
+                vcd_write_byte(fp, entry->value, VCD_ID_IO_OUT);
+                break;
+            case TRACE_IOBUS_IN:
+                vcd_write_byte(fp, entry->value, VCD_ID_IO_IN);
+                break;
+            case TRACE_IOBUS_DIR:
+                fprintf(fp, "%c%c\n", entry->value ? '1' : '0', VCD_ID_IO_DIR);
+                break;
+            case TRACE_ERROR:
+                fprintf(fp, "1%c\n", VCD_ID_ERROR);
+                break;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+void trace_finish(void)
+{
+    if( trace_mode == TRACE_CONTINUOUS )
+    {
+        if( trace_write_vcd(trace.path) == 0 )
+            fprintf(stderr, "trace written to %s\n", trace.path);
+    }
+    else if( trace_mode == TRACE_ON_ERROR && trace.trigger_pending )
+        trace_write_window();
+
+    trace_mode = TRACE_OFF;
+    free(trace.entries);
+    trace.entries = NULL;
+}
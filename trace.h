@@ -0,0 +1,69 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file trace.h
+ * \brief Protocol trace recorder with VCD export
+ * Every pin state written to the control and I/O bus and every sampled input
+ * is recorded into a fixed size ring buffer, which can be exported as a VCD
+ * file (e.g. for GTKWave). When disabled, recording costs one predictable
+ * branch; when enabled, memory is bounded by the ring size.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    TRACE_CONTROLBUS_OUT = 0, /* pin states written to the control bus */
+    TRACE_IOBUS_OUT,          /* value written to the I/O bus */
+    TRACE_IOBUS_DIR,          /* I/O bus direction (1: output) */
+    TRACE_CONTROLBUS_IN,      /* sampled control bus (incl. RDY) */
+    TRACE_IOBUS_IN,           /* sampled I/O bus */
+    TRACE_ERROR               /* error marker */
+} trace_event_t;
+
+typedef enum
+{
+    TRACE_OFF = 0,
+    TRACE_CONTINUOUS, /* keep the last entries, export on trace_finish() */
+    TRACE_ON_ERROR    /* export a window around every error only */
+} trace_mode_t;
+
+struct trace_entry
+{
+    uint64_t time_ns;
+    uint8_t event;
+    uint8_t value;
+};
+
+extern trace_mode_t trace_mode;
+
+int trace_init(trace_mode_t mode, const char *path, unsigned int entries_log2);
+void trace_record_entry(trace_event_t event, unsigned char value);
+void trace_trigger(void);
+int trace_write_vcd(const char *path);
+void trace_finish(void);
+
+static inline void trace_record(trace_event_t event, unsigned char value)
+{
+    if( trace_mode != TRACE_OFF )
+        trace_record_entry(event, value);
+}
+
+#endif /* TRACE_H */
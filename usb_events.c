@@ -0,0 +1,193 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file usb_events.c
+ * \brief Shared libusb event-handling thread (see usb_events.h)
+ * libftdi marks an asynchronous transfer completed from its libusb callback,
+ * which runs inside the event thread. After every round of event handling the
+ * thread takes the completed transfer of each device and wakes its writer;
+ * ftdi_transfer_data_done() then only collects the result. A device has at
+ * most one transfer in flight (see usb_events.h).
+ * Synchronous libusb calls (control transfers such as ftdi_read_pins()) keep
+ * working: libusb lets them wait for the event thread instead of handling
+ * events themselves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ftdi.h>
+#include <libusb.h>
+#include "rt.h"
+#include "usb_events.h"
+
+#define USB_EVENTS_MAX_DEVICES 8
+#define USB_EVENTS_TIMEOUT_US  100000 /* wake-up to check for shutdown */
+
+struct usb_event_transfer
+{
+    struct ftdi_transfer_control *tc;
+    int done;
+};
+
+struct usb_event_device
+{
+    struct ftdi_context *ftdi;
+    struct libusb_context *own_ctx; /* context of the ftdi context, restored on detach */
+    struct usb_event_transfer *pending; /* the write in flight, NULL if none */
+    pthread_cond_t completed;
+    int attached;
+};
+
+static struct
+{
+    libusb_context *ctx;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    volatile int running;
+    struct usb_event_device devices[USB_EVENTS_MAX_DEVICES];
+} events = { NULL, 0, PTHREAD_MUTEX_INITIALIZER, 0 };
+
+/* takes the completed writes off their devices and wakes the writers */
+static void usb_events_deliver(void)
+{
+    pthread_mutex_lock(&events.lock);
+    for(unsigned int d = 0; d < USB_EVENTS_MAX_DEVICES; d++)
+    {
+        struct usb_event_device *device = &events.devices[d];
+
+        if( device->pending && device->pending->tc->completed )
+        {
+            device->pending->done = 1;
+            device->pending = NULL;
+            pthread_cond_broadcast(&device->completed);
+        }
+    }
+    pthread_mutex_unlock(&events.lock);
+}
+
+static void *usb_events_thread(void *arg)
+{
+    struct rt_options thread_options = { rt_options.priority, 0, -1 };
+    struct timeval tv;
+
+    (void)arg;
+    rt_apply(&thread_options);
+    while( events.running )
+    {
+        tv.tv_sec = 0;
+        tv.tv_usec = USB_EVENTS_TIMEOUT_US;
+        libusb_handle_events_timeout_completed(events.ctx, &tv, NULL);
+        usb_events_deliver();
+    }
+    return NULL;
+}
+
+/* creates the shared libusb context and starts the event thread (with the
+ * SCHED_FIFO priority of the real-time options, if any) */
+int usb_events_start(void)
+{
+    if( libusb_init(&events.ctx) != 0 )
+    {
+        fprintf(stderr, "libusb_init failed\n");
+        return EXIT_FAILURE;
+    }
+    for(unsigned int d = 0; d < USB_EVENTS_MAX_DEVICES; d++)
+        pthread_cond_init(&events.devices[d].completed, NULL);
+
+    events.running = 1;
+    if( pthread_create(&events.thread, NULL, usb_events_thread, NULL) != 0 )
+    {
+        fprintf(stderr, "unable to start the USB event thread\n");
+        events.running = 0;
+        libusb_exit(events.ctx);
+        events.ctx = NULL;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+/* moves an ftdi context onto the shared libusb context; call before ftdi_usb_open() */
+struct usb_event_device *usb_events_attach(struct ftdi_context *ftdi)
+{
+    struct usb_event_device *device = NULL;
+
+    pthread_mutex_lock(&events.lock);
+    for(unsigned int d = 0; d < USB_EVENTS_MAX_DEVICES && device == NULL; d++)
+        if( !events.devices[d].attached )
+            device = &events.devices[d];
+    if( device )
+    {
+        device->ftdi = ftdi;
+        device->own_ctx = ftdi->usb_ctx;
+        device->pending = NULL;
+        device->attached = 1;
+        ftdi->usb_ctx = events.ctx;
+    }
+    pthread_mutex_unlock(&events.lock);
+
+    if( device == NULL )
+        fprintf(stderr, "too many devices on the USB event thread\n");
+    return device;
+}
+
+/* submits the write and waits until the event thread delivers its completion
+ * (one writer per device); returns the number of bytes written or a negative
+ * value on error */
+int usb_events_write(struct usb_event_device *device, unsigned char *buf, int size)
+{
+    struct usb_event_transfer transfer = { NULL, 0 };
+
+    pthread_mutex_lock(&events.lock);
+    transfer.tc = ftdi_write_data_submit(device->ftdi, buf, size);
+    if( transfer.tc == NULL )
+    {
+        pthread_mutex_unlock(&events.lock);
+        return -1;
+    }
+    device->pending = &transfer;
+
+    while( !transfer.done )
+        pthread_cond_wait(&device->completed, &events.lock);
+    pthread_mutex_unlock(&events.lock);
+
+    /* already completed: only collects the result and frees the transfer */
+    return ftdi_transfer_data_done(transfer.tc);
+}
+
+/* gives the ftdi context its own libusb context back; call after ftdi_usb_close() */
+void usb_events_detach(struct usb_event_device *device)
+{
+    if( device == NULL )
+        return;
+    pthread_mutex_lock(&events.lock);
+    device->ftdi->usb_ctx = device->own_ctx;
+    device->attached = 0;
+    pthread_mutex_unlock(&events.lock);
+}
+
+void usb_events_stop(void)
+{
+    if( !events.running )
+        return;
+    events.running = 0;
+    libusb_interrupt_event_handler(events.ctx);
+    pthread_join(events.thread, NULL);
+    libusb_exit(events.ctx);
+    events.ctx = NULL;
+}
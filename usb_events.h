@@ -0,0 +1,43 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file usb_events.h
+ * \brief Shared libusb event-handling thread for all open FTDI channels
+ * Every attached ftdi context is moved onto one libusb context whose events are
+ * handled by a dedicated thread. A write is submitted asynchronously and the
+ * event thread reaps its completion, so the bus code never runs the libusb
+ * event loop inside libftdi; any number of channels and readers share the one
+ * loop. The writer still waits for its completion: the channels are separate
+ * endpoints, and a write left in flight could reach the pins after a later
+ * write on the other channel (the nWE edge that latches the I/O bus) or after
+ * a pin read.
+ */
+
+#ifndef USB_EVENTS_H
+#define USB_EVENTS_H
+
+#include <ftdi.h>
+
+struct usb_event_device;
+
+int usb_events_start(void);
+struct usb_event_device *usb_events_attach(struct ftdi_context *ftdi);
+int usb_events_write(struct usb_event_device *device, unsigned char *buf, int size);
+void usb_events_detach(struct usb_event_device *device);
+void usb_events_stop(void);
+
+#endif /* USB_EVENTS_H */
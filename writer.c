@@ -0,0 +1,502 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file writer.c
+ * \brief Asynchronous image writer (see writer.h)
+ * Submitters fill the submission ring under the writer lock; a reaper thread
+ * waits in io_uring_enter() for completions and runs the callbacks, so a
+ * buffer is released as soon as the kernel is done with it. The writer
+ * thread of the fallback takes the requests from a FIFO instead.
+ * An unaligned write on an O_DIRECT image (the last partial batch) waits
+ * until nothing is in flight and switches the image to buffered I/O.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "arena.h"
+#include "output.h"
+#include "rt.h"
+#include "writer.h"
+
+#define WRITER_STOP  (~0ull) /* user_data of the NOP that ends the reaper */
+#define WRITER_SLOTS (WRITER_DEPTH + 1) /* plus a checkpoint sync */
+
+struct writer_request
+{
+    int busy;
+    int sync;
+    const unsigned char *data;
+    size_t length;
+    uint64_t offset;
+    size_t written;           /* by earlier short completions; the rest is in flight */
+    void (*done)(void *context, int result);
+    void *context;
+};
+
+struct writer_ring
+{
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+struct dump_writer
+{
+    struct dump_output *out;
+    struct page_arena *arena;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+    struct writer_request requests[WRITER_SLOTS];
+    unsigned int in_flight;
+    unsigned int queue[WRITER_SLOTS], queue_head, queue_count; /* fallback FIFO */
+    uint64_t offset;          /* end of the image after the submitted writes */
+    uint64_t since_sync;
+    int failed;
+    int stopping;
+    struct writer_ring ring;
+    struct writer_stats stats;
+};
+
+static int ring_setup(struct writer_ring *ring, unsigned int entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if( ring->fd < 0 )
+        return EXIT_FAILURE;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if( p.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if( ring->cq_len > ring->sq_len )
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = ring->sq_ptr;
+    if( ring->sq_ptr != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP) )
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if( ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED )
+    {
+        fprintf(stderr, "unable to map the io_uring rings: %s\n", strerror(errno));
+        close(ring->fd);
+        return EXIT_FAILURE;
+    }
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_free(struct writer_ring *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if( ring->cq_ptr != ring->sq_ptr )
+        munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+/* queues one entry and hands it to the kernel; called with the writer lock held */
+static int ring_submit(struct writer_ring *ring, const struct io_uring_sqe *entry)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    int ret;
+
+    ring->sqes[index] = *entry;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    while( ret < 0 && errno == EINTR );
+    return ret == 1 ? 0 : EXIT_FAILURE;
+}
+
+/* registers every arena buffer, so writes from them can use IORING_OP_WRITE_FIXED */
+static int ring_register(struct writer_ring *ring, const struct page_arena *arena)
+{
+    struct iovec *iov = malloc(arena->count * sizeof(*iov));
+    int ret;
+
+    if( iov == NULL )
+        return EXIT_FAILURE;
+    for(unsigned int k = 0; k < arena->count; k++)
+    {
+        iov[k].iov_base = arena_buffer(arena, k);
+        iov[k].iov_len = arena->buffer_size;
+    }
+    ret = (int)syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, arena->count);
+    free(iov);
+    return ret == 0 ? 0 : EXIT_FAILURE;
+}
+
+static int writer_issue(struct dump_writer *w, unsigned int k);
+
+/* completes a request; called without the writer lock. res is the io_uring
+ * result: bytes written, or a negative errno. A short write is resubmitted for
+ * the rest; only a write that makes no progress fails */
+static void writer_complete(struct dump_writer *w, unsigned int k, int res)
+{
+    struct writer_request request;
+    int result;
+
+    /* the submitter filled in the request under the lock */
+    pthread_mutex_lock(&w->lock);
+    if( res > 0 && !w->requests[k].sync && w->requests[k].written + res < w->requests[k].length )
+    {
+        w->requests[k].written += res;
+        w->stats.resubmits++;
+        if( writer_issue(w, k) == 0 )
+        {
+            pthread_mutex_unlock(&w->lock);
+            return;
+        }
+        res = -EIO; /* the rest could not be queued */
+    }
+    request = w->requests[k];
+    pthread_mutex_unlock(&w->lock);
+
+    if( res < 0 )
+        result = res;
+    else
+        result = request.sync || request.written + res == request.length ? 0 : 1; /* 1: short write */
+    /* a data sync on something that cannot be synced (e.g. /dev/null) is not an error */
+    if( request.sync && (result == -EINVAL || result == -EROFS) )
+        result = 0;
+    if( result != 0 )
+        fprintf(stderr, "Failed to %s the dump file: %s\n", request.sync ? "sync" : "write",
+            result < 0 ? strerror(-result) : "short write");
+    if( request.done )
+        request.done(request.context, result);
+
+    pthread_mutex_lock(&w->lock);
+    if( result != 0 )
+        w->failed = 1;
+    w->requests[k].busy = 0;
+    w->in_flight--;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void *writer_reaper(void *arg)
+{
+    struct dump_writer *w = arg;
+    struct writer_ring *ring = &w->ring;
+
+    rt_apply_role(RT_ROLE_WRITER, 0);
+    for(;;)
+    {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if( head == tail )
+        {
+            syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        for(; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            if( user_data == WRITER_STOP )
+                return NULL;
+            writer_complete(w, (unsigned int)user_data, res);
+        }
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    struct dump_writer *w = arg;
+
+    rt_apply_role(RT_ROLE_WRITER, 0);
+    for(;;)
+    {
+        struct writer_request *request;
+        unsigned int k;
+        int result = 0; /* bytes written or -errno, like an io_uring completion */
+
+        pthread_mutex_lock(&w->lock);
+        while( w->queue_count == 0 && !w->stopping )
+            pthread_cond_wait(&w->changed, &w->lock);
+        if( w->queue_count == 0 )
+        {
+            pthread_mutex_unlock(&w->lock);
+            return NULL;
+        }
+        k = w->queue[w->queue_head];
+        w->queue_head = (w->queue_head + 1) % WRITER_SLOTS;
+        w->queue_count--;
+        pthread_mutex_unlock(&w->lock);
+
+        request = &w->requests[k];
+        if( request->sync )
+            result = fdatasync(w->out->fd) == 0 ? 0 : -errno;
+        for(size_t done = 0; !request->sync && result >= 0 && (size_t)result < request->length; )
+        {
+            ssize_t n = pwrite(w->out->fd, request->data + done, request->length - done,
+                request->offset + done);
+
+            if( n < 0 && errno == EINTR )
+                continue;
+            if( n < 0 )
+            {
+                result = -errno;
+                break;
+            }
+            if( n == 0 )
+                break; /* short write */
+            done += n;
+            result = (int)done;
+        }
+        writer_complete(w, k, result);
+    }
+}
+
+/* takes a free request slot, waiting while WRITER_DEPTH writes are in flight;
+ * called with the writer lock held */
+static unsigned int writer_slot(struct dump_writer *w, int sync)
+{
+    unsigned int k;
+
+    while( w->in_flight >= (sync ? WRITER_SLOTS : WRITER_DEPTH) )
+        pthread_cond_wait(&w->changed, &w->lock);
+    for(k = 0; w->requests[k].busy; k++)
+        ;
+    w->requests[k].busy = 1;
+    w->in_flight++;
+    if( w->in_flight > w->stats.max_in_flight )
+        w->stats.max_in_flight = w->in_flight;
+    return k;
+}
+
+/* hands a request to the ring or the writer thread; called with the lock held */
+static int writer_issue(struct dump_writer *w, unsigned int k)
+{
+    struct writer_request *request = &w->requests[k];
+    struct io_uring_sqe entry;
+
+    if( !w->stats.uring )
+    {
+        w->queue[(w->queue_head + w->queue_count) % WRITER_SLOTS] = k;
+        w->queue_count++;
+        pthread_cond_broadcast(&w->changed);
+        return 0;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.fd = w->out->fd;
+    entry.user_data = k;
+    if( request->sync )
+    {
+        /* behind all writes submitted so far */
+        entry.opcode = IORING_OP_FSYNC;
+        entry.fsync_flags = IORING_FSYNC_DATASYNC;
+        entry.flags = IOSQE_IO_DRAIN;
+    }
+    else
+    {
+        const unsigned char *base = w->stats.registered ? arena_buffer(w->arena, 0) : NULL;
+        size_t index = base ? (size_t)(request->data - base) / w->arena->buffer_size : 0;
+
+        /* the rest of the request after a short completion */
+        entry.opcode = IORING_OP_WRITE;
+        entry.off = request->offset + request->written;
+        entry.addr = (uintptr_t)(request->data + request->written);
+        entry.len = (unsigned)(request->length - request->written);
+        if( base && request->data >= base && index < w->arena->count
+            && request->data + request->length <= arena_buffer(w->arena, index) + w->arena->buffer_size )
+        {
+            entry.opcode = IORING_OP_WRITE_FIXED;
+            entry.buf_index = (uint16_t)index;
+        }
+    }
+    return ring_submit(&w->ring, &entry);
+}
+
+static void writer_release(struct dump_writer *w, unsigned int k)
+{
+    w->requests[k].busy = 0;
+    w->in_flight--;
+    w->failed = 1;
+}
+
+/* a data sync behind everything written so far; called with the lock held */
+static int writer_checkpoint(struct dump_writer *w)
+{
+    unsigned int k = writer_slot(w, 1);
+
+    w->requests[k].sync = 1;
+    w->requests[k].done = NULL;
+    w->since_sync = 0;
+    w->stats.syncs++;
+    if( writer_issue(w, k) != 0 )
+    {
+        writer_release(w, k);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+/* arena: the buffers most writes come from (registered with io_uring), may be NULL */
+struct dump_writer *writer_create(struct dump_output *out, struct page_arena *arena)
+{
+    struct dump_writer *w = calloc(1, sizeof(*w));
+    int ret;
+
+    if( w == NULL )
+        return NULL;
+    w->out = out;
+    w->arena = arena;
+    w->offset = out->end;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->changed, NULL);
+
+    if( ring_setup(&w->ring, 2 * WRITER_SLOTS) == 0 )
+    {
+        w->stats.uring = 1;
+        w->stats.registered = arena && ring_register(&w->ring, arena) == 0;
+        ret = pthread_create(&w->thread, NULL, writer_reaper, w);
+    }
+    else
+    {
+        fprintf(stderr, "io_uring not available (%s), using a writer thread\n", strerror(errno));
+        ret = pthread_create(&w->thread, NULL, writer_thread, w);
+    }
+    if( ret != 0 )
+    {
+        fprintf(stderr, "unable to start the image writer\n");
+        if( w->stats.uring )
+            ring_free(&w->ring);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* appends the data to the image in the background; done(context, result) runs
+ * once the buffer can be reused (result 0: written) */
+int writer_submit(struct dump_writer *w, const unsigned char *data, size_t length,
+    void (*done)(void *context, int result), void *context)
+{
+    unsigned int k;
+    int ret = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if( w->out->direct && ((uintptr_t)data % ARENA_ALIGN != 0 || length % ARENA_ALIGN != 0) )
+    {
+        while( w->in_flight > 0 )
+            pthread_cond_wait(&w->changed, &w->lock);
+        if( output_set_buffered(w->out) != 0 )
+            w->failed = 1;
+    }
+    if( w->failed )
+    {
+        pthread_mutex_unlock(&w->lock);
+        return EXIT_FAILURE;
+    }
+
+    k = writer_slot(w, 0);
+    w->requests[k].sync = 0;
+    w->requests[k].data = data;
+    w->requests[k].length = length;
+    w->requests[k].offset = w->offset;
+    w->requests[k].written = 0;
+    w->requests[k].done = done;
+    w->requests[k].context = context;
+    w->offset += length;
+    w->since_sync += length;
+    w->out->written += length;
+    w->out->end += length;
+    w->stats.writes++;
+    if( writer_issue(w, k) != 0 )
+    {
+        fprintf(stderr, "Failed to queue a write of the dump file.\n");
+        writer_release(w, k);
+        ret = EXIT_FAILURE;
+    }
+    else if( w->since_sync >= WRITER_SYNC_BYTES )
+        ret = writer_checkpoint(w);
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/* waits for all writes, syncs the image once more and stops the writer;
+ * returns EXIT_FAILURE if any write failed */
+int writer_finish(struct dump_writer *w, struct writer_stats *stats)
+{
+    struct io_uring_sqe entry;
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    if( w->since_sync > 0 && !w->failed )
+        writer_checkpoint(w);
+    while( w->in_flight > 0 )
+        pthread_cond_wait(&w->changed, &w->lock);
+    w->stopping = 1;
+    pthread_cond_broadcast(&w->changed);
+    if( w->stats.uring )
+    {
+        memset(&entry, 0, sizeof(entry));
+        entry.opcode = IORING_OP_NOP;
+        entry.user_data = WRITER_STOP;
+        ring_submit(&w->ring, &entry);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+    if( w->stats.uring )
+        ring_free(&w->ring);
+
+    ret = w->failed ? EXIT_FAILURE : 0;
+    if( stats )
+        *stats = w->stats;
+    free(w);
+    return ret;
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ * Copyright (c) 2018 maehw.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file writer.h
+ * \brief Asynchronous image writer (io_uring, or a writer thread as fallback)
+ * Writes are appended to the image in submission order but run in the
+ * background, up to WRITER_DEPTH at a time; the completion callback tells
+ * the caller when its buffer is free again. With io_uring (set up through the
+ * raw system calls) the buffers of the page arena are registered with the
+ * ring, so the kernel does not map them for every write, and an fdatasync is
+ * queued behind every WRITER_SYNC_BYTES of data instead of after each write.
+ * Where io_uring is not available (old kernel, seccomp) a single writer
+ * thread does the same with pwrite() and fdatasync().
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WRITER_DEPTH      8
+#define WRITER_SYNC_BYTES (64ull * 1024 * 1024)
+
+struct dump_output;
+struct page_arena;
+
+struct writer_stats
+{
+    int uring;            /* 1: io_uring, 0: writer thread */
+    int registered;       /* arena buffers registered with the ring */
+    uint64_t writes;
+    uint64_t syncs;
+    uint64_t resubmits;   /* rests of short io_uring writes */
+    unsigned int max_in_flight;
+};
+
+struct dump_writer;
+
+struct dump_writer *writer_create(struct dump_output *out, struct page_arena *arena);
+int writer_submit(struct dump_writer *w, const unsigned char *data, size_t length,
+    void (*done)(void *context, int result), void *context);
+int writer_finish(struct dump_writer *w, struct writer_stats *stats);
+
+#endif /* WRITER_H */